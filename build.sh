@@ -1,3 +1,27 @@
 #!/bin/bash
 
-gcc -g src/main.c -o build/main -O0  -std=c99 -Wno-missing-braces -L ./lib/ -lraylib
+# ./build.sh [debug|release] [rope]
+#   debug   -- -O0 with symbols, the default
+#   release -- optimized, asserts off
+#   rope    -- keep the page in the rope backend instead of the gap buffer
+#
+# The editing core (src/core.c) does not need raylib and ends up in
+# build/libneo_note_core.a, the window is a thin front end linked against it.
+# build/replay runs input traces against the core without a window,
+# build/bench times the gap buffer primitives (./build.sh release for numbers).
+MODE="-g -O0"
+FLAGS=""
+for arg in "$@"; do
+  case "$arg" in
+    debug) MODE="-g -O0" ;;
+    release) MODE="-O2 -DNDEBUG" ;;
+    rope) FLAGS="-DNEO_NOTE_ROPE" ;;
+  esac
+done
+
+mkdir -p build
+gcc -c src/core.c -o build/core.o $MODE -std=c99 -Wno-missing-braces -pthread $FLAGS || exit 1
+ar rcs build/libneo_note_core.a build/core.o || exit 1
+gcc src/replay.c -o build/replay $MODE -std=c99 -Wno-missing-braces -pthread $FLAGS -L ./build/ -lneo_note_core || exit 1
+gcc src/bench.c -o build/bench $MODE -std=c99 -Wno-missing-braces -pthread $FLAGS -L ./build/ -lneo_note_core || exit 1
+gcc src/main.c -o build/main $MODE -std=c99 -Wno-missing-braces -pthread $FLAGS -L ./build/ -lneo_note_core -L ./lib/ -lraylib
@@ -0,0 +1,849 @@
+#include "core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Times the gap buffer primitives one by one, so a change to the data
+// structures can be checked against numbers instead of a feeling.
+//
+//   ./build/bench [options] [benchmark...]
+//     --line N      line length in bytes for the line benchmarks
+//     --page N      lines in the page for the page benchmarks
+//     --gap N       gap size the buffers start with
+//     --pattern P   sequential, random or alternate
+//     --ops N       run exactly N operations instead of BENCH_MIN_MS
+//
+// Without options every benchmark runs over a small grid of sizes. Output is
+// CSV on stdout, one row per run:
+//   benchmark,pattern,size,gap,ops,ns_per_op,bytes_per_op
+// bytes_per_op counts what got memmoved or copied, for the gap moves that is
+// the distance times the element size, for the rest also what expand_gap and
+// the arena copied on a grow. walk_lines copies the text of a line out like
+// a render of its row does, find_line and the regex ones count the bytes
+// they read.
+
+#define BENCH_MIN_MS 50.0
+#define BENCH_MIN_OPS 100
+#define BENCH_MAX_BATCH 4096
+#define BENCH_EXPAND_BATCH 64
+
+typedef enum
+{
+  PATTERN_SEQUENTIAL,
+  PATTERN_RANDOM,
+  PATTERN_ALTERNATE,
+  PATTERN_COUNT,
+} Pattern;
+
+const char *pattern_names[PATTERN_COUNT] = {
+  "sequential",
+  "random",
+  "alternate",
+};
+
+typedef struct
+{
+  int size;
+  int gap;
+  Pattern pattern;
+  long ops;
+
+  // Results
+  long done;
+  double ms;
+  double bytes;
+} Run;
+
+typedef struct
+{
+  const char *name;
+  // Line or page benchmark, picks which sizes the grid hands it
+  int page;
+  void (*run) (Run *run);
+} Benchmark;
+
+// =============================================================================
+// === Helpers
+// =============================================================================
+
+// Keeps the compiler from dropping reads nothing looks at
+volatile long walk_sink;
+
+// Same sequence on every run, so two builds see the same jumps
+unsigned int random_state = 2463534242u;
+
+unsigned int
+next_random (void)
+{
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+// Where the gap goes for operation op, 0 .. length
+int
+pattern_position (Pattern pattern, long op, int length)
+{
+  switch (pattern)
+  {
+  case PATTERN_SEQUENTIAL:
+    return op % (length + 1);
+  case PATTERN_RANDOM:
+    return next_random () % (length + 1);
+  case PATTERN_ALTERNATE:
+  default:
+    return op % 2 == 0 ? 0 : length;
+  }
+}
+
+int
+keep_running (Run *run)
+{
+  if (run->ops > 0)
+    return run->done < run->ops;
+  return run->ms < BENCH_MIN_MS || run->done < BENCH_MIN_OPS;
+}
+
+// How many operations the next timed batch may do, batches start small and
+// double so slow runs stop soon after BENCH_MIN_OPS
+long
+batch_size (Run *run, long batch)
+{
+  if (batch > run->done + 16)
+    batch = run->done + 16;
+  if (run->ops > 0 && run->ops - run->done < batch)
+    return run->ops - run->done;
+  return batch;
+}
+
+// Half of the line or page, the batches that grow or shrink it start over
+// from a fresh one after that
+long
+half_batch (Run *run)
+{
+  long batch = run->size / 2;
+  if (batch < 1)
+    batch = 1;
+  if (batch > BENCH_MAX_BATCH)
+    batch = BENCH_MAX_BATCH;
+  return batch;
+}
+
+long
+gap_distance (int from, int to, size_t element_size)
+{
+  return (from > to ? from - to : to - from) * (long)element_size;
+}
+
+GapBufferLine *
+filled_line (Arena *arena, int length, int gap)
+{
+  // Room for all of it up front, so the gap is still gap long afterwards
+  GapBufferLine *gbl
+      = init_gap_buffer_line (arena, INIT_SIZE_LINE, length + gap);
+  for (int i = 0; i < length; i++)
+    insert_single_char (gbl, 'a' + i % 26, GAP_START);
+  return gbl;
+}
+
+// A note as it is after load_page and a look at every line: lines 0 to 71
+// long, made the way materialize_line and split_gap_buffer_line make them
+GapBufferPage *
+note_page (Arena *arena, int lines, int gap)
+{
+  char text[72];
+  for (int c = 0; c < (int)sizeof (text); c++)
+    text[c] = 'a' + c % 26;
+
+  GapBufferPage *gbp = init_gap_buffer_page (arena, 0, gap);
+  for (int i = 0; i < lines; i++)
+  {
+    int length = i * 37 % 72;
+    GapBufferLine *gbl
+        = init_gap_buffer_line (arena, length + INIT_SIZE_LINE, GAP_SIZE);
+    memcpy (gbl->buffer + gbl->gap_end + 1, text, length);
+    insert_line_at_row (gbp, gbl, i);
+  }
+  return gbp;
+}
+
+GapBufferPage *
+filled_page (Arena *arena, int lines, int gap)
+{
+  GapBufferPage *gbp = init_gap_buffer_page (arena, 0, gap);
+  for (int i = 0; i < lines; i++)
+    insert_line_at_row (
+        gbp,
+        init_gap_buffer_line (arena, INIT_SIZE_LINE, GAP_SIZE),
+        i);
+  return gbp;
+}
+
+// =============================================================================
+// === Gap Buffer
+// =============================================================================
+
+void
+run_move_gap (Run *run, GAP_POSITION gap_pos)
+{
+  int buf_size = run->size + run->gap;
+  char *buffer = malloc (buf_size);
+  memset (buffer, 'a', buf_size);
+  GapBuffer gb = { buffer, 0, run->gap - 1, buf_size, NULL };
+
+  while (keep_running (run))
+  {
+    long count = batch_size (run, BENCH_MAX_BATCH);
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+    {
+      int from = gb.gap_start;
+      int to = pattern_position (run->pattern, run->done + i, run->size);
+      if (gap_pos == GAP_START)
+        move_gap_start (&gb, to, sizeof (char));
+      else
+        move_gap_end (&gb, to + run->gap - 1, sizeof (char));
+      run->bytes += gap_distance (from, gb.gap_start, sizeof (char));
+    }
+    run->ms += now_ms () - start;
+    run->done += count;
+  }
+
+  free (buffer);
+}
+
+void
+run_move_gap_start (Run *run)
+{
+  run_move_gap (run, GAP_START);
+}
+
+void
+run_move_gap_end (Run *run)
+{
+  run_move_gap (run, GAP_END);
+}
+
+// Every operation grows a buffer whose gap is full, a batch of them is set up
+// outside of the clock first
+void
+run_expand_gap (Run *run)
+{
+  CapacityPolicy policy = line_capacity;
+  GapBuffer buffers[BENCH_EXPAND_BATCH];
+
+  while (keep_running (run))
+  {
+    Arena *arena = init_arena ();
+    long count = batch_size (run, BENCH_EXPAND_BATCH);
+    for (long i = 0; i < count; i++)
+    {
+      int buf_size = run->size + run->gap;
+      int at = pattern_position (run->pattern, run->done + i, run->size);
+      char *buffer = arena_alloc (arena, buf_size);
+      memset (buffer, 'a', buf_size);
+      buffers[i]
+          = (GapBuffer){ buffer, at, at + run->gap - 1, buf_size, arena };
+    }
+
+    policy.bytes_copied = 0;
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+      expand_gap (&buffers[i], run->gap + 1, sizeof (char), &policy);
+    run->ms += now_ms () - start;
+    run->bytes += policy.bytes_copied;
+    run->done += count;
+
+    free_arena (arena);
+  }
+}
+
+// =============================================================================
+// === Gap Kernels
+// =============================================================================
+// The same moves and grows as above through the kernels stamped out for chars
+// and line pointers, next to the generic ones they replaced in the editor
+
+void
+run_move_gap_chars (Run *run, GAP_POSITION gap_pos)
+{
+  int buf_size = run->size + run->gap;
+  GapBufferLine *gbl = calloc (1, sizeof (GapBufferLine));
+  gbl->buffer = malloc (buf_size);
+  memset (gbl->buffer, 'a', buf_size);
+  gbl->gap_end = run->gap - 1;
+  gbl->buf_size = buf_size;
+
+  while (keep_running (run))
+  {
+    long count = batch_size (run, BENCH_MAX_BATCH);
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+    {
+      int from = gbl->gap_start;
+      int to = pattern_position (run->pattern, run->done + i, run->size);
+      if (gap_pos == GAP_START)
+        move_gap_start_chars (gbl, to);
+      else
+        move_gap_end_chars (gbl, to + run->gap - 1);
+      run->bytes += gap_distance (from, gbl->gap_start, sizeof (char));
+    }
+    run->ms += now_ms () - start;
+    run->done += count;
+  }
+
+  free (gbl->buffer);
+  free (gbl);
+}
+
+void
+run_move_gap_start_chars (Run *run)
+{
+  run_move_gap_chars (run, GAP_START);
+}
+
+void
+run_move_gap_end_chars (Run *run)
+{
+  run_move_gap_chars (run, GAP_END);
+}
+
+// The page gap without the line index, generic with the pointer size or
+// through the kernel
+void
+run_move_gap_pointers (Run *run, int kernel)
+{
+  Arena *arena = init_arena ();
+  GapBufferPage *gbp = filled_page (arena, run->size, run->gap);
+  move_gap_page (gbp, 0, GAP_START);
+  GapBuffer gb = {
+    (char *)gbp->buffer, gbp->gap_start, gbp->gap_end, gbp->buf_size, arena
+  };
+
+  while (keep_running (run))
+  {
+    long count = batch_size (run, BENCH_MAX_BATCH);
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+    {
+      int from = kernel ? gbp->gap_start : gb.gap_start;
+      int to = pattern_position (run->pattern, run->done + i, run->size);
+      if (kernel)
+        move_gap_start_lines (gbp, to);
+      else
+        move_gap_start (&gb, to, sizeof (GapBufferLine *));
+      run->bytes += gap_distance (from, to, sizeof (GapBufferLine *));
+    }
+    run->ms += now_ms () - start;
+    run->done += count;
+  }
+
+  free_arena (arena);
+}
+
+void
+run_move_gap_start_pointers (Run *run)
+{
+  run_move_gap_pointers (run, 0);
+}
+
+void
+run_move_gap_start_lines (Run *run)
+{
+  run_move_gap_pointers (run, 1);
+}
+
+void
+run_expand_gap_chars (Run *run)
+{
+  CapacityPolicy policy = line_capacity;
+  GapBufferLine *lines[BENCH_EXPAND_BATCH];
+
+  while (keep_running (run))
+  {
+    Arena *arena = init_arena ();
+    long count = batch_size (run, BENCH_EXPAND_BATCH);
+    for (long i = 0; i < count; i++)
+    {
+      int buf_size = run->size + run->gap;
+      int at = pattern_position (run->pattern, run->done + i, run->size);
+      lines[i] = arena_alloc (arena, sizeof (GapBufferLine));
+      memset (lines[i], 0, sizeof (GapBufferLine));
+      lines[i]->buffer = arena_alloc (arena, buf_size);
+      memset (lines[i]->buffer, 'a', buf_size);
+      lines[i]->gap_start = at;
+      lines[i]->gap_end = at + run->gap - 1;
+      lines[i]->buf_size = buf_size;
+      lines[i]->arena = arena;
+    }
+
+    policy.bytes_copied = 0;
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+      expand_gap_chars (lines[i], run->gap + 1, &policy);
+    run->ms += now_ms () - start;
+    run->bytes += policy.bytes_copied;
+    run->done += count;
+
+    free_arena (arena);
+  }
+}
+
+// =============================================================================
+// === Gap Buffer Line
+// =============================================================================
+
+// Typing: move the gap, put a char in
+void
+run_insert_single_char (Run *run)
+{
+  long batch = half_batch (run);
+
+  while (keep_running (run))
+  {
+    Arena *arena = init_arena ();
+    GapBufferLine *gbl = filled_line (arena, run->size, run->gap);
+    long count = batch_size (run, batch);
+
+    long copied = line_capacity.bytes_copied;
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+    {
+      int from = gbl->gap_start;
+      int to = pattern_position (
+          run->pattern,
+          run->done + i,
+          line_length (gbl));
+      move_gap_line (gbl, to, GAP_START);
+      insert_single_char (gbl, 'x', GAP_START);
+      run->bytes += gap_distance (from, to, sizeof (char));
+    }
+    run->ms += now_ms () - start;
+    run->bytes += line_capacity.bytes_copied - copied;
+    run->done += count;
+
+    free_arena (arena);
+  }
+}
+
+// Backspace: move the gap, take the char in front of it
+void
+run_delete_single_char (Run *run)
+{
+  long batch = half_batch (run);
+
+  while (keep_running (run))
+  {
+    Arena *arena = init_arena ();
+    GapBufferLine *gbl = filled_line (arena, run->size, run->gap);
+    long count = batch_size (run, batch);
+
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+    {
+      int from = gbl->gap_start;
+      int to = pattern_position (
+          run->pattern,
+          run->done + i,
+          line_length (gbl));
+      move_gap_line (gbl, to, GAP_START);
+      delete_single_char (gbl, GAP_START);
+      run->bytes += gap_distance (from, to, sizeof (char));
+    }
+    run->ms += now_ms () - start;
+    run->done += count;
+
+    free_arena (arena);
+  }
+}
+
+// =============================================================================
+// === Gab Buffer Page
+// =============================================================================
+
+void
+run_move_gap_page (Run *run)
+{
+  Arena *arena = init_arena ();
+  GapBufferPage *gbp = filled_page (arena, run->size, run->gap);
+  move_gap_page (gbp, 0, GAP_START);
+
+  while (keep_running (run))
+  {
+    long count = batch_size (run, 1024);
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+    {
+      int from = gbp->gap_start;
+      int to = pattern_position (run->pattern, run->done + i, run->size);
+      move_gap_page (gbp, to, GAP_START);
+      run->bytes += gap_distance (from, to, sizeof (GapBufferLine *));
+    }
+    run->ms += now_ms () - start;
+    run->done += count;
+  }
+
+  free_arena (arena);
+}
+
+// What rendering does with every row: find the line and copy its text out
+void
+run_walk_lines (Run *run)
+{
+  Arena *arena = init_arena ();
+  GapBufferPage *gbp = note_page (arena, run->size, run->gap);
+  int gap_size = gbp->gap_end - gbp->gap_start + 1;
+  char text[128];
+  long sum = 0;
+
+  while (keep_running (run))
+  {
+    long count = batch_size (run, BENCH_MAX_BATCH);
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+    {
+      int row = pattern_position (run->pattern, run->done + i, run->size - 1);
+      int slot = row < gbp->gap_start ? row : row + gap_size;
+      LineView view = line_view (gbp->map, gbp->buffer[slot]);
+      memcpy (text, view.before, view.before_size);
+      memcpy (text + view.before_size, view.after, view.after_size);
+      sum += text[0];
+      run->bytes += view.before_size + view.after_size;
+    }
+    run->ms += now_ms () - start;
+    run->done += count;
+  }
+
+  free_arena (arena);
+  walk_sink += sum;
+}
+
+// New lines at pattern rows, the lines themselves are made before the clock
+// starts
+void
+run_insert_single_line (Run *run)
+{
+  long batch = half_batch (run);
+  GapBufferLine **lines = malloc (batch * sizeof (GapBufferLine *));
+
+  while (keep_running (run))
+  {
+    Arena *arena = init_arena ();
+    GapBufferPage *gbp = filled_page (arena, run->size, run->gap);
+    long count = batch_size (run, batch);
+    for (long i = 0; i < count; i++)
+      lines[i] = init_gap_buffer_line (arena, INIT_SIZE_LINE, GAP_SIZE);
+
+    long copied = page_capacity.bytes_copied;
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+    {
+      int gap_size = gbp->gap_end - gbp->gap_start + 1;
+      int rows = gbp->buf_size - gap_size;
+      int row = pattern_position (run->pattern, run->done + i, rows);
+      int from = gbp->gap_start;
+
+      // insert_single_line wants a slot and puts the line before it, the
+      // row past the last line can only be reached as after the last one
+      if (row == rows && rows > 0)
+      {
+        int last = rows - 1;
+        int slot = last < gbp->gap_start ? last : last + gap_size;
+        insert_single_line (gbp, lines[i], slot, AFTER);
+      }
+      else
+      {
+        int slot = row < gbp->gap_start ? row : row + gap_size;
+        insert_single_line (gbp, lines[i], slot, BEFORE);
+      }
+      run->bytes += gap_distance (from, row, sizeof (GapBufferLine *));
+    }
+    run->ms += now_ms () - start;
+    run->bytes += page_capacity.bytes_copied - copied;
+    run->done += count;
+
+    free_arena (arena);
+  }
+
+  free (lines);
+}
+
+// =============================================================================
+// === Search
+// =============================================================================
+
+// A query that is not in the line, so every op reads all of it. Its first
+// byte shows up every 26 bytes, which keeps the filter honest.
+void
+run_find_line (Run *run)
+{
+  Arena *arena = init_arena ();
+  GapBufferLine *gbl = filled_line (arena, run->size, run->gap);
+  LineView view = line_view (NULL, gbl);
+  long sum = 0;
+
+  while (keep_running (run))
+  {
+    long count = batch_size (run, BENCH_MAX_BATCH);
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+      sum += find_in_view (view, 0, "zebra", 5);
+    run->ms += now_ms () - start;
+    run->bytes += (double)count * run->size;
+    run->done += count;
+  }
+
+  free_arena (arena);
+  walk_sink += sum;
+}
+
+// Task ids and due dates, what notes get grepped for
+#define BENCH_REGEX "#[0-9a-f]{8}|due:[0-9-]+"
+
+// The end of a match of the program from pc at at, -1 if there is none.
+// Tries one way after the other like an engine without a DFA.
+int
+backtrack (
+    RegexInst *program,
+    int pc,
+    const unsigned char *text,
+    int at,
+    int size)
+{
+  for (;;)
+  {
+    RegexInst *inst = &program[pc];
+    switch (inst->op)
+    {
+    case REGEX_RANGE:
+      if (at == size || text[at] < inst->low || text[at] > inst->high)
+        return -1;
+      at++;
+      break;
+    case REGEX_SPLIT:
+    {
+      int end = backtrack (program, inst->out, text, at, size);
+      if (end >= 0)
+        return end;
+      pc = inst->out1;
+      continue;
+    }
+    case REGEX_LINE_START:
+      if (at != 0)
+        return -1;
+      break;
+    case REGEX_LINE_END:
+      if (at != size)
+        return -1;
+      break;
+    case REGEX_MATCH:
+      return at;
+    }
+    pc = inst->out;
+  }
+}
+
+// BENCH_REGEX over a line it is not in, with the lazy DFA
+void
+run_regex_line (Run *run)
+{
+  Arena *arena = init_arena ();
+  GapBufferLine *gbl = filled_line (arena, run->size, run->gap);
+  LineView view = line_view (NULL, gbl);
+  Regex *regex = init_regex (arena);
+  regex_compile (regex, BENCH_REGEX, strlen (BENCH_REGEX));
+  long sum = 0;
+
+  while (keep_running (run))
+  {
+    long count = batch_size (run, BENCH_MAX_BATCH);
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+      sum += regex_starts (regex, view, 0);
+    run->ms += now_ms () - start;
+    run->bytes += (double)count * run->size;
+    run->done += count;
+  }
+
+  free_arena (arena);
+  walk_sink += sum;
+}
+
+// The same with backtracking from every byte. It wants the line in one
+// piece, filled_line has all of it in front of the gap.
+void
+run_backtrack_line (Run *run)
+{
+  Arena *arena = init_arena ();
+  GapBufferLine *gbl = filled_line (arena, run->size, run->gap);
+  LineView view = line_view (NULL, gbl);
+  const unsigned char *text = (const unsigned char *)view.before;
+  Regex *regex = init_regex (arena);
+  regex_compile (regex, BENCH_REGEX, strlen (BENCH_REGEX));
+  long sum = 0;
+
+  while (keep_running (run))
+  {
+    long count = batch_size (run, BENCH_MAX_BATCH);
+    double start = now_ms ();
+    for (long i = 0; i < count; i++)
+    {
+      for (int at = 0; at < view.before_size; at++)
+      {
+        int end = backtrack (
+            regex->program,
+            regex->forward.start,
+            text,
+            at,
+            view.before_size);
+        if (end >= 0)
+        {
+          sum++;
+          break;
+        }
+      }
+    }
+    run->ms += now_ms () - start;
+    run->bytes += (double)count * run->size;
+    run->done += count;
+  }
+
+  free_arena (arena);
+  walk_sink += sum;
+}
+
+// =============================================================================
+// === main
+// =============================================================================
+
+Benchmark benchmarks[] = {
+  { "move_gap_start", 0, run_move_gap_start },
+  { "move_gap_end", 0, run_move_gap_end },
+  { "expand_gap", 0, run_expand_gap },
+  { "move_gap_start_chars", 0, run_move_gap_start_chars },
+  { "move_gap_end_chars", 0, run_move_gap_end_chars },
+  { "expand_gap_chars", 0, run_expand_gap_chars },
+  { "insert_single_char", 0, run_insert_single_char },
+  { "delete_single_char", 0, run_delete_single_char },
+  { "move_gap_page", 1, run_move_gap_page },
+  { "move_gap_start_pointers", 1, run_move_gap_start_pointers },
+  { "move_gap_start_lines", 1, run_move_gap_start_lines },
+  { "insert_single_line", 1, run_insert_single_line },
+  { "walk_lines", 1, run_walk_lines },
+  { "find_line", 0, run_find_line },
+  { "regex_line", 0, run_regex_line },
+  { "backtrack_line", 0, run_backtrack_line },
+};
+#define BENCHMARK_COUNT (int)(sizeof (benchmarks) / sizeof (benchmarks[0]))
+
+// The grid when no size is given
+int line_sizes[] = { 80, 4096, 1 << 20 };
+int line_gaps[] = { GAP_SIZE, 64, 4096 };
+int page_sizes[] = { 1000, 100000 };
+int page_gaps[] = { GAP_SIZE, 1024 };
+
+void
+bench (Benchmark *benchmark, int size, int gap, Pattern pattern, long ops)
+{
+  Run run = { .size = size, .gap = gap, .pattern = pattern, .ops = ops };
+  random_state = 2463534242u;
+  benchmark->run (&run);
+
+  printf (
+      "%s,%s,%d,%d,%ld,%.2f,%.2f\n",
+      benchmark->name,
+      pattern_names[pattern],
+      size,
+      gap,
+      run.done,
+      run.done > 0 ? run.ms * 1e6 / run.done : 0,
+      run.done > 0 ? run.bytes / run.done : 0);
+  fflush (stdout);
+}
+
+int
+main (int argc, char **argv)
+{
+  int line = 0;
+  int page = 0;
+  int gap = 0;
+  int pattern = -1;
+  long ops = 0;
+  int selected[BENCHMARK_COUNT] = { 0 };
+  int any_selected = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp (argv[i], "--line") == 0 && i + 1 < argc)
+      line = atoi (argv[++i]);
+    else if (strcmp (argv[i], "--page") == 0 && i + 1 < argc)
+      page = atoi (argv[++i]);
+    else if (strcmp (argv[i], "--gap") == 0 && i + 1 < argc)
+      gap = atoi (argv[++i]);
+    else if (strcmp (argv[i], "--ops") == 0 && i + 1 < argc)
+      ops = atol (argv[++i]);
+    else if (strcmp (argv[i], "--pattern") == 0 && i + 1 < argc)
+    {
+      i++;
+      for (int p = 0; p < PATTERN_COUNT; p++)
+        if (strcmp (argv[i], pattern_names[p]) == 0)
+          pattern = p;
+      if (pattern < 0)
+      {
+        fprintf (stderr, "Unknown pattern %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else
+    {
+      int found = 0;
+      for (int b = 0; b < BENCHMARK_COUNT; b++)
+        if (strcmp (argv[i], benchmarks[b].name) == 0)
+          selected[b] = found = any_selected = 1;
+      if (!found)
+      {
+        fprintf (stderr, "Unknown benchmark %s\n", argv[i]);
+        return 1;
+      }
+    }
+  }
+
+  if (line < 0 || page < 0 || gap < 0)
+  {
+    fprintf (stderr, "Sizes can not be negative\n");
+    return 1;
+  }
+
+  printf ("benchmark,pattern,size,gap,ops,ns_per_op,bytes_per_op\n");
+  for (int b = 0; b < BENCHMARK_COUNT; b++)
+  {
+    if (any_selected && !selected[b])
+      continue;
+
+    Benchmark *benchmark = &benchmarks[b];
+    int *sizes = benchmark->page ? page_sizes : line_sizes;
+    int size_count = benchmark->page ? 2 : 3;
+    int *gaps = benchmark->page ? page_gaps : line_gaps;
+    int gap_count = benchmark->page ? 2 : 3;
+    int given_size = benchmark->page ? page : line;
+    if (given_size > 0)
+    {
+      sizes = &given_size;
+      size_count = 1;
+    }
+    if (gap > 0)
+    {
+      gaps = &gap;
+      gap_count = 1;
+    }
+
+    for (int s = 0; s < size_count; s++)
+      for (int g = 0; g < gap_count; g++)
+        for (int p = 0; p < PATTERN_COUNT; p++)
+          if (pattern < 0 || pattern == p)
+            bench (benchmark, sizes[s], gaps[g], p, ops);
+  }
+
+  return 0;
+}
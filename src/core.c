@@ -0,0 +1,6638 @@
+// TODO(rolf): Error handle all allocations
+#define _POSIX_C_SOURCE 200809L
+
+#include "core.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// =============================================================================
+// === Utilities
+// =============================================================================
+
+PositionInGapArray
+get_index_pos_in_gap_array (int index, int gap_start, int gap_end, int buf_size)
+{
+  if (index < 0)
+  {
+    return OUTSIDE_LEFT;
+  }
+  if (index > buf_size - 1)
+  {
+    return OUTSIDE_RIGHT;
+  }
+  if (index == gap_start - 1)
+  {
+    return GAP_MINUS_ONE;
+  }
+  if (index == gap_end + 1)
+  {
+    return GAP_PLUS_ONE;
+  }
+  if (index < gap_start)
+  {
+    return BEFORE_GAP;
+  }
+  if (index > gap_end)
+  {
+    return AFTER_GAP;
+  }
+  if (gap_start == 0)
+  {
+    return INSIDE_GAP_START;
+  }
+  return INSIDE_GAP_INBETWEEN;
+}
+
+void
+print_line (GapBufferLine *gbl)
+{
+  printf ("[");
+  for (int i = 0; i < gbl->buf_size; i++)
+  {
+    if (i < gbl->gap_start || i > gbl->gap_end)
+      printf ("%c", gbl->buffer[i]);
+    else if (i < gbl->buf_size - 1)
+      printf ("_");
+  }
+  printf ("]\n");
+}
+
+double
+now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// A page slot holds either a real line or, for files opened with load_page,
+// the number of a line in the mapped file tagged with the low bit. page_line
+// turns those into a GapBufferLine the first time a line is edited or the
+// cursor enters it, everything that only reads goes through a LineView.
+int
+line_is_mapped (GapBufferLine *gbl)
+{
+  return ((uintptr_t)gbl & 1) != 0;
+}
+
+GapBufferLine *
+mapped_line (size_t index)
+{
+  return (GapBufferLine *)((index << 1) | 1);
+}
+
+size_t
+mapped_line_index (GapBufferLine *gbl)
+{
+  return (uintptr_t)gbl >> 1;
+}
+
+LineView
+line_view (MappedFile *map, GapBufferLine *gbl)
+{
+  LineView view = { 0 };
+
+  if (line_is_mapped (gbl))
+  {
+    size_t index = mapped_line_index (gbl);
+    view.before = map->data + map->line_starts[index];
+    view.before_size
+        = map->line_starts[index + 1] - 1 - map->line_starts[index];
+    view.after = view.before + view.before_size;
+    return view;
+  }
+
+  view.before = gbl->buffer;
+  view.before_size = gbl->gap_start;
+  view.after = gbl->buffer + gbl->gap_end + 1;
+  view.after_size = gbl->buf_size - 1 - (gbl->gap_end + 1);
+  return view;
+}
+
+// What the line takes up in the saved file
+long
+line_bytes (MappedFile *map, GapBufferLine *gbl)
+{
+  LineView view = line_view (map, gbl);
+  return view.before_size + view.after_size + 1;
+}
+
+void
+print_page (GapBufferPage *gbp)
+{
+  printf ("[\n");
+  for (int i = 0; i < gbp->buf_size; i++)
+  {
+    if ((i < gbp->gap_start || i > gbp->gap_end)
+        && line_is_mapped (gbp->buffer[i]))
+    {
+      LineView view = line_view (gbp->map, gbp->buffer[i]);
+      printf ("[%.*s]\n", view.before_size, view.before);
+    }
+    else if (i < gbp->gap_start || i > gbp->gap_end)
+    {
+      print_line (gbp->buffer[i]);
+    }
+    else
+    {
+      printf ("_\n");
+    }
+  }
+  printf ("]\n");
+}
+
+// =============================================================================
+// === UTF-8
+// =============================================================================
+// Lines hold UTF-8 and a column is a byte offset into the line. A char is a
+// byte that is not a continuation byte plus the continuation bytes after it,
+// that way the cursor and the render agree on where chars start even in a
+// file that is not valid UTF-8. A char that does not decode is drawn as
+// UTF8_REPLACEMENT and saved back the way it was loaded.
+
+int
+utf8_is_continuation (char byte)
+{
+  return ((unsigned char)byte & 0xC0) == 0x80;
+}
+
+// Bytes of the char at the start of text, at most size
+int
+utf8_char_size (const char *text, int size)
+{
+  int length = 1;
+  while (length < size && utf8_is_continuation (text[length]))
+    length++;
+  return length;
+}
+
+// Decodes the sequence at the start of text and returns its size. Anything
+// that is not a valid sequence, overlong, a surrogate, past U+10FFFF or cut
+// off by size, is UTF8_REPLACEMENT and 1 byte.
+int
+utf8_decode (const char *text, int size, int *codepoint)
+{
+  const unsigned char *bytes = (const unsigned char *)text;
+  int length;
+  int value;
+  int min;
+
+  *codepoint = UTF8_REPLACEMENT;
+  if (bytes[0] < 0x80)
+  {
+    *codepoint = bytes[0];
+    return 1;
+  }
+  else if ((bytes[0] & 0xE0) == 0xC0)
+  {
+    length = 2;
+    value = bytes[0] & 0x1F;
+    min = 0x80;
+  }
+  else if ((bytes[0] & 0xF0) == 0xE0)
+  {
+    length = 3;
+    value = bytes[0] & 0x0F;
+    min = 0x800;
+  }
+  else if ((bytes[0] & 0xF8) == 0xF0)
+  {
+    length = 4;
+    value = bytes[0] & 0x07;
+    min = 0x10000;
+  }
+  else
+  {
+    return 1;
+  }
+
+  if (length > size)
+    return 1;
+  for (int i = 1; i < length; i++)
+  {
+    if (!utf8_is_continuation (text[i]))
+      return 1;
+    value = (value << 6) | (bytes[i] & 0x3F);
+  }
+  if (value < min || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF))
+    return 1;
+
+  *codepoint = value;
+  return length;
+}
+
+// Writes codepoint to out, which needs room for UTF8_MAX_SIZE bytes, and
+// returns how many it took. What is not a codepoint goes out as
+// UTF8_REPLACEMENT.
+int
+utf8_encode (int codepoint, char *out)
+{
+  if (codepoint < 0 || codepoint > 0x10FFFF
+      || (codepoint >= 0xD800 && codepoint <= 0xDFFF))
+    codepoint = UTF8_REPLACEMENT;
+
+  if (codepoint < 0x80)
+  {
+    out[0] = (char)codepoint;
+    return 1;
+  }
+  if (codepoint < 0x800)
+  {
+    out[0] = (char)(0xC0 | codepoint >> 6);
+    out[1] = (char)(0x80 | (codepoint & 0x3F));
+    return 2;
+  }
+  if (codepoint < 0x10000)
+  {
+    out[0] = (char)(0xE0 | codepoint >> 12);
+    out[1] = (char)(0x80 | (codepoint >> 6 & 0x3F));
+    out[2] = (char)(0x80 | (codepoint & 0x3F));
+    return 3;
+  }
+  out[0] = (char)(0xF0 | codepoint >> 18);
+  out[1] = (char)(0x80 | (codepoint >> 12 & 0x3F));
+  out[2] = (char)(0x80 | (codepoint >> 6 & 0x3F));
+  out[3] = (char)(0x80 | (codepoint & 0x3F));
+  return 4;
+}
+
+// Bytes from the start of text that are valid UTF-8, size if all of them are.
+// Runs of ASCII go 16 bytes at a time where SSE2 is around, only the chunks
+// with a high bit set get decoded.
+size_t
+utf8_valid_size (const char *text, size_t size)
+{
+  size_t i = 0;
+  while (i < size)
+  {
+#ifdef __SSE2__
+    // Straight to the first byte with its high bit set
+    while (i + 16 <= size)
+    {
+      __m128i chunk = _mm_loadu_si128 ((const __m128i *)(text + i));
+      unsigned int mask = _mm_movemask_epi8 (chunk);
+      if (mask != 0)
+      {
+        i += __builtin_ctz (mask);
+        break;
+      }
+      i += 16;
+    }
+    if (i == size)
+      break;
+#endif
+    if ((unsigned char)text[i] < 0x80)
+    {
+      i++;
+      continue;
+    }
+
+    int codepoint;
+    int left = size - i < UTF8_MAX_SIZE ? (int)(size - i) : UTF8_MAX_SIZE;
+    int length = utf8_decode (text + i, left, &codepoint);
+    // Every valid sequence past ASCII is at least 2 bytes
+    if (length == 1)
+      return i;
+    i += length;
+  }
+  return size;
+}
+
+// =============================================================================
+// === DEBUG
+// =============================================================================
+
+int count = 0;
+int
+render_line_debug (GapBufferLine *gbl, char *buffer, int pos, int cursor_pos)
+{
+  buffer[pos] = '[';
+  pos++;
+
+  for (int l = 0; l < gbl->buf_size; l++)
+  {
+    // Render Char/Gap;
+    if (l < gbl->gap_start || l > gbl->gap_end)
+    {
+      // Account for padding
+      if (l < gbl->buf_size - 1)
+      {
+        buffer[pos] = gbl->buffer[l];
+        pos++;
+      }
+      else if (l == gbl->buf_size - 1)
+      {
+        buffer[pos] = ':';
+        pos++;
+      }
+    }
+    else if (l < gbl->buf_size - 1)
+    {
+      buffer[pos] = '_';
+      pos++;
+    }
+
+    // Cursor
+    if (l == cursor_pos)
+    {
+      if (count++ % 2)
+      {
+        buffer[pos - 1] = (char)219;
+      }
+    }
+  }
+  buffer[pos] = ']';
+  pos++;
+  buffer[pos] = '\n';
+  pos++;
+
+  return pos;
+}
+
+int
+render_view_debug (LineView view, char *buffer, int pos)
+{
+  buffer[pos] = '[';
+  pos++;
+  memcpy (buffer + pos, view.before, view.before_size);
+  pos += view.before_size;
+  buffer[pos] = ':';
+  pos++;
+  buffer[pos] = ']';
+  pos++;
+  buffer[pos] = '\n';
+  pos++;
+
+  return pos;
+}
+
+void
+render_page_debug (Page *page, char *buffer, int size, Cursor c)
+{
+  int pos = 0;
+  buffer[pos] = '[';
+  pos++;
+  buffer[pos] = '\n';
+  pos++;
+
+#ifdef NEO_NOTE_ROPE
+  for (int slot = page_first_slot (page); slot >= 0;
+       slot = page_next_slot (page, slot))
+  {
+    GapBufferLine *gbl = page_line_entry (page, slot);
+    if (line_is_mapped (gbl))
+    {
+      LineView view = page_line_view (page, slot);
+      if (pos + view.before_size + 8 >= size)
+        break;
+      pos = render_view_debug (view, buffer, pos);
+      continue;
+    }
+    if (pos + gbl->buf_size + 8 >= size)
+      break;
+    pos = render_line_debug (
+        gbl,
+        buffer,
+        pos,
+        slot == c.line ? c.pos : -1);
+  }
+#else
+  for (int i = 0; i < page->buf_size; i++)
+  {
+    if (i < page->gap_start || i > page->gap_end)
+    {
+      GapBufferLine *gbl = page->buffer[i];
+      if (line_is_mapped (gbl))
+      {
+        LineView view = line_view (page->map, gbl);
+        if (pos + view.before_size + 8 >= size)
+          break;
+        pos = render_view_debug (view, buffer, pos);
+        continue;
+      }
+      if (pos + gbl->buf_size + 8 >= size)
+        break;
+      pos = render_line_debug (gbl, buffer, pos, i == c.line ? c.pos : -1);
+    }
+    else
+    {
+      if (pos + 8 >= size)
+        break;
+      buffer[pos] = '_';
+      pos++;
+      buffer[pos] = '\n';
+      pos++;
+    }
+  }
+#endif
+  buffer[pos] = ']';
+  pos++;
+  buffer[pos] = '\n';
+  pos++;
+  buffer[pos] = '\0';
+}
+
+// =============================================================================
+// === Arena
+// =============================================================================
+// One arena per document. Small blocks (line headers, short line buffers,
+// rope nodes) are carved from big chunks and go to a free list per size
+// class when released, everything bigger is a plain malloc the arena keeps
+// track of. Closing the document is a single free_arena.
+// A NULL arena falls back to malloc/realloc/free.
+
+Arena *
+init_arena (void)
+{
+  Arena *arena = malloc (sizeof (Arena));
+  arena->chunks = NULL;
+  arena->large = NULL;
+  arena->live_bytes = 0;
+  arena->peak_bytes = 0;
+  arena->system_bytes = 0;
+  arena->allocs = 0;
+  arena->frees = 0;
+  for (int i = 0; i < ARENA_CLASS_COUNT; i++)
+  {
+    arena->free_lists[i] = NULL;
+  }
+
+  return arena;
+}
+
+void
+free_arena (Arena *arena)
+{
+  ArenaChunk *chunk = arena->chunks;
+  while (chunk != NULL)
+  {
+    ArenaChunk *next = chunk->next;
+    free (chunk);
+    chunk = next;
+  }
+
+  ArenaLarge *large = arena->large;
+  while (large != NULL)
+  {
+    ArenaLarge *next = large->next;
+    free (large);
+    large = next;
+  }
+
+  free (arena);
+}
+
+int
+arena_size_class (size_t size)
+{
+  int size_class = 0;
+  size_t block_size = ARENA_MIN_BLOCK;
+
+  while (block_size < size)
+  {
+    block_size <<= 1;
+    size_class++;
+  }
+
+  return size_class;
+}
+
+// How many bytes a request of size really gets
+size_t
+arena_block_size (Arena *arena, size_t size)
+{
+  if (arena == NULL || size > ARENA_MAX_BLOCK)
+    return size;
+
+  return (size_t)ARENA_MIN_BLOCK << arena_size_class (size);
+}
+
+void
+arena_count (Arena *arena, long bytes)
+{
+  arena->live_bytes += bytes;
+  if (arena->live_bytes > arena->peak_bytes)
+    arena->peak_bytes = arena->live_bytes;
+}
+
+void *
+arena_alloc (Arena *arena, size_t size)
+{
+  if (arena == NULL)
+    return malloc (size);
+
+  arena->allocs++;
+  arena_count (arena, arena_block_size (arena, size));
+
+  if (size > ARENA_MAX_BLOCK)
+  {
+    arena->system_bytes += sizeof (ArenaLarge) + size;
+    ArenaLarge *large = malloc (sizeof (ArenaLarge) + size);
+    large->size = size;
+    large->prev = NULL;
+    large->next = arena->large;
+    if (arena->large != NULL)
+      arena->large->prev = large;
+    arena->large = large;
+
+    return large + 1;
+  }
+
+  int size_class = arena_size_class (size);
+  ArenaFree *block = arena->free_lists[size_class];
+  if (block != NULL)
+  {
+    arena->free_lists[size_class] = block->next;
+    return block;
+  }
+
+  size_t block_size = (size_t)ARENA_MIN_BLOCK << size_class;
+  if (arena->chunks == NULL
+      || arena->chunks->used + block_size > ARENA_CHUNK_SIZE)
+  {
+    arena->system_bytes += sizeof (ArenaChunk) + ARENA_CHUNK_SIZE;
+    ArenaChunk *chunk = malloc (sizeof (ArenaChunk) + ARENA_CHUNK_SIZE);
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+
+  void *result = arena->chunks->data + arena->chunks->used;
+  arena->chunks->used += block_size;
+
+  return result;
+}
+
+void
+arena_free (Arena *arena, void *ptr, size_t size)
+{
+  if (ptr == NULL)
+    return;
+
+  if (arena == NULL)
+  {
+    free (ptr);
+    return;
+  }
+
+  arena->frees++;
+  arena_count (arena, -(long)arena_block_size (arena, size));
+
+  if (size > ARENA_MAX_BLOCK)
+  {
+    arena->system_bytes -= sizeof (ArenaLarge) + size;
+    ArenaLarge *large = (ArenaLarge *)ptr - 1;
+    if (large->prev != NULL)
+      large->prev->next = large->next;
+    else
+      arena->large = large->next;
+    if (large->next != NULL)
+      large->next->prev = large->prev;
+
+    free (large);
+    return;
+  }
+
+  int size_class = arena_size_class (size);
+  ArenaFree *block = ptr;
+  block->next = arena->free_lists[size_class];
+  arena->free_lists[size_class] = block;
+}
+
+void *
+arena_resize (Arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+  if (arena == NULL)
+    return realloc (ptr, new_size);
+
+  // Still fits the block it already has
+  if (new_size <= ARENA_MAX_BLOCK
+      && arena_block_size (arena, new_size)
+             == arena_block_size (arena, old_size))
+    return ptr;
+
+  if (old_size > ARENA_MAX_BLOCK && new_size > ARENA_MAX_BLOCK)
+  {
+    ArenaLarge *large = (ArenaLarge *)ptr - 1;
+    ArenaLarge *prev = large->prev;
+    ArenaLarge *next = large->next;
+
+    large = realloc (large, sizeof (ArenaLarge) + new_size);
+    large->size = new_size;
+    arena->system_bytes += (long)new_size - (long)old_size;
+    arena_count (arena, (long)new_size - (long)old_size);
+    if (prev != NULL)
+      prev->next = large;
+    else
+      arena->large = large;
+    if (next != NULL)
+      next->prev = large;
+
+    return large + 1;
+  }
+
+  void *result = arena_alloc (arena, new_size);
+  memcpy (result, ptr, old_size < new_size ? old_size : new_size);
+  arena_free (arena, ptr, old_size);
+
+  return result;
+}
+
+// =============================================================================
+// === Cursor
+// =============================================================================
+
+Cursor *
+init_cursor (Arena *arena, int line, int pos)
+{
+  Cursor *c = arena_alloc (arena, sizeof (Cursor));
+  c->line = line;
+  c->pos = pos;
+
+  return c;
+}
+
+int
+move_cursor_next_line (Cursor *c, Page *page)
+{
+  int next = page_next_slot (page, c->line);
+  if (next < 0)
+    return 1;
+
+  c->line = next;
+  return 0;
+}
+
+int
+move_cursor_previous_line (Cursor *c, Page *page)
+{
+  int previous = page_prev_slot (page, c->line);
+  if (previous < 0)
+    return 1;
+
+  c->line = previous;
+  return 0;
+}
+
+// Same line, as close to column as its length allows and never inside a char
+void
+move_cursor_column (Cursor *c, Page *page, int column)
+{
+  GapBufferLine *line = page_line (page, c->line);
+  int length = line_length (line);
+
+  if (column > length)
+    column = length;
+  while (column > 0 && column < length
+         && utf8_is_continuation (line_byte (line, column)))
+    column--;
+  c->pos = line_pos (line, column);
+}
+
+// Same line, on its index-th char or at the end when it has fewer
+void
+move_cursor_char (Cursor *c, Page *page, int index)
+{
+  GapBufferLine *line = page_line (page, c->line);
+  c->pos = line_pos (line, line_char_column (line, index));
+}
+
+PositionInGapArray
+move_cursor (Cursor *c, Page *page, int new_index)
+{
+  GapBufferLine *line = page_line (page, c->line);
+  PositionInGapArray state = get_index_pos_in_gap_array (
+      new_index,
+      line->gap_start,
+      line->gap_end,
+      line->buf_size);
+
+  switch (state)
+  {
+  case OUTSIDE_RIGHT:
+    if (line->gap_end == line->buf_size - 1)
+    {
+      c->pos = line->gap_start - 1;
+    }
+    else
+    {
+      c->pos = line->buf_size - 1;
+    }
+    return state;
+  case OUTSIDE_LEFT:
+    if (line->gap_start == 0)
+    {
+      c->pos = line->gap_end + 1;
+    }
+    else
+    {
+      c->pos = 0;
+    }
+    return state;
+  case BEFORE_GAP:
+  case AFTER_GAP:
+  case GAP_PLUS_ONE:
+  case GAP_MINUS_ONE:
+    c->pos = new_index;
+    return state;
+  case INSIDE_GAP_START:
+    c->pos = line->gap_end + 1;
+    return state;
+  case INSIDE_GAP_INBETWEEN:
+    if (c->pos > new_index)
+    {
+      c->pos = line->gap_start - 1;
+    }
+    else
+    {
+      c->pos = line->gap_end + 1;
+    }
+    return state;
+  }
+}
+
+// =============================================================================
+// === Capacity Policy
+// =============================================================================
+// How far a full gap grows and how much of an oversized gap may stay when
+// asked to shrink. Growing by a share of the buffer instead of a fixed amount
+// makes typing into a long line amortized O(1), bytes_copied shows it.
+
+CapacityPolicy line_capacity = { .name = "line",
+                                  .min_gap = GAP_SIZE,
+                                  .growth_percent = GAP_GROWTH_PERCENT,
+                                  .max_slack = 64 };
+CapacityPolicy page_capacity = { .name = "page",
+                                  .min_gap = GAP_SIZE,
+                                  .growth_percent = GAP_GROWTH_PERCENT,
+                                  .max_slack = 1024 };
+
+int
+capacity_gap_size (CapacityPolicy *policy, int buf_size, int needed)
+{
+  long gap = (long)buf_size * policy->growth_percent / 100;
+
+  if (gap < policy->min_gap)
+    gap = policy->min_gap;
+  if (gap < needed)
+    gap = needed;
+
+  return (int)gap;
+}
+
+// =============================================================================
+// === Gap Buffer
+// =============================================================================
+void
+move_gap_start (GapBuffer *gb, int index, size_t element_size)
+{
+  int dest;
+  int src;
+  int size;
+  int gap_size = gb->gap_end - gb->gap_start + 1;
+
+  assert (index < gb->buf_size);
+  if (index < 0)
+    index = 0;
+
+  // Index before gap
+  if (index < gb->gap_start)
+  {
+    dest = index + gap_size;
+    src = index;
+    size = gb->gap_start - index;
+  }
+  // index after gap
+  else if (index > gb->gap_end)
+  {
+    // Not enough space for gap after index
+    if (gb->buf_size - gap_size < index)
+    {
+      index = gb->buf_size - gap_size;
+    }
+    dest = gb->gap_start;
+    src = gb->gap_end + 1;
+    size = index - gb->gap_start;
+  }
+  // index inside gap
+  else
+  {
+    // Not enough space for gap after index
+    if (gb->buf_size - gap_size < index)
+    {
+      index = gb->buf_size - gap_size;
+    }
+    dest = gb->gap_start;
+    src = gb->gap_end + 1;
+    size = index - gb->gap_start;
+  }
+
+  memmove (
+      (char *)gb->buffer + dest * element_size,
+      (char *)gb->buffer + src * element_size,
+      size * element_size);
+
+  gb->gap_start = index;
+  gb->gap_end = index + (gap_size - 1);
+}
+
+void
+move_gap_end (GapBuffer *gb, int index, size_t element_size)
+{
+  int dest;
+  int src;
+  int size;
+  int gap_size = gb->gap_end - gb->gap_start + 1;
+
+  assert (index < gb->buf_size);
+  if (index < 0)
+    index = 0;
+
+  // Index before gap
+  if (index < gb->gap_start)
+  {
+
+    // Not enough space for gap before index
+    if (index < gap_size - 1)
+    {
+      index = gap_size - 1;
+    }
+
+    dest = index + 1;
+    src = index - (gap_size - 1);
+    size = gb->gap_start - src;
+  }
+  // index after gap
+  else if (index > gb->gap_end)
+  {
+    dest = gb->gap_start;
+    src = gb->gap_end + 1;
+    size = index - gb->gap_end;
+  }
+  // index inside gap
+  else
+  {
+    // Not enough space for gap before index
+    if (index < gap_size - 1)
+    {
+      index = gap_size - 1;
+    }
+
+    dest = index + 1;
+    src = index - (gap_size - 1);
+    size = gb->gap_start - src;
+  }
+
+  memmove (
+      (char *)gb->buffer + dest * element_size,
+      (char *)gb->buffer + src * element_size,
+      size * element_size);
+
+  gb->gap_end = index;
+  gb->gap_start = index - (gap_size - 1);
+}
+
+void
+expand_gap (
+    GapBuffer *gb,
+    int size,
+    size_t element_size,
+    CapacityPolicy *policy)
+{
+  int gap_size = gb->gap_end - gb->gap_start + 1;
+
+  // Only grows, shrink_gap is the way back
+  if (size <= gap_size)
+    return;
+
+  int new_gap_size = capacity_gap_size (policy, gb->buf_size, size);
+  int new_size = gb->buf_size + new_gap_size - gap_size;
+  int tail = gb->buf_size - gb->gap_end - 1;
+
+  // Use all of the block the arena hands out anyway
+  new_size = arena_block_size (gb->arena, new_size * element_size)
+             / element_size;
+  new_gap_size = new_size - gb->buf_size + gap_size;
+
+  uintptr_t old_address = (uintptr_t)gb->buffer;
+  char *new_buffer = arena_resize (
+      gb->arena,
+      gb->buffer,
+      gb->buf_size * element_size,
+      new_size * element_size);
+
+  // Could not grow in place, realloc copied the whole old block
+  if ((uintptr_t)new_buffer != old_address)
+    policy->bytes_copied += gb->buf_size * element_size;
+
+  memmove (
+      new_buffer + (gb->gap_start + new_gap_size) * element_size,
+      new_buffer + (gb->gap_end + 1) * element_size,
+      tail * element_size);
+  policy->bytes_copied += tail * element_size;
+  policy->grows++;
+
+  gb->buffer = new_buffer;
+  gb->gap_end = gb->gap_start + new_gap_size - 1;
+  gb->buf_size = new_size;
+}
+
+void
+shrink_gap (GapBuffer *gb, size_t element_size, CapacityPolicy *policy)
+{
+  int gap_size = gb->gap_end - gb->gap_start + 1;
+  int new_gap_size = policy->max_slack > 0 ? policy->max_slack : 1;
+
+  if (gap_size <= new_gap_size)
+    return;
+
+  int new_size = gb->buf_size - (gap_size - new_gap_size);
+  int tail = gb->buf_size - gb->gap_end - 1;
+
+  memmove (
+      (char *)gb->buffer + (gb->gap_start + new_gap_size) * element_size,
+      (char *)gb->buffer + (gb->gap_end + 1) * element_size,
+      tail * element_size);
+  policy->bytes_copied += tail * element_size;
+  policy->shrinks++;
+
+  // Shrinking in place may still fail, the old block is fine to keep then
+  char *new_buffer = arena_resize (
+      gb->arena,
+      gb->buffer,
+      gb->buf_size * element_size,
+      new_size * element_size);
+  if (new_buffer != NULL)
+    gb->buffer = new_buffer;
+
+  gb->gap_end = gb->gap_start + new_gap_size - 1;
+  gb->buf_size = new_size;
+}
+
+void
+insert_in_gap (
+    GapBuffer *gb,
+    char *buffer_ptr,
+    int count,
+    size_t element_size,
+    CapacityPolicy *policy)
+{
+  int gap_size = gb->gap_end - gb->gap_start + 1;
+
+  if (gap_size <= count)
+  {
+    expand_gap (gb, count + GAP_SIZE, element_size, policy);
+  }
+  memcpy (
+      (char *)gb->buffer + gb->gap_start * element_size,
+      buffer_ptr,
+      count * element_size);
+
+  gb->gap_start = gb->gap_start + count;
+}
+
+// =============================================================================
+// === Gap Kernels
+// =============================================================================
+// The functions above take any element size and work on a GapBuffer copy of
+// the line or page. The kernels here are the same code stamped out once per
+// element type and work on the line or page in place, so the size multiplies
+// fold into constants and the compiler is free to inline them into the line
+// and page functions. The generic ones stay for build/bench to compare with.
+
+#define GAP_KERNELS(suffix, Buffer, Element)                                 \
+  void move_gap_start_##suffix (Buffer *gb, int index)                       \
+  {                                                                          \
+    int gap_size = gb->gap_end - gb->gap_start + 1;                          \
+    int dest;                                                                \
+    int src;                                                                 \
+    int size;                                                                \
+                                                                             \
+    assert (index < gb->buf_size);                                           \
+    if (index < 0)                                                           \
+      index = 0;                                                             \
+                                                                             \
+    if (index < gb->gap_start)                                               \
+    {                                                                        \
+      dest = index + gap_size;                                               \
+      src = index;                                                           \
+      size = gb->gap_start - index;                                          \
+    }                                                                        \
+    else                                                                     \
+    {                                                                        \
+      /* Not enough space for gap after index */                             \
+      if (gb->buf_size - gap_size < index)                                   \
+        index = gb->buf_size - gap_size;                                     \
+      dest = gb->gap_start;                                                  \
+      src = gb->gap_end + 1;                                                 \
+      size = index - gb->gap_start;                                          \
+    }                                                                        \
+                                                                             \
+    memmove (gb->buffer + dest, gb->buffer + src, size * sizeof (Element));  \
+    gb->gap_start = index;                                                   \
+    gb->gap_end = index + gap_size - 1;                                      \
+  }                                                                          \
+                                                                             \
+  void move_gap_end_##suffix (Buffer *gb, int index)                         \
+  {                                                                          \
+    int gap_size = gb->gap_end - gb->gap_start + 1;                          \
+    int dest;                                                                \
+    int src;                                                                 \
+    int size;                                                                \
+                                                                             \
+    assert (index < gb->buf_size);                                           \
+    if (index < 0)                                                           \
+      index = 0;                                                             \
+                                                                             \
+    if (index > gb->gap_end)                                                 \
+    {                                                                        \
+      dest = gb->gap_start;                                                  \
+      src = gb->gap_end + 1;                                                 \
+      size = index - gb->gap_end;                                            \
+    }                                                                        \
+    else                                                                     \
+    {                                                                        \
+      /* Not enough space for gap before index */                            \
+      if (index < gap_size - 1)                                              \
+        index = gap_size - 1;                                                \
+      dest = index + 1;                                                      \
+      src = index - (gap_size - 1);                                          \
+      size = gb->gap_start - src;                                            \
+    }                                                                        \
+                                                                             \
+    memmove (gb->buffer + dest, gb->buffer + src, size * sizeof (Element));  \
+    gb->gap_end = index;                                                     \
+    gb->gap_start = index - (gap_size - 1);                                  \
+  }                                                                          \
+                                                                             \
+  void expand_gap_##suffix (Buffer *gb, int size, CapacityPolicy *policy)    \
+  {                                                                          \
+    int gap_size = gb->gap_end - gb->gap_start + 1;                          \
+    if (size <= gap_size)                                                    \
+      return;                                                                \
+                                                                             \
+    int new_gap_size = capacity_gap_size (policy, gb->buf_size, size);       \
+    int new_size = gb->buf_size + new_gap_size - gap_size;                   \
+    int tail = gb->buf_size - gb->gap_end - 1;                               \
+    new_size = arena_block_size (gb->arena, new_size * sizeof (Element))     \
+               / sizeof (Element);                                           \
+    new_gap_size = new_size - gb->buf_size + gap_size;                       \
+                                                                             \
+    Element *old_buffer = gb->buffer;                                        \
+    Element *new_buffer = arena_resize (                                     \
+        gb->arena,                                                           \
+        gb->buffer,                                                          \
+        gb->buf_size * sizeof (Element),                                     \
+        new_size * sizeof (Element));                                        \
+    if (new_buffer != old_buffer)                                            \
+      policy->bytes_copied += gb->buf_size * sizeof (Element);               \
+                                                                             \
+    memmove (                                                                \
+        new_buffer + gb->gap_start + new_gap_size,                           \
+        new_buffer + gb->gap_end + 1,                                        \
+        tail * sizeof (Element));                                            \
+    policy->bytes_copied += tail * sizeof (Element);                         \
+    policy->grows++;                                                         \
+                                                                             \
+    gb->buffer = new_buffer;                                                 \
+    gb->gap_end = gb->gap_start + new_gap_size - 1;                          \
+    gb->buf_size = new_size;                                                 \
+  }                                                                          \
+                                                                             \
+  void shrink_gap_##suffix (Buffer *gb, CapacityPolicy *policy)              \
+  {                                                                          \
+    int gap_size = gb->gap_end - gb->gap_start + 1;                          \
+    int new_gap_size = policy->max_slack > 0 ? policy->max_slack : 1;        \
+    if (gap_size <= new_gap_size)                                            \
+      return;                                                                \
+                                                                             \
+    int new_size = gb->buf_size - (gap_size - new_gap_size);                 \
+    int tail = gb->buf_size - gb->gap_end - 1;                               \
+    memmove (                                                                \
+        gb->buffer + gb->gap_start + new_gap_size,                           \
+        gb->buffer + gb->gap_end + 1,                                        \
+        tail * sizeof (Element));                                            \
+    policy->bytes_copied += tail * sizeof (Element);                         \
+    policy->shrinks++;                                                       \
+                                                                             \
+    Element *new_buffer = arena_resize (                                     \
+        gb->arena,                                                           \
+        gb->buffer,                                                          \
+        gb->buf_size * sizeof (Element),                                     \
+        new_size * sizeof (Element));                                        \
+    if (new_buffer != NULL)                                                  \
+      gb->buffer = new_buffer;                                               \
+                                                                             \
+    gb->gap_end = gb->gap_start + new_gap_size - 1;                          \
+    gb->buf_size = new_size;                                                 \
+  }                                                                          \
+                                                                             \
+  void insert_in_gap_##suffix (                                              \
+      Buffer *gb,                                                            \
+      Element const *elements,                                               \
+      int count,                                                             \
+      CapacityPolicy *policy)                                                \
+  {                                                                          \
+    if (gb->gap_end - gb->gap_start + 1 <= count)                            \
+      expand_gap_##suffix (gb, count + GAP_SIZE, policy);                    \
+    memcpy (gb->buffer + gb->gap_start, elements, count * sizeof (Element)); \
+    gb->gap_start += count;                                                  \
+  }
+
+GAP_KERNELS (chars, GapBufferLine, char)
+GAP_KERNELS (lines, GapBufferPage, GapBufferLine *)
+
+// =============================================================================
+// === Gap Buffer Line
+// =============================================================================
+// Most lines are short, those keep their text in small right behind the
+// header, so a line is one block and its text shares the cache lines of the
+// header. buffer points at small then and everything that only reads or moves
+// the gap can not tell the difference. The first time the gap has to grow the
+// text moves out into a block of its own, shrink_gap_line brings a line that
+// fits again back in.
+
+GapBufferLine *
+init_gap_buffer_line (Arena *arena, int initial_size, int gap_size)
+{
+  GapBufferLine *gbl;
+  int buf_size = (initial_size + gap_size) * sizeof (char);
+  size_t header = offsetof (GapBufferLine, small);
+
+  if (header + buf_size <= LINE_INLINE_SIZE)
+  {
+    // All of the block it gets anyway goes to the text, the rest as gap
+    size_t block = arena_block_size (arena, header + buf_size);
+    gbl = arena_alloc (arena, block);
+    gbl->small_size = block - header;
+    gap_size += gbl->small_size - buf_size;
+    buf_size = gbl->small_size;
+    gbl->buffer = gbl->small;
+  }
+  else
+  {
+    gbl = arena_alloc (arena, header);
+    gbl->small_size = 0;
+    gbl->buffer = arena_alloc (arena, buf_size);
+  }
+
+  gbl->arena = arena;
+  gbl->generation = 0;
+  gbl->breaks = NULL;
+  gbl->wrapped = 0;
+  gbl->highlight = 0;
+  gbl->gap_start = 0;
+  gbl->gap_end = gap_size - 1;
+  gbl->buf_size = buf_size;
+
+  assert (gbl->gap_end < gbl->buf_size);
+
+  for (int i = 0; i < gbl->buf_size; i++)
+  {
+    gbl->buffer[i] = '\0';
+  }
+
+  return gbl;
+}
+
+void
+free_gap_buffer_line (GapBufferLine *gbl)
+{
+  free_line_breaks (gbl);
+  if (!line_is_inline (gbl))
+    arena_free (gbl->arena, gbl->buffer, gbl->buf_size);
+  arena_free (gbl->arena, gbl, line_header_size (gbl));
+}
+
+int
+line_is_inline (GapBufferLine *gbl)
+{
+  return gbl->buffer == gbl->small;
+}
+
+// The block of the line itself, small included
+size_t
+line_header_size (GapBufferLine *gbl)
+{
+  return offsetof (GapBufferLine, small) + gbl->small_size;
+}
+
+// The text moves out of small into a block of its own
+void
+spill_line (GapBufferLine *gbl)
+{
+  char *buffer = arena_alloc (gbl->arena, gbl->buf_size);
+  memcpy (buffer, gbl->small, gbl->buf_size);
+  line_capacity.bytes_copied += gbl->buf_size;
+  gbl->buffer = buffer;
+}
+
+// And back, with all of small that is not text as gap
+void
+unspill_line (GapBufferLine *gbl)
+{
+  char *buffer = gbl->buffer;
+  int after = gbl->buf_size - gbl->gap_end - 1;
+
+  memcpy (gbl->small, buffer, gbl->gap_start);
+  memcpy (
+      gbl->small + gbl->small_size - after,
+      buffer + gbl->gap_end + 1,
+      after);
+  line_capacity.bytes_copied += gbl->gap_start + after;
+  line_capacity.shrinks++;
+  arena_free (gbl->arena, buffer, gbl->buf_size);
+
+  gbl->buffer = gbl->small;
+  gbl->gap_end = gbl->small_size - after - 1;
+  gbl->buf_size = gbl->small_size;
+}
+
+void
+move_gap_line (GapBufferLine *gbl, int index, GAP_POSITION gap_pos)
+{
+  switch (gap_pos)
+  {
+  case GAP_START:
+    move_gap_start_chars (gbl, index);
+    break;
+  case GAP_END:
+    move_gap_end_chars (gbl, index);
+    break;
+  }
+}
+
+void
+expand_gap_line (GapBufferLine *gbl, int new_gap_size)
+{
+  if (new_gap_size <= gbl->gap_end - gbl->gap_start + 1)
+    return;
+  if (line_is_inline (gbl))
+    spill_line (gbl);
+
+  expand_gap_chars (gbl, new_gap_size, &line_capacity);
+}
+
+void
+shrink_gap_line (GapBufferLine *gbl)
+{
+  if (line_is_inline (gbl))
+    return;
+  if (line_length (gbl) + 1 + GAP_SIZE <= gbl->small_size)
+  {
+    unspill_line (gbl);
+    return;
+  }
+
+  shrink_gap_chars (gbl, &line_capacity);
+}
+
+void
+insert_single_char (GapBufferLine *gbl, char value, GAP_POSITION gap_pos)
+{
+  if (gbl->gap_end == gbl->gap_start)
+    expand_gap_line (gbl, GAP_SIZE);
+  switch (gap_pos)
+  {
+  case GAP_START:
+    gbl->buffer[gbl->gap_start] = value;
+    gbl->gap_start++;
+    break;
+  case GAP_END:
+    gbl->buffer[gbl->gap_end] = value;
+    gbl->gap_end--;
+    break;
+  }
+}
+
+void
+insert_in_gap_line (GapBufferLine *gbl, char *buffer_ptr, int count)
+{
+  // Grows here so a line in small can move out first
+  if (gbl->gap_end - gbl->gap_start + 1 <= count)
+    expand_gap_line (gbl, count + GAP_SIZE);
+
+  insert_in_gap_chars (gbl, buffer_ptr, count, &line_capacity);
+}
+
+void
+delete_single_char (GapBufferLine *gbl, GAP_POSITION gap_pos)
+{
+  switch (gap_pos)
+  {
+  case GAP_START:
+    if (gbl->gap_start > 0)
+    {
+      gbl->gap_start--;
+    }
+    break;
+  case GAP_END:
+    if (gbl->gap_end < gbl->buf_size - 1)
+    {
+      gbl->gap_end++;
+    }
+  }
+}
+
+// Lines are addressed by physical index everywhere else, the range functions
+// below take the column a user would count, gap left out.
+int
+line_length (GapBufferLine *gbl)
+{
+  return gbl->buf_size - 1 - (gbl->gap_end - gbl->gap_start + 1);
+}
+
+int
+line_column (GapBufferLine *gbl, int pos)
+{
+  if (pos < gbl->gap_start)
+    return pos;
+  return pos - (gbl->gap_end - gbl->gap_start + 1);
+}
+
+int
+line_pos (GapBufferLine *gbl, int column)
+{
+  if (column < gbl->gap_start)
+    return column;
+  return column + (gbl->gap_end - gbl->gap_start + 1);
+}
+
+char
+line_byte (GapBufferLine *gbl, int column)
+{
+  return gbl->buffer[line_pos (gbl, column)];
+}
+
+// Column of the char after the one at column, the length at the end
+int
+line_next_char (GapBufferLine *gbl, int column)
+{
+  int length = line_length (gbl);
+  if (column < length)
+    column++;
+  while (column < length && utf8_is_continuation (line_byte (gbl, column)))
+    column++;
+  return column;
+}
+
+// Column of the char in front of column, 0 at the start
+int
+line_prev_char (GapBufferLine *gbl, int column)
+{
+  if (column > 0)
+    column--;
+  while (column > 0 && utf8_is_continuation (line_byte (gbl, column)))
+    column--;
+  return column;
+}
+
+// Chars in front of column
+int
+line_char_index (GapBufferLine *gbl, int column)
+{
+  int length = line_length (gbl);
+  int index = 0;
+  for (int at = 0; at < column && at < length; at = line_next_char (gbl, at))
+    index++;
+  return index;
+}
+
+// Column of char index, the length when the line has fewer chars
+int
+line_char_column (GapBufferLine *gbl, int index)
+{
+  int length = line_length (gbl);
+  int column = 0;
+  for (int i = 0; i < index && column < length; i++)
+    column = line_next_char (gbl, column);
+  return column;
+}
+
+void
+insert_span_line (GapBufferLine *gbl, int column, char *buffer_ptr, int count)
+{
+  if (column != gbl->gap_start)
+    move_gap_line (gbl, column, GAP_START);
+  insert_in_gap_line (gbl, buffer_ptr, count);
+}
+
+void
+delete_range_line (GapBufferLine *gbl, int column, int count)
+{
+  int length = line_length (gbl);
+  if (column + count > length)
+    count = length - column;
+  if (count <= 0)
+    return;
+
+  // Let the gap swallow the range from whichever side is closer to it
+  int end = column + count;
+  if (abs (end - gbl->gap_start) < abs (column - gbl->gap_start))
+  {
+    if (end != gbl->gap_start)
+      move_gap_line (gbl, end, GAP_START);
+    gbl->gap_start -= count;
+  }
+  else
+  {
+    if (column != gbl->gap_start)
+      move_gap_line (gbl, column, GAP_START);
+    gbl->gap_end += count;
+  }
+}
+
+// Everything from column on moves to the returned line, which has its gap in
+// front so the cursor can start typing there right away.
+GapBufferLine *
+split_gap_buffer_line (GapBufferLine *gbl, int column)
+{
+  if (column != gbl->gap_start)
+    move_gap_line (gbl, column, GAP_START);
+
+  int tail = gbl->buf_size - 1 - (gbl->gap_end + 1);
+  GapBufferLine *new_line
+      = init_gap_buffer_line (gbl->arena, tail + INIT_SIZE_LINE, GAP_SIZE);
+
+  memcpy (
+      new_line->buffer + new_line->gap_end + 1,
+      gbl->buffer + gbl->gap_end + 1,
+      tail);
+  gbl->gap_end = gbl->buf_size - 2;
+
+  return new_line;
+}
+
+// Appends the text of next to gbl
+void
+join_gap_buffer_line (GapBufferLine *gbl, LineView next)
+{
+  int before = next.before_size;
+  int after = next.after_size;
+  int length = line_length (gbl);
+
+  if (length != gbl->gap_start)
+    move_gap_line (gbl, length, GAP_START);
+  if (gbl->gap_end - gbl->gap_start + 1 <= before + after)
+    expand_gap_line (gbl, before + after + GAP_SIZE);
+
+  memcpy (gbl->buffer + gbl->gap_start, next.before, before);
+  memcpy (gbl->buffer + gbl->gap_start + before, next.after, after);
+  gbl->gap_start += before + after;
+}
+
+// =============================================================================
+// === Mapped File
+// =============================================================================
+
+void
+push_line_start (MappedFile *map, Arena *arena, size_t *capacity, size_t start)
+{
+  if (map->line_count + 1 >= *capacity)
+  {
+    map->line_starts = arena_resize (
+        arena,
+        map->line_starts,
+        *capacity * sizeof (size_t),
+        *capacity * 2 * sizeof (size_t));
+    *capacity *= 2;
+  }
+  map->line_starts[map->line_count] = start;
+  map->line_count++;
+}
+
+// One pass over the file, 16 bytes at a time where SSE2 is around
+void
+index_lines (MappedFile *map, Arena *arena)
+{
+  size_t capacity = 1024;
+  size_t i = 0;
+
+  map->line_starts = arena_alloc (arena, capacity * sizeof (size_t));
+  map->line_count = 0;
+  push_line_start (map, arena, &capacity, 0);
+
+#ifdef __SSE2__
+  __m128i newline = _mm_set1_epi8 ('\n');
+  for (; i + 16 <= map->size; i += 16)
+  {
+    __m128i chunk = _mm_loadu_si128 ((const __m128i *)(map->data + i));
+    unsigned int mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (chunk, newline));
+    while (mask != 0)
+    {
+      push_line_start (map, arena, &capacity, i + __builtin_ctz (mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i < map->size; i++)
+  {
+    if (map->data[i] == '\n')
+      push_line_start (map, arena, &capacity, i + 1);
+  }
+
+  // A trailing newline ends the last line instead of starting an empty one,
+  // its start then doubles as the end marker. Otherwise the end marker points
+  // one past the file, as if there was a newline.
+  map->final_newline
+      = map->size > 0 && map->line_starts[map->line_count - 1] == map->size;
+  if (map->final_newline)
+  {
+    map->line_count--;
+  }
+  else
+  {
+    push_line_start (map, arena, &capacity, map->size + 1);
+    map->line_count--;
+  }
+}
+
+GapBufferLine *
+materialize_line (Arena *arena, MappedFile *map, GapBufferLine *entry)
+{
+  LineView view = line_view (map, entry);
+  GapBufferLine *gbl = init_gap_buffer_line (
+      arena,
+      view.before_size + INIT_SIZE_LINE,
+      GAP_SIZE);
+
+  memcpy (gbl->buffer + gbl->gap_end + 1, view.before, view.before_size);
+
+  return gbl;
+}
+
+void
+unmap_file (MappedFile *map)
+{
+  if (map->data != NULL)
+    munmap ((void *)map->data, map->size);
+}
+
+// =============================================================================
+// === Copy On Write
+// =============================================================================
+
+void
+snapshot_retire (Snapshot *snapshot, void *ptr, size_t size)
+{
+  if (snapshot->retired_count == snapshot->retired_capacity)
+  {
+    snapshot->retired_capacity = snapshot->retired_capacity * 2 + 64;
+    snapshot->retired = realloc (
+        snapshot->retired,
+        snapshot->retired_capacity * sizeof (Retired));
+  }
+  snapshot->retired[snapshot->retired_count].ptr = ptr;
+  snapshot->retired[snapshot->retired_count].size = size;
+  snapshot->retired_count++;
+}
+
+int
+line_is_shared (Snapshot *snapshot, GapBufferLine *gbl)
+{
+  return snapshot != NULL && gbl->generation <= snapshot->generation;
+}
+
+GapBufferLine *
+copy_line_on_write (Snapshot *snapshot, GapBufferLine *gbl)
+{
+  size_t header = line_header_size (gbl);
+  GapBufferLine *copy = arena_alloc (gbl->arena, header);
+  // The breaks go along, a snapshot never reads them
+  memcpy (copy, gbl, header);
+  snapshot->copied_bytes += header;
+  if (line_is_inline (gbl))
+  {
+    copy->buffer = copy->small;
+  }
+  else
+  {
+    copy->buffer = arena_alloc (gbl->arena, gbl->buf_size);
+    memcpy (copy->buffer, gbl->buffer, gbl->buf_size);
+    snapshot->copied_bytes += gbl->buf_size;
+    snapshot_retire (snapshot, gbl->buffer, gbl->buf_size);
+  }
+  snapshot_retire (snapshot, gbl, header);
+
+  return copy;
+}
+
+// For lines that leave the page
+void
+release_line (Snapshot *snapshot, GapBufferLine *gbl)
+{
+  if (line_is_mapped (gbl))
+    return;
+
+  if (line_is_shared (snapshot, gbl))
+  {
+    free_line_breaks (gbl);
+    if (!line_is_inline (gbl))
+      snapshot_retire (snapshot, gbl->buffer, gbl->buf_size);
+    snapshot_retire (snapshot, gbl, line_header_size (gbl));
+    return;
+  }
+
+  free_gap_buffer_line (gbl);
+}
+
+// =============================================================================
+// === Line Index
+// =============================================================================
+// Fenwick tree over the physical slots of the gap page. A slot holds the bytes
+// of its line, newline included, gap slots hold 0. That way the gap moving
+// only touches the slots that changed, and rows, slots and byte offsets map
+// to each other in O(log n).
+
+void
+init_line_index (LineIndex *index, Arena *arena, int size)
+{
+  index->size = size;
+  index->tree = arena_alloc (arena, (size + 1) * sizeof (long));
+  memset (index->tree, 0, (size + 1) * sizeof (long));
+}
+
+void
+line_index_add (LineIndex *index, int slot, long delta)
+{
+  for (int i = slot + 1; i <= index->size; i += i & -i)
+    index->tree[i] += delta;
+}
+
+// Bytes in the slots in front of slot
+long
+line_index_prefix (LineIndex *index, int slot)
+{
+  long sum = 0;
+  for (int i = slot; i > 0; i -= i & -i)
+    sum += index->tree[i];
+  return sum;
+}
+
+void
+line_index_set (LineIndex *index, int slot, long value)
+{
+  long current = line_index_prefix (index, slot + 1)
+                 - line_index_prefix (index, slot);
+  if (value != current)
+    line_index_add (index, slot, value - current);
+}
+
+// The last slot whose prefix is still <= offset, for an offset inside the text
+// that is the slot holding it
+int
+line_index_find (LineIndex *index, long offset)
+{
+  int step = 1;
+  while (step * 2 <= index->size)
+    step *= 2;
+
+  int slot = 0;
+  for (; step > 0; step /= 2)
+  {
+    if (slot + step <= index->size && index->tree[slot + step] <= offset)
+    {
+      slot += step;
+      offset -= index->tree[slot];
+    }
+  }
+  return slot;
+}
+
+// =============================================================================
+// === Damage
+// =============================================================================
+// Every change to the text of a line goes through page_line_changed or puts a
+// new line into the page, both mark the line here. The render cache redraws
+// the rows showing a marked line, rows whose line moved are found by the cache
+// itself.
+
+void
+mark_damaged (Damage *damage, GapBufferLine *line)
+{
+  if (damage->all)
+    return;
+  if (damage->count > 0 && damage->lines[damage->count - 1] == line)
+    return;
+
+  if (damage->count == DAMAGE_MAX)
+  {
+    damage->all = 1;
+    return;
+  }
+  damage->lines[damage->count] = line;
+  damage->count++;
+}
+
+// =============================================================================
+// === Wrap
+// =============================================================================
+// Lines wider than the view are cut into rows at the last space that still
+// fits, a word wider than a row is cut where the row ends. Spaces never start
+// a row, they hang at the end of the one before. The widths come from the
+// advances the renderer draws with.
+//
+// A materialized line keeps the byte columns its rows start at, a line still
+// in the file only keeps its number of rows, by its line in the file. Both
+// remember the generation of the Wrap they were made for, a new width or font
+// makes all of them stale at once and they are wrapped again when they show
+// up on screen or by page_wrap_some in the background. Edited lines are
+// wrapped again on the spot, see page_line_changed. The rows of every line go
+// into an index next to the bytes, so scrolling finds the line at a row in
+// O(log n) however much of the page is wrapped.
+
+Wrap *
+init_wrap (int width)
+{
+  Wrap *wrap = calloc (1, sizeof (Wrap));
+  wrap->width = width;
+  wrap->generation = 1;
+
+  return wrap;
+}
+
+// The tables of mapped lines live in the arena of the page
+void
+free_wrap (Wrap *wrap)
+{
+  free (wrap->scratch);
+  free (wrap);
+}
+
+void
+free_line_breaks (GapBufferLine *gbl)
+{
+  if (gbl->breaks == NULL)
+    return;
+
+  arena_free (gbl->arena, gbl->breaks, (gbl->breaks[0] + 1) * sizeof (int));
+  gbl->breaks = NULL;
+}
+
+// Rows of the line as it was wrapped last, 1 if it never was
+int
+line_height (Wrap *wrap, GapBufferLine *entry)
+{
+  if (wrap == NULL)
+    return 1;
+
+  if (line_is_mapped (entry))
+  {
+    int height = wrap->mapped_heights[mapped_line_index (entry)];
+    return height > 0 ? height : 1;
+  }
+  return entry->breaks != NULL ? entry->breaks[0] + 1 : 1;
+}
+
+int
+line_is_wrapped (Wrap *wrap, GapBufferLine *entry)
+{
+  if (line_is_mapped (entry))
+    return wrap->mapped_wrapped[mapped_line_index (entry)] == wrap->generation;
+  return entry->wrapped == wrap->generation;
+}
+
+int
+wrap_advance (Wrap *wrap, int codepoint)
+{
+  // Control chars are sized like a space
+  if (codepoint < ' ')
+    codepoint = ' ';
+  if (codepoint < 128)
+    return wrap->ascii[codepoint];
+  if (wrap->advance == NULL)
+    return wrap->ascii['M'];
+  return wrap->advance (wrap->context, codepoint);
+}
+
+void
+push_break (Wrap *wrap, int *count, int column)
+{
+  if (*count == wrap->scratch_capacity)
+  {
+    wrap->scratch_capacity = wrap->scratch_capacity * 2 + 64;
+    wrap->scratch
+        = realloc (wrap->scratch, wrap->scratch_capacity * sizeof (int));
+  }
+  wrap->scratch[*count] = column;
+  (*count)++;
+}
+
+// Byte columns the rows after the first start at go into scratch, returns how
+// many there are
+int
+wrap_view (Wrap *wrap, LineView view)
+{
+  int count = 0;
+  if (wrap->width <= 0)
+    return 0;
+
+  int x = 0;
+  int row_start = 0;
+  // Column right behind the last space of the row and where it ends
+  int space_end = -1;
+  int space_x = 0;
+
+  const char *pieces[2] = { view.before, view.after };
+  int sizes[2] = { view.before_size, view.after_size };
+  int column = 0;
+  for (int piece = 0; piece < 2; piece++)
+  {
+    const char *text = pieces[piece];
+    int size = sizes[piece];
+    int i = 0;
+    while (i < size)
+    {
+      // Most of it is ASCII, one byte needs no decoding
+      int length = 1;
+      int codepoint = (unsigned char)text[i];
+      if (codepoint >= 0x80)
+      {
+        length = utf8_char_size (text + i, size - i);
+        if (utf8_decode (text + i, length, &codepoint) != length)
+          codepoint = UTF8_REPLACEMENT;
+      }
+      int space = codepoint <= ' ';
+      int advance = wrap_advance (wrap, codepoint);
+
+      // Every row gets at least one char
+      while (!space && x + advance > wrap->width && column > row_start)
+      {
+        if (space_end > row_start)
+        {
+          row_start = space_end;
+          x -= space_x;
+        }
+        else
+        {
+          row_start = column;
+          x = 0;
+        }
+        space_end = -1;
+        push_break (wrap, &count, row_start);
+      }
+
+      x += advance;
+      if (space)
+      {
+        space_end = column + length;
+        space_x = x;
+      }
+      column += length;
+      i += length;
+    }
+  }
+
+  return count;
+}
+
+// Wraps the line for the current width and keeps what it found, returns its
+// number of rows
+int
+wrap_line (Wrap *wrap, MappedFile *map, GapBufferLine *entry)
+{
+  int count = wrap_view (wrap, line_view (map, entry));
+  wrap->lines_wrapped++;
+
+  if (line_is_mapped (entry))
+  {
+    size_t index = mapped_line_index (entry);
+    wrap->mapped_heights[index] = count + 1;
+    wrap->mapped_wrapped[index] = wrap->generation;
+    return count + 1;
+  }
+
+  // Mostly the line keeps its number of rows and its block with it
+  int old = entry->breaks != NULL ? entry->breaks[0] : 0;
+  if (count == 0)
+    free_line_breaks (entry);
+  else if (old == 0)
+    entry->breaks = arena_alloc (entry->arena, (count + 1) * sizeof (int));
+  else if (old != count)
+    entry->breaks = arena_resize (
+        entry->arena,
+        entry->breaks,
+        (old + 1) * sizeof (int),
+        (count + 1) * sizeof (int));
+
+  if (count > 0)
+  {
+    entry->breaks[0] = count;
+    memcpy (entry->breaks + 1, wrap->scratch, count * sizeof (int));
+  }
+  entry->wrapped = wrap->generation;
+
+  return count + 1;
+}
+
+// Row of the line the byte column is in
+int
+line_wrap_row (const int *breaks, int count, int column)
+{
+  int low = 0;
+  int high = count;
+  while (low < high)
+  {
+    int mid = (low + high + 1) / 2;
+    if (breaks[mid - 1] <= column)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+  return low;
+}
+
+// =============================================================================
+// === Highlight
+// =============================================================================
+// Markdown is highlighted a line at a time. All a line needs from the lines
+// above it is whether it is inside a fenced code block, so every line keeps
+// the state it ends in, a line still in the file keeps it by its line in the
+// file. Drawing a line tokenizes it from the state of the line above.
+//
+// An edit only marks its rows as dirty. page_highlight_some tokenizes from the
+// first dirty row down and stops at the first line past the dirty ones that
+// ends in the state it had, everything below it is still right. A fence
+// opened above a long page may take a few frames to get to the end, never more
+// than the budget per frame.
+
+Highlight *
+init_highlight (void)
+{
+  Highlight *highlight = calloc (1, sizeof (Highlight));
+  highlight->dirty_start = -1;
+  highlight->dirty_end = -1;
+
+  return highlight;
+}
+
+// The states of mapped lines live in the arena of the page
+void
+free_highlight (Highlight *highlight)
+{
+  free (highlight->runs);
+  free (highlight);
+}
+
+int
+line_state (Highlight *highlight, GapBufferLine *entry)
+{
+  if (highlight == NULL)
+    return 0;
+  if (line_is_mapped (entry))
+    return highlight->mapped_states[mapped_line_index (entry)];
+  return entry->highlight;
+}
+
+// Lines shared with a snapshot can take it too, a snapshot never reads it
+void
+set_line_state (Highlight *highlight, GapBufferLine *entry, int state)
+{
+  if (line_is_mapped (entry))
+    highlight->mapped_states[mapped_line_index (entry)] = state;
+  else
+    entry->highlight = state;
+}
+
+void
+highlight_mark (Highlight *highlight, int from, int to)
+{
+  if (highlight == NULL)
+    return;
+
+  if (highlight->dirty_start < 0 || from < highlight->dirty_start)
+    highlight->dirty_start = from;
+  if (to > highlight->dirty_end)
+    highlight->dirty_end = to;
+}
+
+// The new line has no state yet and the one below it a new line above
+void
+highlight_insert_row (Highlight *highlight, int row, int count)
+{
+  if (highlight == NULL)
+    return;
+
+  if (highlight->dirty_start >= row)
+    highlight->dirty_start++;
+  if (highlight->dirty_end >= row)
+    highlight->dirty_end++;
+  highlight_mark (highlight, row, row + 1 < count ? row + 1 : row);
+}
+
+// The line that takes the row has a new line above
+void
+highlight_delete_row (Highlight *highlight, int row, int count)
+{
+  if (highlight == NULL)
+    return;
+
+  if (highlight->dirty_start > row)
+    highlight->dirty_start--;
+  if (highlight->dirty_end > row)
+    highlight->dirty_end--;
+  if (highlight->dirty_start >= count)
+  {
+    highlight->dirty_start = -1;
+    highlight->dirty_end = -1;
+  }
+  else if (highlight->dirty_end >= count)
+  {
+    highlight->dirty_end = count - 1;
+  }
+
+  if (row < count)
+    highlight_mark (highlight, row, row);
+}
+
+// 0 past the end, no char the rules look for
+int
+view_byte (LineView view, int i)
+{
+  if (i < view.before_size)
+    return (unsigned char)view.before[i];
+  i -= view.before_size;
+  if (i < view.after_size)
+    return (unsigned char)view.after[i];
+  return 0;
+}
+
+int
+view_run (LineView view, int i, int c)
+{
+  int start = i;
+  while (view_byte (view, i) == c)
+    i++;
+  return i - start;
+}
+
+void
+push_run (Highlight *highlight, int start, HighlightKind kind)
+{
+  int count = highlight->run_count;
+  if (count > 0 && highlight->runs[count - 1].kind == kind)
+    return;
+  if (count > 0 && highlight->runs[count - 1].start == start)
+  {
+    highlight->runs[count - 1].kind = kind;
+    return;
+  }
+
+  if (count == highlight->run_capacity)
+  {
+    highlight->run_capacity = highlight->run_capacity * 2 + 16;
+    highlight->runs = realloc (
+        highlight->runs,
+        highlight->run_capacity * sizeof (HighlightRun));
+  }
+  highlight->runs[count] = (HighlightRun){ start, kind };
+  highlight->run_count++;
+}
+
+int
+is_tag_char (int c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+         || (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '/';
+}
+
+// A fence of at least three ` or ~ behind up to three spaces, 0 if the line
+// does not start with one. A ``` fence can not have a ` after it.
+int
+view_fence (LineView view, int *fence_char)
+{
+  int i = view_run (view, 0, ' ');
+  if (i > 3)
+    return 0;
+
+  int c = view_byte (view, i);
+  if (c != '`' && c != '~')
+    return 0;
+  int length = view_run (view, i, c);
+  if (length < 3)
+    return 0;
+
+  if (c == '`')
+  {
+    int size = view.before_size + view.after_size;
+    for (int j = i + length; j < size; j++)
+      if (view_byte (view, j) == '`')
+        return 0;
+  }
+
+  *fence_char = c;
+  return length;
+}
+
+// A closing fence has nothing but spaces after it
+int
+view_closes_fence (LineView view, int state)
+{
+  int c = state & HIGHLIGHT_TILDE ? '~' : '`';
+  int i = view_run (view, 0, ' ');
+  if (i > 3)
+    return 0;
+
+  int length = view_run (view, i, c);
+  if (length < 3 || length < (state & HIGHLIGHT_FENCE_LENGTH))
+    return 0;
+
+  i += length;
+  int size = view.before_size + view.after_size;
+  while (view_byte (view, i) == ' ' || view_byte (view, i) == '\t')
+    i++;
+  return i == size;
+}
+
+// The list marker and task box the line starts with, returns where the text
+// after them starts
+int
+highlight_marker (Highlight *highlight, LineView view, int i)
+{
+  int c = view_byte (view, i);
+  int end = i;
+  if (c == '-' || c == '*' || c == '+')
+  {
+    end = i + 1;
+  }
+  else if (c >= '0' && c <= '9')
+  {
+    end = i;
+    while (view_byte (view, end) >= '0' && view_byte (view, end) <= '9')
+      end++;
+    if (end - i > 9
+        || (view_byte (view, end) != '.' && view_byte (view, end) != ')'))
+      return i;
+    end++;
+  }
+  else
+  {
+    return i;
+  }
+
+  if (view_byte (view, end) != ' ')
+    return i;
+  push_run (highlight, i, HIGHLIGHT_MARKER);
+  push_run (highlight, end, HIGHLIGHT_TEXT);
+
+  int box = end + view_run (view, end, ' ');
+  int mark = view_byte (view, box + 1);
+  if (view_byte (view, box) != '['
+      || (mark != ' ' && mark != 'x' && mark != 'X')
+      || view_byte (view, box + 2) != ']')
+    return end;
+  int after = view_byte (view, box + 3);
+  if (after != ' ' && after != '\t' && after != 0)
+    return end;
+
+  push_run (
+      highlight,
+      box,
+      mark == ' ' ? HIGHLIGHT_TASK : HIGHLIGHT_TASK_DONE);
+  push_run (highlight, box + 3, HIGHLIGHT_TEXT);
+  return box + 3;
+}
+
+// Code spans and #tags in the text of the line
+void
+highlight_inline (Highlight *highlight, LineView view, int i)
+{
+  int size = view.before_size + view.after_size;
+  while (i < size)
+  {
+    int c = view_byte (view, i);
+    if (c == '\\')
+    {
+      i += 2;
+    }
+    else if (c == '`')
+    {
+      // Closed by a run of as many backticks, no more and no less
+      int length = view_run (view, i, '`');
+      int j = i + length;
+      int close = -1;
+      while (j < size)
+      {
+        int run = view_run (view, j, '`');
+        if (run == length)
+        {
+          close = j + run;
+          break;
+        }
+        j += run > 0 ? run : 1;
+      }
+
+      if (close < 0)
+      {
+        i += length;
+        continue;
+      }
+      push_run (highlight, i, HIGHLIGHT_CODE);
+      push_run (highlight, close, HIGHLIGHT_TEXT);
+      i = close;
+    }
+    else if (
+        c == '#' && is_tag_char (view_byte (view, i + 1))
+        && (i == 0 || view_byte (view, i - 1) == ' '
+            || view_byte (view, i - 1) == '\t'))
+    {
+      int j = i + 1;
+      while (is_tag_char (view_byte (view, j)))
+        j++;
+      push_run (highlight, i, HIGHLIGHT_TAG);
+      push_run (highlight, j, HIGHLIGHT_TEXT);
+      i = j;
+    }
+    else
+    {
+      i++;
+    }
+  }
+}
+
+// Tokenizes the line from the state of the line above and returns the state
+// it ends in. With runs set the runs of the line go into the Highlight, else
+// only the state is worked out, which only needs to look for fences.
+int
+highlight_view (Highlight *highlight, LineView view, int state, int runs)
+{
+  highlight->run_count = 0;
+  if (runs)
+    push_run (highlight, 0, HIGHLIGHT_TEXT);
+
+  if (state & HIGHLIGHT_IN_FENCE)
+  {
+    int closes = view_closes_fence (view, state);
+    if (runs)
+      push_run (highlight, 0, closes ? HIGHLIGHT_FENCE : HIGHLIGHT_CODE);
+    return closes ? 0 : state;
+  }
+
+  int fence_char;
+  int length = view_fence (view, &fence_char);
+  if (length > 0)
+  {
+    if (runs)
+      push_run (highlight, 0, HIGHLIGHT_FENCE);
+    if (length > HIGHLIGHT_FENCE_LENGTH)
+      length = HIGHLIGHT_FENCE_LENGTH;
+    return HIGHLIGHT_IN_FENCE | (fence_char == '~' ? HIGHLIGHT_TILDE : 0)
+           | length;
+  }
+
+  if (!runs)
+    return 0;
+
+  int i = view_run (view, 0, ' ');
+  int level = view_run (view, i, '#');
+  int after = view_byte (view, i + level);
+  if (i <= 3 && level >= 1 && level <= 6
+      && (after == ' ' || after == '\t' || after == 0))
+  {
+    push_run (highlight, 0, HIGHLIGHT_HEADING);
+    return 0;
+  }
+
+  // Nested list items are indented, so their markers may be too
+  i = highlight_marker (highlight, view, i);
+  highlight_inline (highlight, view, i);
+
+  return 0;
+}
+
+// =============================================================================
+// === Gab Buffer Page
+// =============================================================================
+
+GapBufferPage *
+init_gap_buffer_page (Arena *arena, int initial_size, int gap_size)
+{
+  GapBufferPage *gbp = arena_alloc (arena, sizeof (GapBufferPage));
+  gbp->arena = arena;
+  gbp->map = NULL;
+  gbp->snapshot = NULL;
+  gbp->generation = 1;
+  gbp->shared = 0;
+  gbp->damage.count = 0;
+  gbp->damage.all = 0;
+  gbp->wrap = NULL;
+  gbp->highlight = NULL;
+  gbp->heights.size = 0;
+  gbp->heights.tree = NULL;
+  gbp->buffer = arena_alloc (
+      arena,
+      (initial_size + gap_size) * sizeof (GapBufferLine *));
+  gbp->gap_start = 0;
+  gbp->gap_end = gap_size - 1;
+  gbp->buf_size = initial_size + gap_size;
+
+  for (int i = 0; i < gbp->buf_size; i++)
+  {
+    gbp->buffer[i] = NULL;
+  }
+  init_line_index (&gbp->offsets, arena, gbp->buf_size);
+
+  return gbp;
+}
+
+long
+slot_bytes (GapBufferPage *gbp, int slot)
+{
+  if (slot >= gbp->gap_start && slot <= gbp->gap_end)
+    return 0;
+  return line_bytes (gbp->map, gbp->buffer[slot]);
+}
+
+long
+slot_height (GapBufferPage *gbp, int slot)
+{
+  if (slot >= gbp->gap_start && slot <= gbp->gap_end)
+    return 0;
+  return line_height (gbp->wrap, gbp->buffer[slot]);
+}
+
+void
+build_line_index (
+    GapBufferPage *gbp,
+    LineIndex *index,
+    long (*value) (GapBufferPage *, int))
+{
+  if (index->size != gbp->buf_size)
+  {
+    arena_free (gbp->arena, index->tree, (index->size + 1) * sizeof (long));
+    init_line_index (index, gbp->arena, gbp->buf_size);
+  }
+
+  index->tree[0] = 0;
+  for (int i = 1; i <= index->size; i++)
+    index->tree[i] = value (gbp, i - 1);
+  for (int i = 1; i <= index->size; i++)
+  {
+    int parent = i + (i & -i);
+    if (parent <= index->size)
+      index->tree[parent] += index->tree[i];
+  }
+}
+
+// After the array got reallocated or its tail moved, O(n)
+void
+rebuild_line_index (GapBufferPage *gbp)
+{
+  build_line_index (gbp, &gbp->offsets, slot_bytes);
+  if (gbp->wrap != NULL)
+    build_line_index (gbp, &gbp->heights, slot_height);
+}
+
+void
+reindex_slots (GapBufferPage *gbp, int from, int to)
+{
+  for (int i = from; i < to; i++)
+  {
+    line_index_set (&gbp->offsets, i, slot_bytes (gbp, i));
+    if (gbp->wrap != NULL)
+      line_index_set (&gbp->heights, i, slot_height (gbp, i));
+  }
+}
+
+void
+move_gap_page (GapBufferPage *gbp, int index, GAP_POSITION gap_pos)
+{
+  assert (index >= 0);
+  assert (index < gbp->buf_size);
+
+  int old_start = gbp->gap_start;
+  int old_end = gbp->gap_end;
+
+  switch (gap_pos)
+  {
+  case GAP_START:
+    move_gap_start_lines (gbp, index);
+    break;
+  case GAP_END:
+    move_gap_end_lines (gbp, index);
+    break;
+  }
+
+  // Only the lines that moved across the gap change slot
+  if (gbp->gap_start < old_start)
+  {
+    reindex_slots (gbp, gbp->gap_start, old_start);
+    reindex_slots (gbp, gbp->gap_end + 1, old_end + 1);
+  }
+  else if (gbp->gap_start > old_start)
+  {
+    reindex_slots (gbp, old_start, gbp->gap_start);
+    reindex_slots (gbp, old_end + 1, gbp->gap_end + 1);
+  }
+}
+
+void
+expand_gap_page (GapBufferPage *gbp, int new_gap_size)
+{
+  expand_gap_lines (gbp, new_gap_size, &page_capacity);
+  rebuild_line_index (gbp);
+}
+
+void
+shrink_gap_page (GapBufferPage *gbp)
+{
+  shrink_gap_lines (gbp, &page_capacity);
+  rebuild_line_index (gbp);
+}
+
+int
+insert_line_at_row (GapBufferPage *gbp, GapBufferLine *new_line, int row)
+{
+  if (gbp->gap_end == gbp->gap_start)
+    expand_gap_page (gbp, GAP_SIZE);
+
+  // The gap start is also the number of lines in front of the gap
+  if (row != gbp->gap_start)
+    move_gap_page (gbp, row, GAP_START);
+
+  gbp->buffer[gbp->gap_start] = new_line;
+  gbp->gap_start++;
+
+  // Gap slots count 0, no need to look up the old value
+  line_index_add (
+      &gbp->offsets,
+      gbp->gap_start - 1,
+      line_bytes (gbp->map, new_line));
+  if (gbp->wrap != NULL)
+    line_index_add (
+        &gbp->heights,
+        gbp->gap_start - 1,
+        line_height (gbp->wrap, new_line));
+
+  return gbp->gap_start - 1;
+}
+
+int
+insert_single_line (
+    GapBufferPage *gbp,
+    GapBufferLine *new_line,
+    int line_index,
+    DIRECTION dir)
+{
+  assert (line_index < gbp->buf_size);
+
+  int row = line_index;
+  if (line_index > gbp->gap_end)
+    row = line_index - (gbp->gap_end - gbp->gap_start + 1);
+  if (dir == AFTER)
+    row++;
+
+  return insert_line_at_row (gbp, new_line, row);
+}
+
+void
+insert_in_gap_page (GapBufferPage *gbp, char *buffer_ptr, int count)
+{
+  insert_in_gap_lines (
+      gbp,
+      (GapBufferLine **)buffer_ptr,
+      count,
+      &page_capacity);
+  rebuild_line_index (gbp);
+}
+
+void
+delete_single_line (GapBufferPage *gbp)
+{
+  if (gbp->gap_start > 0)
+  {
+    gbp->gap_start--;
+    line_index_set (&gbp->offsets, gbp->gap_start, 0);
+    if (gbp->wrap != NULL)
+      line_index_set (&gbp->heights, gbp->gap_start, 0);
+  }
+};
+;
+
+// =============================================================================
+// === Rope Page
+// =============================================================================
+// Lines live in a treap ordered by their row, every node counts the lines in
+// its subtree. Lookup, insert and delete by row are O(log n) and nothing ever
+// has to shift a line array around, the slot of a line is simply its row.
+
+#ifdef NEO_NOTE_ROPE
+
+int
+rope_count (RopeNode *node)
+{
+  return node ? node->count : 0;
+}
+
+long
+rope_bytes (RopeNode *node)
+{
+  return node ? node->bytes : 0;
+}
+
+int
+rope_heights (RopeNode *node)
+{
+  return node ? node->heights : 0;
+}
+
+void
+rope_update (RopeNode *node)
+{
+  node->count = 1 + rope_count (node->left) + rope_count (node->right);
+  node->bytes = node->size + rope_bytes (node->left) + rope_bytes (node->right);
+  node->heights
+      = node->height + rope_heights (node->left) + rope_heights (node->right);
+}
+
+RopeNode *
+init_rope_node (RopePage *rp, GapBufferLine *line)
+{
+  RopeNode *node = arena_alloc (rp->arena, sizeof (RopeNode));
+  node->left = NULL;
+  node->right = NULL;
+  node->line = line;
+  node->count = 1;
+  node->size = line_bytes (rp->map, line);
+  node->bytes = node->size;
+  node->height = line_height (rp->wrap, line);
+  node->heights = node->height;
+  node->generation = rp->generation;
+
+  // xorshift32, random priorities are all the balancing a treap needs
+  rp->seed ^= rp->seed << 13;
+  rp->seed ^= rp->seed >> 17;
+  rp->seed ^= rp->seed << 5;
+  node->priority = rp->seed;
+
+  return node;
+}
+
+RopePage *
+init_rope_page (Arena *arena)
+{
+  RopePage *rp = arena_alloc (arena, sizeof (RopePage));
+  rp->arena = arena;
+  rp->map = NULL;
+  rp->snapshot = NULL;
+  rp->generation = 1;
+  rp->damage.count = 0;
+  rp->damage.all = 0;
+  rp->wrap = NULL;
+  rp->highlight = NULL;
+  rp->root = NULL;
+  rp->seed = 2463534242u;
+
+  return rp;
+}
+
+// Nodes a snapshot can see are copied before they are changed
+RopeNode *
+rope_own (RopePage *rp, RopeNode *node)
+{
+  Snapshot *snapshot = rp->snapshot;
+  if (snapshot == NULL || node->generation > snapshot->generation)
+    return node;
+
+  RopeNode *copy = arena_alloc (rp->arena, sizeof (RopeNode));
+  *copy = *node;
+  copy->generation = rp->generation;
+
+  snapshot->copied_bytes += sizeof (RopeNode);
+  snapshot_retire (snapshot, node, sizeof (RopeNode));
+
+  return copy;
+}
+
+RopeNode *
+rope_merge (RopePage *rp, RopeNode *a, RopeNode *b)
+{
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+
+  if (a->priority > b->priority)
+  {
+    a = rope_own (rp, a);
+    a->right = rope_merge (rp, a->right, b);
+    rope_update (a);
+    return a;
+  }
+
+  b = rope_own (rp, b);
+  b->left = rope_merge (rp, a, b->left);
+  rope_update (b);
+  return b;
+}
+
+// left gets the first `rows` lines of node, right the rest
+void
+rope_split (
+    RopePage *rp,
+    RopeNode *node,
+    int rows,
+    RopeNode **left,
+    RopeNode **right)
+{
+  if (node == NULL)
+  {
+    *left = NULL;
+    *right = NULL;
+    return;
+  }
+
+  node = rope_own (rp, node);
+  if (rope_count (node->left) < rows)
+  {
+    rope_split (
+        rp,
+        node->right,
+        rows - rope_count (node->left) - 1,
+        &node->right,
+        right);
+    rope_update (node);
+    *left = node;
+  }
+  else
+  {
+    rope_split (rp, node->left, rows, left, &node->left);
+    rope_update (node);
+    *right = node;
+  }
+}
+
+RopeNode *
+rope_find (RopeNode *node, int row)
+{
+  while (node != NULL)
+  {
+    int left_count = rope_count (node->left);
+    if (row < left_count)
+    {
+      node = node->left;
+    }
+    else if (row == left_count)
+    {
+      return node;
+    }
+    else
+    {
+      row -= left_count + 1;
+      node = node->right;
+    }
+  }
+  return NULL;
+}
+
+// Like rope_find, but copies every shared node on the way down so the one
+// returned can be changed
+RopeNode *
+rope_find_own (RopePage *rp, int row)
+{
+  RopeNode **link = &rp->root;
+  while (*link != NULL)
+  {
+    RopeNode *node = rope_own (rp, *link);
+    *link = node;
+
+    int left_count = rope_count (node->left);
+    if (row < left_count)
+    {
+      link = &node->left;
+    }
+    else if (row == left_count)
+    {
+      return node;
+    }
+    else
+    {
+      row -= left_count + 1;
+      link = &node->right;
+    }
+  }
+  return NULL;
+}
+
+// Bytes in the rows in front of row
+long
+rope_offset (RopeNode *node, int row)
+{
+  long offset = 0;
+  while (node != NULL)
+  {
+    int left_count = rope_count (node->left);
+    if (row < left_count)
+    {
+      node = node->left;
+      continue;
+    }
+
+    offset += rope_bytes (node->left);
+    if (row == left_count)
+      break;
+
+    offset += node->size;
+    row -= left_count + 1;
+    node = node->right;
+  }
+  return offset;
+}
+
+// Row holding offset, the row count if it is past the end
+int
+rope_find_offset (RopeNode *node, long offset)
+{
+  int row = 0;
+  while (node != NULL)
+  {
+    long left_bytes = rope_bytes (node->left);
+    if (offset < left_bytes)
+    {
+      node = node->left;
+    }
+    else if (offset < left_bytes + node->size)
+    {
+      return row + rope_count (node->left);
+    }
+    else
+    {
+      offset -= left_bytes + node->size;
+      row += rope_count (node->left) + 1;
+      node = node->right;
+    }
+  }
+  return row;
+}
+
+// Takes the rows of row from its line again and fixes up the sums above it,
+// all in one walk down. An edited line is also marked damaged, gets its size
+// again and is wrapped again.
+RopeNode *
+rope_line_changed (RopePage *rp, RopeNode *node, int row, int edited)
+{
+  node = rope_own (rp, node);
+
+  int left_count = rope_count (node->left);
+  if (row < left_count)
+  {
+    node->left = rope_line_changed (rp, node->left, row, edited);
+  }
+  else if (row == left_count)
+  {
+    if (edited)
+    {
+      mark_damaged (&rp->damage, node->line);
+      node->size = line_bytes (rp->map, node->line);
+      if (rp->wrap != NULL)
+        wrap_line (rp->wrap, rp->map, node->line);
+    }
+    node->height = line_height (rp->wrap, node->line);
+  }
+  else
+  {
+    node->right = rope_line_changed (
+        rp,
+        node->right,
+        row - left_count - 1,
+        edited);
+  }
+
+  rope_update (node);
+  return node;
+}
+
+// Rows in front of row once wrapped
+int
+rope_top (RopeNode *node, int row)
+{
+  int top = 0;
+  while (node != NULL)
+  {
+    int left_count = rope_count (node->left);
+    if (row < left_count)
+    {
+      node = node->left;
+      continue;
+    }
+
+    top += rope_heights (node->left);
+    if (row == left_count)
+      break;
+
+    top += node->height;
+    row -= left_count + 1;
+    node = node->right;
+  }
+  return top;
+}
+
+// Line showing the wrapped row top, the line count if it is past the end.
+// rows gets how many rows of it come before top.
+int
+rope_find_top (RopeNode *node, int top, int *rows)
+{
+  int row = 0;
+  while (node != NULL)
+  {
+    int left_heights = rope_heights (node->left);
+    if (top < left_heights)
+    {
+      node = node->left;
+    }
+    else if (top < left_heights + node->height)
+    {
+      *rows = top - left_heights;
+      return row + rope_count (node->left);
+    }
+    else
+    {
+      top -= left_heights + node->height;
+      row += rope_count (node->left) + 1;
+      node = node->right;
+    }
+  }
+  *rows = 0;
+  return row;
+}
+
+int
+insert_rope_line (RopePage *rp, GapBufferLine *line, int row)
+{
+  RopeNode *left;
+  RopeNode *right;
+  RopeNode *node = init_rope_node (rp, line);
+
+  rope_split (rp, rp->root, row, &left, &right);
+  rp->root = rope_merge (rp, rope_merge (rp, left, node), right);
+
+  return row;
+}
+
+GapBufferLine *
+delete_rope_line (RopePage *rp, int row)
+{
+  RopeNode *left;
+  RopeNode *middle;
+  RopeNode *right;
+
+  rope_split (rp, rp->root, row, &left, &right);
+  rope_split (rp, right, 1, &middle, &right);
+  rp->root = rope_merge (rp, left, right);
+
+  GapBufferLine *line = middle->line;
+  if (rp->snapshot != NULL && middle->generation <= rp->snapshot->generation)
+    snapshot_retire (rp->snapshot, middle, sizeof (RopeNode));
+  else
+    arena_free (rp->arena, middle, sizeof (RopeNode));
+
+  return line;
+}
+
+#endif
+
+// =============================================================================
+// === Page
+// =============================================================================
+
+#ifdef NEO_NOTE_ROPE
+
+Page *
+init_page (void)
+{
+  return init_rope_page (init_arena ());
+}
+
+void
+free_page (Page *page)
+{
+  if (page->map != NULL)
+    unmap_file (page->map);
+  free_arena (page->arena);
+}
+
+// Wrapped again for a new width, the text is the same. Most lines keep their
+// number of rows, those need no walk that copies the nodes.
+void
+page_wrap_slot (Page *page, int slot)
+{
+  RopeNode *node = rope_find (page->root, slot);
+  if (wrap_line (page->wrap, page->map, node->line) != node->height)
+    page->root = rope_line_changed (page, page->root, slot, 0);
+}
+
+GapBufferLine *
+page_line (Page *page, int slot)
+{
+  GapBufferLine *line = rope_find (page->root, slot)->line;
+
+  if (line_is_mapped (line))
+  {
+    int state = line_state (page->highlight, line);
+    line = materialize_line (page->arena, page->map, line);
+    line->highlight = state;
+  }
+  else if (line_is_shared (page->snapshot, line))
+    line = copy_line_on_write (page->snapshot, line);
+  else
+    return line;
+
+  line->generation = page->generation;
+  rope_find_own (page, slot)->line = line;
+  // Its breaks were not kept while it was in the file
+  if (page->wrap != NULL && !line_is_wrapped (page->wrap, line))
+    page_wrap_slot (page, slot);
+
+  return line;
+}
+
+GapBufferLine *
+page_line_entry (Page *page, int slot)
+{
+  return rope_find (page->root, slot)->line;
+}
+
+int
+page_line_count (Page *page)
+{
+  return rope_count (page->root);
+}
+
+int
+page_first_slot (Page *page)
+{
+  return page->root != NULL ? 0 : -1;
+}
+
+int
+page_next_slot (Page *page, int slot)
+{
+  return slot + 1 < rope_count (page->root) ? slot + 1 : -1;
+}
+
+int
+page_prev_slot (Page *page, int slot)
+{
+  return slot - 1;
+}
+
+int
+page_slot_to_row (Page *page, int slot)
+{
+  return slot;
+}
+
+int
+page_row_to_slot (Page *page, int row)
+{
+  return row;
+}
+
+int
+page_insert_line (Page *page, GapBufferLine *line, int slot, DIRECTION dir)
+{
+  if (!line_is_mapped (line))
+    line->generation = page->generation;
+  if (page->wrap != NULL)
+    wrap_line (page->wrap, page->map, line);
+  mark_damaged (&page->damage, line);
+  int row = insert_rope_line (page, line, dir == AFTER ? slot + 1 : slot);
+  highlight_insert_row (page->highlight, row, rope_count (page->root));
+  return row;
+}
+
+int
+page_append_line (Page *page, GapBufferLine *line)
+{
+  if (!line_is_mapped (line))
+    line->generation = page->generation;
+  if (page->wrap != NULL)
+    wrap_line (page->wrap, page->map, line);
+  mark_damaged (&page->damage, line);
+  int row = insert_rope_line (page, line, rope_count (page->root));
+  highlight_insert_row (page->highlight, row, rope_count (page->root));
+  return row;
+}
+
+int
+page_delete_line (Page *page, int slot)
+{
+  release_line (page->snapshot, delete_rope_line (page, slot));
+  if (page->wrap != NULL && slot < page->wrap->next_row)
+    page->wrap->next_row--;
+  highlight_delete_row (page->highlight, slot, rope_count (page->root));
+
+  return slot - 1;
+}
+
+void
+page_line_changed (Page *page, int slot)
+{
+  page->root = rope_line_changed (page, page->root, slot, 1);
+  highlight_mark (page->highlight, slot, slot);
+}
+
+long
+page_byte_count (Page *page)
+{
+  return rope_bytes (page->root);
+}
+
+long
+page_slot_offset (Page *page, int slot)
+{
+  return rope_offset (page->root, slot);
+}
+
+int
+page_offset_slot (Page *page, long offset)
+{
+  int count = rope_count (page->root);
+  if (offset < 0)
+    return page_first_slot (page);
+
+  int row = rope_find_offset (page->root, offset);
+  return row < count ? row : count - 1;
+}
+
+int
+page_height (Page *page)
+{
+  return rope_heights (page->root);
+}
+
+int
+page_slot_top (Page *page, int slot)
+{
+  return rope_top (page->root, slot);
+}
+
+// Slot of the line showing the wrapped row top, -1 past the end. rows gets
+// how many rows of the line are above top.
+int
+page_find_top (Page *page, int top, int *rows)
+{
+  *rows = 0;
+  if (top < 0)
+    return page_first_slot (page);
+
+  int row = rope_find_top (page->root, top, rows);
+  return row < rope_count (page->root) ? row : -1;
+}
+
+#else
+
+Page *
+init_page (void)
+{
+  return init_gap_buffer_page (init_arena (), 0, GAP_SIZE);
+}
+
+void
+free_page (Page *page)
+{
+  if (page->map != NULL)
+    unmap_file (page->map);
+  free_arena (page->arena);
+}
+
+// The line array is shared with a snapshot until the first change to it
+void
+page_unshare (Page *page)
+{
+  if (!page->shared)
+    return;
+
+  size_t size = page->buf_size * sizeof (GapBufferLine *);
+  GapBufferLine **copy = arena_alloc (page->arena, size);
+  memcpy (copy, page->buffer, size);
+
+  page->snapshot->copied_bytes += size;
+  snapshot_retire (page->snapshot, page->buffer, size);
+  page->buffer = copy;
+  page->shared = 0;
+}
+
+// Wrapped again for a new width, the text is the same
+void
+page_wrap_slot (Page *page, int slot)
+{
+  if (page->wrap == NULL)
+    return;
+
+  // The index has the rows the line had so far
+  GapBufferLine *entry = page->buffer[slot];
+  int old = line_height (page->wrap, entry);
+  int height = wrap_line (page->wrap, page->map, entry);
+  if (height != old)
+    line_index_add (&page->heights, slot, height - old);
+}
+
+GapBufferLine *
+page_line (Page *page, int slot)
+{
+  GapBufferLine *line = page->buffer[slot];
+
+  if (line_is_mapped (line))
+  {
+    int state = line_state (page->highlight, line);
+    line = materialize_line (page->arena, page->map, line);
+    line->highlight = state;
+    // Its breaks were not kept while it was in the file
+    if (page->wrap != NULL)
+      line_index_set (
+          &page->heights,
+          slot,
+          wrap_line (page->wrap, page->map, line));
+  }
+  else if (line_is_shared (page->snapshot, line))
+  {
+    line = copy_line_on_write (page->snapshot, line);
+  }
+  else
+  {
+    return line;
+  }
+
+  line->generation = page->generation;
+  page_unshare (page);
+  page->buffer[slot] = line;
+
+  return line;
+}
+
+GapBufferLine *
+page_line_entry (Page *page, int slot)
+{
+  return page->buffer[slot];
+}
+
+int
+page_line_count (Page *page)
+{
+  return page->buf_size - (page->gap_end - page->gap_start + 1);
+}
+
+int
+page_first_slot (Page *page)
+{
+  return page_next_slot (page, -1);
+}
+
+int
+page_next_slot (Page *page, int slot)
+{
+  int next = slot + 1;
+  if (next == page->gap_start)
+    next = page->gap_end + 1;
+
+  return next < page->buf_size ? next : -1;
+}
+
+int
+page_prev_slot (Page *page, int slot)
+{
+  int previous = slot - 1;
+  if (previous == page->gap_end)
+    previous = page->gap_start - 1;
+
+  return previous;
+}
+
+int
+page_slot_to_row (Page *page, int slot)
+{
+  if (slot < page->gap_start)
+    return slot;
+  return slot - (page->gap_end - page->gap_start + 1);
+}
+
+int
+page_row_to_slot (Page *page, int row)
+{
+  if (row < page->gap_start)
+    return row;
+  return row + (page->gap_end - page->gap_start + 1);
+}
+
+int
+page_insert_line (Page *page, GapBufferLine *line, int slot, DIRECTION dir)
+{
+  page_unshare (page);
+  if (!line_is_mapped (line))
+    line->generation = page->generation;
+  if (page->wrap != NULL)
+    wrap_line (page->wrap, page->map, line);
+  mark_damaged (&page->damage, line);
+  int new_slot = insert_single_line (page, line, slot, dir);
+  highlight_insert_row (
+      page->highlight,
+      page_slot_to_row (page, new_slot),
+      page_line_count (page));
+  return new_slot;
+}
+
+int
+page_append_line (Page *page, GapBufferLine *line)
+{
+  page_unshare (page);
+  if (!line_is_mapped (line))
+    line->generation = page->generation;
+  if (page->wrap != NULL)
+    wrap_line (page->wrap, page->map, line);
+  mark_damaged (&page->damage, line);
+  int row = page_line_count (page);
+  highlight_insert_row (page->highlight, row, row + 1);
+  return insert_line_at_row (page, line, row);
+}
+
+int
+page_delete_line (Page *page, int slot)
+{
+  int row = page_slot_to_row (page, slot);
+  GapBufferLine *line = page->buffer[slot];
+
+  page_unshare (page);
+  move_gap_page (page, row + 1, GAP_START);
+  delete_single_line (page);
+  release_line (page->snapshot, line);
+  if (page->wrap != NULL && row < page->wrap->next_row)
+    page->wrap->next_row--;
+  highlight_delete_row (page->highlight, row, page_line_count (page));
+
+  // Everything in front of the gap keeps its row as slot
+  return row - 1;
+}
+
+void
+page_line_changed (Page *page, int slot)
+{
+  mark_damaged (&page->damage, page->buffer[slot]);
+  line_index_set (&page->offsets, slot, slot_bytes (page, slot));
+  page_wrap_slot (page, slot);
+  highlight_mark (
+      page->highlight,
+      page_slot_to_row (page, slot),
+      page_slot_to_row (page, slot));
+}
+
+long
+page_byte_count (Page *page)
+{
+  return line_index_prefix (&page->offsets, page->buf_size);
+}
+
+long
+page_slot_offset (Page *page, int slot)
+{
+  return line_index_prefix (&page->offsets, slot);
+}
+
+int
+page_offset_slot (Page *page, long offset)
+{
+  if (offset < 0)
+    return page_first_slot (page);
+  if (offset >= page_byte_count (page))
+    return page_prev_slot (page, page->buf_size);
+
+  return line_index_find (&page->offsets, offset);
+}
+
+int
+page_height (Page *page)
+{
+  if (page->wrap == NULL)
+    return page_line_count (page);
+  return line_index_prefix (&page->heights, page->buf_size);
+}
+
+int
+page_slot_top (Page *page, int slot)
+{
+  if (page->wrap == NULL)
+    return page_slot_to_row (page, slot);
+  return line_index_prefix (&page->heights, slot);
+}
+
+// Slot of the line showing the wrapped row top, -1 past the end. rows gets
+// how many rows of the line are above top.
+int
+page_find_top (Page *page, int top, int *rows)
+{
+  *rows = 0;
+  if (top < 0)
+    return page_first_slot (page);
+  if (top >= page_height (page))
+    return -1;
+  if (page->wrap == NULL)
+    return page_row_to_slot (page, top);
+
+  int slot = line_index_find (&page->heights, top);
+  *rows = top - line_index_prefix (&page->heights, slot);
+  return slot;
+}
+
+#endif
+
+// Both backends
+LineView
+page_line_view (Page *page, int slot)
+{
+  return line_view (page->map, page_line_entry (page, slot));
+}
+
+int
+page_split_line (Page *page, int slot, int column)
+{
+  GapBufferLine *new_line
+      = split_gap_buffer_line (page_line (page, slot), column);
+  page_line_changed (page, slot);
+  return page_insert_line (page, new_line, slot, AFTER);
+}
+
+int
+page_join_next_line (Page *page, int slot)
+{
+  int next = page_next_slot (page, slot);
+  if (next < 0)
+    return slot;
+
+  int row = page_slot_to_row (page, slot);
+  join_gap_buffer_line (page_line (page, slot), page_line_view (page, next));
+  page_delete_line (page, next);
+
+  slot = page_row_to_slot (page, row);
+  page_line_changed (page, slot);
+  return slot;
+}
+
+// Maps the file and gives every line a slot that points into the mapping,
+// no text is copied until a line gets edited. NULL if the file can't be read.
+Page *
+load_page (const char *path)
+{
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat (fd, &st) != 0)
+  {
+    close (fd);
+    return NULL;
+  }
+
+  Page *page = init_page ();
+  MappedFile *map = arena_alloc (page->arena, sizeof (MappedFile));
+  map->size = st.st_size;
+  map->data = NULL;
+
+  if (map->size > 0)
+  {
+    void *data = mmap (NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+      close (fd);
+      free_page (page);
+      return NULL;
+    }
+    posix_madvise (data, map->size, POSIX_MADV_SEQUENTIAL);
+    map->data = data;
+  }
+  close (fd);
+
+  index_lines (map, page->arena);
+  map->valid_size = utf8_valid_size (map->data, map->size);
+  page->map = map;
+
+#ifndef NEO_NOTE_ROPE
+  expand_gap_page (page, map->line_count + GAP_SIZE);
+#endif
+  for (size_t i = 0; i < map->line_count; i++)
+  {
+    page_append_line (page, mapped_line (i));
+  }
+
+  return page;
+}
+
+// Lines already in the page count one row each until they are wrapped, so
+// this is cheap enough to call right after load_page
+void
+page_set_wrap (Page *page, Wrap *wrap)
+{
+  assert (page->wrap == NULL);
+
+  page->wrap = wrap;
+  if (page->map != NULL && page->map->line_count > 0)
+  {
+    size_t count = page->map->line_count;
+    wrap->mapped_heights = arena_alloc (page->arena, count * sizeof (int));
+    wrap->mapped_wrapped
+        = arena_alloc (page->arena, count * sizeof (unsigned int));
+    memset (wrap->mapped_heights, 0, count * sizeof (int));
+    memset (wrap->mapped_wrapped, 0, count * sizeof (unsigned int));
+    wrap->mapped_count = count;
+  }
+#ifndef NEO_NOTE_ROPE
+  build_line_index (page, &page->heights, slot_height);
+#endif
+}
+
+// For a new width or font, every line is stale until it is wrapped again
+void
+page_rewrap (Page *page, int width)
+{
+  Wrap *wrap = page->wrap;
+  wrap->width = width;
+  wrap->generation++;
+  wrap->next_row = 0;
+}
+
+void
+page_wrap_line (Page *page, int slot)
+{
+  if (page->wrap != NULL
+      && !line_is_wrapped (page->wrap, page_line_entry (page, slot)))
+    page_wrap_slot (page, slot);
+}
+
+// Columns the rows of the line after the first start at, wrapped first if it
+// is stale. A line still in the file is wrapped into the scratch of the Wrap,
+// so breaks is only good until the next call.
+int
+page_line_breaks (Page *page, int slot, const int **breaks)
+{
+  Wrap *wrap = page->wrap;
+  *breaks = NULL;
+  if (wrap == NULL)
+    return 0;
+
+  GapBufferLine *entry = page_line_entry (page, slot);
+  int fresh = line_is_wrapped (wrap, entry);
+  if (!fresh)
+    page_wrap_slot (page, slot);
+
+  if (!line_is_mapped (entry))
+  {
+    if (entry->breaks == NULL)
+      return 0;
+    *breaks = entry->breaks + 1;
+    return entry->breaks[0];
+  }
+
+  // Just wrapped, scratch still has them
+  int count = line_height (wrap, entry) - 1;
+  if (count > 0 && fresh)
+    wrap_view (wrap, line_view (page->map, entry));
+  *breaks = wrap->scratch;
+  return count;
+}
+
+// Wraps stale lines from where the last call stopped until budget_ms is used
+// up, 1 once every line is wrapped for the current width
+int
+page_wrap_some (Page *page, double budget_ms)
+{
+  Wrap *wrap = page->wrap;
+  if (wrap == NULL)
+    return 1;
+
+  double start = now_ms ();
+  int line_count = page_line_count (page);
+  int checked = 0;
+  while (wrap->next_row < line_count)
+  {
+    if (checked % WRAP_CHECK_LINES == 0 && checked > 0
+        && now_ms () - start > budget_ms)
+      break;
+
+    page_wrap_line (page, page_row_to_slot (page, wrap->next_row));
+    wrap->next_row++;
+    checked++;
+  }
+
+  return wrap->next_row >= line_count;
+}
+
+// Every line is dirty, page_highlight_some catches up from the top
+void
+page_set_highlight (Page *page, Highlight *highlight)
+{
+  assert (page->highlight == NULL);
+
+  page->highlight = highlight;
+  if (page->map != NULL && page->map->line_count > 0)
+  {
+    size_t count = page->map->line_count;
+    highlight->mapped_states = arena_alloc (page->arena, count);
+    memset (highlight->mapped_states, 0, count);
+    highlight->mapped_count = count;
+  }
+  if (page_line_count (page) > 0)
+    highlight_mark (highlight, 0, page_line_count (page) - 1);
+}
+
+// State of the line above the slot, the one its highlight starts from
+int
+page_line_start_state (Page *page, int slot)
+{
+  int previous = page_prev_slot (page, slot);
+  if (previous < 0)
+    return 0;
+  return line_state (page->highlight, page_line_entry (page, previous));
+}
+
+// Runs of the line, only good until the next call
+int
+page_highlight_line (Page *page, int slot, const HighlightRun **runs)
+{
+  Highlight *highlight = page->highlight;
+  *runs = NULL;
+  if (highlight == NULL)
+    return 0;
+
+  highlight_view (
+      highlight,
+      page_line_view (page, slot),
+      page_line_start_state (page, slot),
+      1);
+  *runs = highlight->runs;
+  return highlight->run_count;
+}
+
+// Tokenizes the dirty rows until the states converge or budget_ms is used up,
+// 1 once every line has the right state. A line whose line above ends in a
+// new state is damaged, its colors change with it.
+int
+page_highlight_some (Page *page, double budget_ms)
+{
+  Highlight *highlight = page->highlight;
+  if (highlight == NULL || highlight->dirty_start < 0)
+    return 1;
+
+  double start = now_ms ();
+  int line_count = page_line_count (page);
+  int row = highlight->dirty_start;
+  int slot = row < line_count ? page_row_to_slot (page, row) : -1;
+  int state = slot >= 0 ? page_line_start_state (page, slot) : 0;
+  int checked = 0;
+  while (slot >= 0)
+  {
+    if (checked % HIGHLIGHT_CHECK_LINES == 0 && checked > 0
+        && now_ms () - start > budget_ms)
+    {
+      highlight->dirty_start = row;
+      return 0;
+    }
+
+    GapBufferLine *entry = page_line_entry (page, slot);
+    int end = highlight_view (
+        highlight,
+        line_view (page->map, entry),
+        state,
+        0);
+    highlight->lines_scanned++;
+    checked++;
+
+    int next = page_next_slot (page, slot);
+    if (end == line_state (highlight, entry))
+    {
+      // The lines below started from this state when they got theirs
+      if (row >= highlight->dirty_end)
+        break;
+    }
+    else
+    {
+      set_line_state (highlight, entry, end);
+      if (next >= 0)
+        mark_damaged (&page->damage, page_line_entry (page, next));
+    }
+
+    state = end;
+    slot = next;
+    row++;
+  }
+
+  highlight->dirty_start = -1;
+  highlight->dirty_end = -1;
+  return 1;
+}
+
+// =============================================================================
+// === Save
+// =============================================================================
+// Lines are written straight from their spans with writev, untouched lines of
+// a mapped file are one long run of the mapping and end up in a single iovec.
+// The text goes to a temporary file first that is renamed over the old one, a
+// mapping of the old file stays valid through that. The last line ends with a
+// newline unless the file it came from did not, a new note always has one.
+
+void
+push_span (struct iovec *iov, int *count, const char *data, size_t size)
+{
+  if (size == 0)
+    return;
+
+  if (*count > 0
+      && (char *)iov[*count - 1].iov_base + iov[*count - 1].iov_len == data)
+  {
+    iov[*count - 1].iov_len += size;
+    return;
+  }
+
+  iov[*count].iov_base = (void *)data;
+  iov[*count].iov_len = size;
+  (*count)++;
+}
+
+int
+write_spans (int fd, struct iovec *iov, int count)
+{
+  while (count > 0)
+  {
+    ssize_t written = writev (fd, iov, count);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    // Short write, skip what made it and go again
+    while (count > 0 && (size_t)written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+int
+save_page (Page *page, const char *path)
+{
+  static const char newline = '\n';
+  MappedFile *map = page->map;
+
+  char *tmp_path = malloc (strlen (path) + 16);
+  sprintf (tmp_path, "%s.save-XXXXXX", path);
+
+  int fd = mkstemp (tmp_path);
+  if (fd < 0)
+  {
+    free (tmp_path);
+    return -1;
+  }
+
+  // Keep the permissions of the file we replace
+  struct stat st;
+  if (stat (path, &st) == 0)
+    fchmod (fd, st.st_mode & 07777);
+
+  struct iovec iov[SAVE_BATCH];
+  int count = 0;
+  int result = 0;
+
+  for (int slot = page_first_slot (page); slot >= 0 && result == 0;
+       slot = page_next_slot (page, slot))
+  {
+    if (count + 3 > SAVE_BATCH)
+    {
+      result = write_spans (fd, iov, count);
+      count = 0;
+    }
+
+    LineView view = page_line_view (page, slot);
+    const char *end = view.after + view.after_size;
+    int last = page_next_slot (page, slot) < 0;
+
+    push_span (iov, &count, view.before, view.before_size);
+    push_span (iov, &count, view.after, view.after_size);
+
+    // A mapped line is followed by its own newline in the mapping
+    if (map != NULL && end >= map->data && end < map->data + map->size
+        && *end == '\n')
+      push_span (iov, &count, end, 1);
+    else if (!last || map == NULL || map->final_newline)
+      push_span (iov, &count, &newline, 1);
+  }
+
+  if (result == 0)
+    result = write_spans (fd, iov, count);
+  if (result == 0)
+    result = fsync (fd);
+  if (close (fd) != 0)
+    result = -1;
+  if (result == 0)
+    result = rename (tmp_path, path);
+  if (result != 0)
+    unlink (tmp_path);
+
+  free (tmp_path);
+  return result;
+}
+
+// =============================================================================
+// === Snapshot
+// =============================================================================
+// Taking a snapshot copies the page header and bumps the generation, nothing
+// else. Whatever the editor changes afterwards is copied first, see
+// Copy On Write, so the snapshot can be read from another thread while typing
+// goes on.
+
+Snapshot *
+take_snapshot (Page *page)
+{
+  assert (page->snapshot == NULL);
+
+  Snapshot *snapshot = malloc (sizeof (Snapshot));
+  snapshot->page = *page;
+  snapshot->generation = page->generation;
+  snapshot->retired = NULL;
+  snapshot->retired_count = 0;
+  snapshot->retired_capacity = 0;
+  snapshot->copied_bytes = 0;
+
+  page->generation++;
+  page->snapshot = snapshot;
+#ifndef NEO_NOTE_ROPE
+  page->shared = 1;
+#endif
+
+  return snapshot;
+}
+
+void
+release_snapshot (Page *page, Snapshot *snapshot)
+{
+  for (int i = 0; i < snapshot->retired_count; i++)
+  {
+    arena_free (
+        page->arena,
+        snapshot->retired[i].ptr,
+        snapshot->retired[i].size);
+  }
+
+  page->snapshot = NULL;
+#ifndef NEO_NOTE_ROPE
+  page->shared = 0;
+#endif
+
+  free (snapshot->retired);
+  free (snapshot);
+}
+
+// =============================================================================
+// === Autosave
+// =============================================================================
+// The main thread snapshots the page at the end of a frame and hands it to the
+// worker, which writes it out with save_page. The snapshot is released on the
+// main thread once the worker hands it back, the arena is not thread safe.
+
+void *
+autosave_worker (void *data)
+{
+  Autosave *autosave = data;
+
+  pthread_mutex_lock (&autosave->lock);
+  while (!autosave->quit)
+  {
+    if (autosave->pending == NULL)
+    {
+      pthread_cond_wait (&autosave->wake, &autosave->lock);
+      continue;
+    }
+
+    Snapshot *snapshot = autosave->pending;
+    pthread_mutex_unlock (&autosave->lock);
+
+    double start = now_ms ();
+    int result = save_page (&snapshot->page, autosave->path);
+    double save_ms = now_ms () - start;
+
+    pthread_mutex_lock (&autosave->lock);
+    autosave->pending = NULL;
+    autosave->done = snapshot;
+    autosave->result = result;
+    autosave->save_ms = save_ms;
+    pthread_cond_broadcast (&autosave->wake);
+  }
+  pthread_mutex_unlock (&autosave->lock);
+
+  return NULL;
+}
+
+Autosave *
+start_autosave (const char *file_path)
+{
+  Autosave *autosave = calloc (1, sizeof (Autosave));
+  autosave->path = malloc (strlen (file_path) + 16);
+  sprintf (autosave->path, "%s.autosave", file_path);
+
+  pthread_mutex_init (&autosave->lock, NULL);
+  pthread_cond_init (&autosave->wake, NULL);
+  pthread_create (&autosave->thread, NULL, autosave_worker, autosave);
+
+  return autosave;
+}
+
+// Waits for a save in flight, needs to happen before free_page
+void
+stop_autosave (Autosave *autosave, Page *page)
+{
+  pthread_mutex_lock (&autosave->lock);
+  while (autosave->pending != NULL)
+    pthread_cond_wait (&autosave->wake, &autosave->lock);
+  autosave->quit = 1;
+  pthread_cond_signal (&autosave->wake);
+  pthread_mutex_unlock (&autosave->lock);
+
+  pthread_join (autosave->thread, NULL);
+  if (autosave->done != NULL)
+    release_snapshot (page, autosave->done);
+
+  pthread_mutex_destroy (&autosave->lock);
+  pthread_cond_destroy (&autosave->wake);
+  free (autosave->path);
+  free (autosave);
+}
+
+// Once per frame, after the edits of that frame went in
+void
+autosave_frame (Autosave *autosave, Page *page, double frame_ms)
+{
+  pthread_mutex_lock (&autosave->lock);
+  int saving = autosave->pending != NULL;
+  Snapshot *done = autosave->done;
+  autosave->done = NULL;
+  pthread_mutex_unlock (&autosave->lock);
+
+  if (saving)
+  {
+    if (frame_ms > autosave->frame_ms_max_saving)
+      autosave->frame_ms_max_saving = frame_ms;
+    return;
+  }
+  if (frame_ms > autosave->frame_ms_max_idle)
+    autosave->frame_ms_max_idle = frame_ms;
+
+  if (done != NULL)
+  {
+    autosave->copied_bytes = done->copied_bytes;
+    release_snapshot (page, done);
+    if (autosave->result == 0)
+      autosave->saves++;
+  }
+
+  double now = now_ms ();
+  if (autosave->edits == 0)
+    return;
+  if (autosave->dirty_since_ms == 0)
+    autosave->dirty_since_ms = now;
+  if (autosave->edits < AUTOSAVE_EDITS
+      && now - autosave->dirty_since_ms < AUTOSAVE_INTERVAL_MS)
+    return;
+
+  Snapshot *snapshot = take_snapshot (page);
+  autosave->snapshot_ms = now_ms () - now;
+  if (autosave->snapshot_ms > autosave->snapshot_ms_max)
+    autosave->snapshot_ms_max = autosave->snapshot_ms;
+  autosave->dirty_since_ms = 0;
+  autosave->edits = 0;
+
+  pthread_mutex_lock (&autosave->lock);
+  autosave->pending = snapshot;
+  pthread_cond_signal (&autosave->wake);
+  pthread_mutex_unlock (&autosave->lock);
+}
+
+// =============================================================================
+// === Editor
+// =============================================================================
+// Everything a front end needs to drive a page without a window. The keys are
+// the editor's own, a front end maps its input onto them.
+
+// Takes over page, a new one with a single empty line if NULL. path is where
+// EDITOR_KEY_SAVE writes to.
+Editor *
+init_editor (Page *page, const char *path)
+{
+  if (page == NULL)
+    page = init_page ();
+
+  if (page_line_count (page) == 0)
+  {
+    GapBufferLine *first_line
+        = init_gap_buffer_line (page->arena, INIT_SIZE_LINE, GAP_SIZE);
+    page_append_line (page, first_line);
+  }
+
+  Editor *editor = arena_alloc (page->arena, sizeof (Editor));
+  editor->page = page;
+  editor->path = path;
+  editor->page_rows = 1;
+  editor->edits = 0;
+  memset (&editor->compaction, 0, sizeof (Compaction));
+  editor->compaction.last_edit_ms = now_ms ();
+  memset (&editor->search, 0, sizeof (Search));
+  editor->search.arena = page->arena;
+  editor->selections = NULL;
+  editor->selection_count = 0;
+  editor->selection_capacity = 0;
+  editor->primary = 0;
+
+  int first_slot = page_first_slot (page);
+  GapBufferLine *first_line = page_line (page, first_slot);
+  assert (first_line->gap_end + 1 < first_line->buf_size);
+  editor->cursor
+      = init_cursor (page->arena, first_slot, first_line->gap_end + 1);
+
+  return editor;
+}
+
+void
+free_editor (Editor *editor)
+{
+  // The editor and its cursor live in the page arena
+  free_page (editor->page);
+}
+
+void
+editor_edited (Editor *editor, int count)
+{
+  editor->edits += count;
+
+  // A finished compaction has something to look at again
+  editor->compaction.last_edit_ms = now_ms ();
+  editor->compaction.done = 0;
+  editor->search.stale = 1;
+}
+
+// UTF-8 that goes in front of editor->cursor, '\n' splits the line like
+// Enter. Other control chars and bytes that are not valid UTF-8 are dropped.
+void
+editor_insert_at_cursor (Editor *editor, const char *text, int count)
+{
+  Page *page = editor->page;
+  Cursor *cursor = editor->cursor;
+
+  int start = 0;
+  while (start < count)
+  {
+    if (text[start] == '\n')
+    {
+      editor_key_at_cursor (editor, EDITOR_KEY_ENTER);
+      start++;
+      continue;
+    }
+
+    int end = start;
+    while (end < count)
+    {
+      int codepoint;
+      int length = utf8_decode (text + end, count - end, &codepoint);
+      if (codepoint < 32 || codepoint == 127
+          || (codepoint == UTF8_REPLACEMENT && length == 1))
+        break;
+      end += length;
+    }
+    if (end == start)
+    {
+      start++;
+      continue;
+    }
+
+    // The whole run goes in with one gap move
+    GapBufferLine *line = page_line (page, cursor->line);
+    insert_span_line (
+        line,
+        line_column (line, cursor->pos),
+        (char *)text + start,
+        end - start);
+    page_line_changed (page, cursor->line);
+    cursor->pos = line->gap_end + 1;
+
+    editor_edited (editor, end - start);
+    start = end;
+  }
+}
+
+// A key at editor->cursor alone, the selections are not looked at. 0, or
+// what save_page returned for EDITOR_KEY_SAVE.
+int
+editor_key_at_cursor (Editor *editor, EditorKey key)
+{
+  Page *page = editor->page;
+  Cursor *cursor = editor->cursor;
+  GapBufferLine *current_line = page_line (page, cursor->line);
+
+  switch (key)
+  {
+  case EDITOR_KEY_NONE:
+    break;
+
+  case EDITOR_KEY_UP:
+  {
+    int column = line_column (current_line, cursor->pos);
+    int index = line_char_index (current_line, column);
+    if (move_cursor_previous_line (cursor, page) == 0)
+      move_cursor_char (cursor, page, index);
+    break;
+  }
+
+  case EDITOR_KEY_DOWN:
+  {
+    int column = line_column (current_line, cursor->pos);
+    int index = line_char_index (current_line, column);
+    if (move_cursor_next_line (cursor, page) == 0)
+      move_cursor_char (cursor, page, index);
+    break;
+  }
+
+  case EDITOR_KEY_PAGE_UP:
+  case EDITOR_KEY_PAGE_DOWN:
+  {
+    int column = line_column (current_line, cursor->pos);
+    int index = line_char_index (current_line, column);
+    int row = page_slot_to_row (page, cursor->line)
+              + (key == EDITOR_KEY_PAGE_UP ? -editor->page_rows
+                                           : editor->page_rows);
+
+    if (row < 0)
+      row = 0;
+    if (row >= page_line_count (page))
+      row = page_line_count (page) - 1;
+
+    cursor->line = page_row_to_slot (page, row);
+    move_cursor_char (cursor, page, index);
+    break;
+  }
+
+  // A whole char at a time, onto the next or previous line at the ends
+  case EDITOR_KEY_RIGHT:
+  {
+    int column = line_column (current_line, cursor->pos);
+    if (column < line_length (current_line))
+    {
+      cursor->pos
+          = line_pos (current_line, line_next_char (current_line, column));
+    }
+    else if (move_cursor_next_line (cursor, page) == 0)
+    {
+      move_cursor (cursor, page, 0);
+    }
+    break;
+  }
+
+  case EDITOR_KEY_LEFT:
+  {
+    int column = line_column (current_line, cursor->pos);
+    if (column > 0)
+    {
+      cursor->pos
+          = line_pos (current_line, line_prev_char (current_line, column));
+    }
+    else if (move_cursor_previous_line (cursor, page) == 0)
+    {
+      current_line = page_line (page, cursor->line);
+      move_cursor (cursor, page, current_line->buf_size - 1);
+    }
+    break;
+  }
+
+  case EDITOR_KEY_BACKSPACE:
+  {
+    int column = line_column (current_line, cursor->pos);
+    int previous = page_prev_slot (page, cursor->line);
+
+    if (column > 0)
+    {
+      int start = line_prev_char (current_line, column);
+      delete_range_line (current_line, start, column - start);
+      page_line_changed (page, cursor->line);
+      cursor->pos = current_line->gap_end + 1;
+    }
+    else if (previous >= 0)
+    {
+      int previous_length = line_length (page_line (page, previous));
+
+      cursor->line = page_join_next_line (page, previous);
+      current_line = page_line (page, cursor->line);
+      cursor->pos = line_pos (current_line, previous_length);
+    }
+    editor_edited (editor, 1);
+    break;
+  }
+
+  case EDITOR_KEY_ENTER:
+  {
+    int column = line_column (current_line, cursor->pos);
+
+    cursor->line = page_split_line (page, cursor->line, column);
+    current_line = page_line (page, cursor->line);
+    cursor->pos = current_line->gap_end + 1;
+    editor_edited (editor, 1);
+    break;
+  }
+
+  case EDITOR_KEY_SAVE:
+    return save_page (page, editor->path);
+
+  // The multi cursor keys, see editor_apply_key
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+// Puts the cursor on slot, as close to column as the line allows
+void
+editor_move_cursor (Editor *editor, int slot, int column)
+{
+  // A click or a jump leaves just the one cursor
+  editor->selection_count = 0;
+  editor->cursor->line = slot;
+  move_cursor_column (editor->cursor, editor->page, column);
+}
+
+// As many whole lines from the top as fit in buffer, returns how many
+int
+editor_text (Editor *editor, char *buffer, int size)
+{
+  Page *page = editor->page;
+  int line_count = 0;
+  int pos = 0;
+  for (int slot = page_first_slot (page); slot >= 0;
+       slot = page_next_slot (page, slot))
+  {
+    LineView view = page_line_view (page, slot);
+
+    // Only whole lines, and keep room for the '\0'
+    if (pos + view.before_size + view.after_size + 1 >= size)
+      break;
+
+    memcpy (buffer + pos, view.before, view.before_size);
+    pos += view.before_size;
+    memcpy (buffer + pos, view.after, view.after_size);
+    pos += view.after_size;
+    buffer[pos] = '\n';
+    pos++;
+    line_count++;
+  }
+  buffer[pos] = '\0';
+  return line_count;
+}
+
+// =============================================================================
+// === Multi Cursor
+// =============================================================================
+// Ctrl+click adds a cursor, Shift with the arrows selects and the find bar can
+// turn every match into a selection. Each cursor is a Selection on row and
+// column, editor->cursor is put on one of them at a time to do the edit there
+// with the same code as the one cursor, and stays on the primary one.
+//
+// Whatever is typed or pressed in a frame goes to all of them as one batch,
+// with the cursors in page order. That way the gap of each line and the gap
+// of the page only ever move forward through a batch, instead of back and
+// forth once per cursor. An edit only moves the text after it, so where a
+// cursor is now is where it was before the batch, moved by the edit just
+// before it.
+
+// Below 0, 0 or above 0, as for qsort
+int
+compare_position (int row, int column, int other_row, int other_column)
+{
+  if (row != other_row)
+    return row < other_row ? -1 : 1;
+  return (column > other_column) - (column < other_column);
+}
+
+// 1 when the cursor is at the end of its selection
+int
+selection_forward (Selection *selection)
+{
+  return compare_position (
+             selection->anchor_row,
+             selection->anchor_column,
+             selection->row,
+             selection->column)
+         <= 0;
+}
+
+// 1 for a cursor with nothing selected
+int
+selection_empty (Selection *selection)
+{
+  return selection->row == selection->anchor_row
+         && selection->column == selection->anchor_column;
+}
+
+// Where the selection starts and ends in page order
+void
+selection_range (
+    Selection *selection,
+    int *start_row,
+    int *start_column,
+    int *end_row,
+    int *end_column)
+{
+  int forward = selection_forward (selection);
+  *start_row = forward ? selection->anchor_row : selection->row;
+  *start_column = forward ? selection->anchor_column : selection->column;
+  *end_row = forward ? selection->row : selection->anchor_row;
+  *end_column = forward ? selection->column : selection->anchor_column;
+}
+
+int
+compare_selections (const void *a, const void *b)
+{
+  int a_row, a_column, b_row, b_column, end_row, end_column;
+  selection_range ((Selection *)a, &a_row, &a_column, &end_row, &end_column);
+  selection_range ((Selection *)b, &b_row, &b_column, &end_row, &end_column);
+  return compare_position (a_row, a_column, b_row, b_column);
+}
+
+// Where a position from before the batch is now, the edit before it took the
+// text up to old_row and old_column and left it at new_row and new_column
+void
+shift_position (
+    int *row,
+    int *column,
+    int old_row,
+    int old_column,
+    int new_row,
+    int new_column)
+{
+  if (*row == old_row)
+  {
+    *row = new_row;
+    *column += new_column - old_column;
+  }
+  else
+  {
+    *row += new_row - old_row;
+  }
+}
+
+// editor->cursor on row, as close to column as the line allows
+void
+editor_load_cursor (Editor *editor, int row, int column)
+{
+  editor->cursor->line = page_row_to_slot (editor->page, row);
+  move_cursor_column (editor->cursor, editor->page, column);
+}
+
+void
+editor_cursor_position (Editor *editor, int *row, int *column)
+{
+  Cursor *cursor = editor->cursor;
+  GapBufferLine *line = page_line (editor->page, cursor->line);
+  *row = page_slot_to_row (editor->page, cursor->line);
+  *column = line_column (line, cursor->pos);
+}
+
+// Room for one more selection at the end
+Selection *
+editor_push_selection (Editor *editor)
+{
+  if (editor->selection_count == editor->selection_capacity)
+  {
+    int capacity = editor->selection_capacity;
+    editor->selection_capacity = capacity == 0 ? 16 : capacity * 2;
+    if (editor->selections == NULL)
+      editor->selections = arena_alloc (
+          editor->page->arena,
+          editor->selection_capacity * sizeof (Selection));
+    else
+      editor->selections = arena_resize (
+          editor->page->arena,
+          editor->selections,
+          capacity * sizeof (Selection),
+          editor->selection_capacity * sizeof (Selection));
+  }
+  editor->selection_count++;
+  return &editor->selections[editor->selection_count - 1];
+}
+
+// The one cursor becomes the first of many
+void
+editor_push_cursor (Editor *editor)
+{
+  int row, column;
+  editor_cursor_position (editor, &row, &column);
+  *editor_push_selection (editor) = (Selection){ row, column, row, column };
+  editor->primary = editor->selection_count - 1;
+}
+
+// Sorts the selections if they are out of order, merges the ones that
+// overlap and puts the cursor on the primary one. Selections that only touch
+// stay apart, like the matches of a rename next to each other, a cursor that
+// meets another one or a selection joins it. One cursor with nothing selected
+// is the editor without selections again.
+void
+editor_normalize_cursors (Editor *editor)
+{
+  Selection *selections = editor->selections;
+  int count = editor->selection_count;
+  Selection primary = selections[editor->primary];
+
+  // After a batch or an add in page order there is nothing to sort
+  for (int i = 1; i < count; i++)
+  {
+    if (compare_selections (&selections[i - 1], &selections[i]) > 0)
+    {
+      qsort (selections, count, sizeof (Selection), compare_selections);
+      break;
+    }
+  }
+
+  int kept = 0;
+  for (int i = 0; i < count; i++)
+  {
+    Selection *selection = &selections[i];
+    int is_primary = memcmp (selection, &primary, sizeof (Selection)) == 0;
+
+    int start_row, start_column, end_row, end_column;
+    selection_range (
+        selection,
+        &start_row,
+        &start_column,
+        &end_row,
+        &end_column);
+
+    if (kept > 0)
+    {
+      Selection *last = &selections[kept - 1];
+      int last_start_row, last_start_column, last_end_row, last_end_column;
+      selection_range (
+          last,
+          &last_start_row,
+          &last_start_column,
+          &last_end_row,
+          &last_end_column);
+
+      int order = compare_position (
+          start_row,
+          start_column,
+          last_end_row,
+          last_end_column);
+      int empty = selection_empty (selection) || selection_empty (last);
+      if (order < 0 || (order == 0 && empty))
+      {
+        // One selection over both, facing the way the later one does
+        if (compare_position (
+                end_row,
+                end_column,
+                last_end_row,
+                last_end_column)
+            < 0)
+        {
+          end_row = last_end_row;
+          end_column = last_end_column;
+        }
+        if (selection_forward (selection))
+          *last = (Selection){
+            end_row, end_column, last_start_row, last_start_column
+          };
+        else
+          *last = (Selection){
+            last_start_row, last_start_column, end_row, end_column
+          };
+        if (is_primary)
+          editor->primary = kept - 1;
+        continue;
+      }
+    }
+
+    selections[kept] = *selection;
+    if (is_primary)
+      editor->primary = kept;
+    kept++;
+  }
+  editor->selection_count = kept;
+
+  Selection *kept_primary = &selections[editor->primary];
+  editor_load_cursor (editor, kept_primary->row, kept_primary->column);
+  if (kept == 1 && kept_primary->row == kept_primary->anchor_row
+      && kept_primary->column == kept_primary->anchor_column)
+    editor->selection_count = 0;
+}
+
+// A new primary cursor on row and column, next to the ones there are
+void
+editor_add_cursor (Editor *editor, int row, int column)
+{
+  if (row < 0 || row >= page_line_count (editor->page))
+    return;
+
+  if (editor->selection_count == 0)
+    editor_push_cursor (editor);
+
+  editor_load_cursor (editor, row, column);
+  editor_cursor_position (editor, &row, &column);
+  *editor_push_selection (editor) = (Selection){ row, column, row, column };
+  editor->primary = editor->selection_count - 1;
+
+  // Adding in page order, as a trace of the find bar does, needs no sort
+  int start_row, start_column, end_row, end_column;
+  selection_range (
+      &editor->selections[editor->selection_count - 2],
+      &start_row,
+      &start_column,
+      &end_row,
+      &end_column);
+  if (compare_position (row, column, end_row, end_column) > 0)
+    return;
+
+  editor_normalize_cursors (editor);
+}
+
+// The primary cursor goes to row and column, its selection still starts
+// where it did
+void
+editor_select_to (Editor *editor, int row, int column)
+{
+  if (row < 0 || row >= page_line_count (editor->page))
+    return;
+
+  if (editor->selection_count == 0)
+    editor_push_cursor (editor);
+
+  editor_load_cursor (editor, row, column);
+  editor_cursor_position (editor, &row, &column);
+  Selection *selection = &editor->selections[editor->primary];
+  selection->row = row;
+  selection->column = column;
+
+  // The last one growing forward stays in order and apart
+  int count = editor->selection_count;
+  if (count > 1 && editor->primary == count - 1)
+  {
+    int start_row, start_column, end_row, end_column;
+    int last_start_row, last_start_column, last_end_row, last_end_column;
+    selection_range (
+        selection,
+        &start_row,
+        &start_column,
+        &end_row,
+        &end_column);
+    selection_range (
+        &editor->selections[count - 2],
+        &last_start_row,
+        &last_start_column,
+        &last_end_row,
+        &last_end_column);
+    if (compare_position (
+            start_row,
+            start_column,
+            last_end_row,
+            last_end_column)
+        > 0)
+      return;
+  }
+
+  editor_normalize_cursors (editor);
+}
+
+// Back to the one cursor, where the primary one is
+void
+editor_clear_cursors (Editor *editor)
+{
+  editor->selection_count = 0;
+}
+
+// Every match of the search becomes a selection, the first one from the
+// cursor on is the primary one. How many there are.
+int
+editor_select_matches (Editor *editor)
+{
+  Page *page = editor->page;
+  Search *search = &editor->search;
+  if (search->stale)
+    search_set_query (search, page, search->query, search->size);
+  if (search->count == 0)
+    return 0;
+
+  int row, column;
+  editor_cursor_position (editor, &row, &column);
+  int next = search_next (search, row, column);
+
+  editor->selection_count = 0;
+  for (int i = 0; i < search->count; i++)
+  {
+    SearchMatch *match = &search->matches[i];
+    *editor_push_selection (editor) = (Selection){ match->row,
+                                                   match->column + match->size,
+                                                   match->row,
+                                                   match->column };
+  }
+  editor->primary = next >= 0 ? next : 0;
+  editor_normalize_cursors (editor);
+
+  return search->count;
+}
+
+// Takes out the text from start to end, which can be rows apart
+void
+editor_delete_range (
+    Editor *editor,
+    int start_row,
+    int start_column,
+    int end_row,
+    int end_column)
+{
+  Page *page = editor->page;
+  int slot = page_row_to_slot (page, start_row);
+  GapBufferLine *line = page_line (page, slot);
+
+  if (start_row == end_row)
+  {
+    delete_range_line (line, start_column, end_column - start_column);
+    page_line_changed (page, slot);
+    editor_edited (editor, end_column - start_column);
+    return;
+  }
+
+  // The tail of the first row, the rows in between and the head of the last
+  // one, then what is left of the two becomes one line
+  delete_range_line (line, start_column, line_length (line) - start_column);
+  page_line_changed (page, slot);
+  for (int row = start_row + 1; row < end_row; row++)
+    page_delete_line (page, page_row_to_slot (page, start_row + 1));
+
+  int last = page_row_to_slot (page, start_row + 1);
+  delete_range_line (page_line (page, last), 0, end_column);
+  page_line_changed (page, last);
+  page_join_next_line (page, page_row_to_slot (page, start_row));
+  editor_edited (editor, end_row - start_row);
+}
+
+// The same key or text at every cursor, in page order. Text when it is not
+// NULL, else EDITOR_KEY_ENTER or EDITOR_KEY_BACKSPACE. What is selected goes
+// first, a Backspace on a selection only takes that out.
+void
+editor_edit_cursors (
+    Editor *editor,
+    EditorKey key,
+    const char *text,
+    int count)
+{
+  // Where the edit before ended, before the batch and now
+  int old_row = -1;
+  int old_column = 0;
+  int new_row = -1;
+  int new_column = 0;
+
+  for (int i = 0; i < editor->selection_count; i++)
+  {
+    Selection *selection = &editor->selections[i];
+    int start_row, start_column, end_row, end_column;
+    selection_range (
+        selection,
+        &start_row,
+        &start_column,
+        &end_row,
+        &end_column);
+    int selected = start_row != end_row || start_column != end_column;
+
+    int next_old_row = end_row;
+    int next_old_column = end_column;
+    shift_position (
+        &start_row,
+        &start_column,
+        old_row,
+        old_column,
+        new_row,
+        new_column);
+    shift_position (
+        &end_row,
+        &end_column,
+        old_row,
+        old_column,
+        new_row,
+        new_column);
+
+    if (selected)
+      editor_delete_range (
+          editor,
+          start_row,
+          start_column,
+          end_row,
+          end_column);
+    editor_load_cursor (editor, start_row, start_column);
+    if (text != NULL)
+      editor_insert_at_cursor (editor, text, count);
+    else if (!selected || key != EDITOR_KEY_BACKSPACE)
+      editor_key_at_cursor (editor, key);
+
+    old_row = next_old_row;
+    old_column = next_old_column;
+    editor_cursor_position (editor, &new_row, &new_column);
+    *selection = (Selection){ new_row, new_column, new_row, new_column };
+  }
+
+  editor_normalize_cursors (editor);
+}
+
+// Moves every cursor the way key moves the one, select keeps where the
+// selections started and else they go
+void
+editor_move_cursors (Editor *editor, EditorKey key, int select)
+{
+  for (int i = 0; i < editor->selection_count; i++)
+  {
+    Selection *selection = &editor->selections[i];
+    editor_load_cursor (editor, selection->row, selection->column);
+    editor_key_at_cursor (editor, key);
+    editor_cursor_position (editor, &selection->row, &selection->column);
+    if (!select)
+    {
+      selection->anchor_row = selection->row;
+      selection->anchor_column = selection->column;
+    }
+  }
+
+  editor_normalize_cursors (editor);
+}
+
+// UTF-8 that goes in front of every cursor, see editor_insert_at_cursor
+void
+editor_insert_text (Editor *editor, const char *text, int count)
+{
+  if (editor->selection_count == 0)
+    editor_insert_at_cursor (editor, text, count);
+  else if (count > 0)
+    editor_edit_cursors (editor, EDITOR_KEY_NONE, text, count);
+}
+
+// 0, or what save_page returned for EDITOR_KEY_SAVE
+int
+editor_apply_key (Editor *editor, EditorKey key)
+{
+  switch (key)
+  {
+  case EDITOR_KEY_SELECT_UP:
+  case EDITOR_KEY_SELECT_DOWN:
+  case EDITOR_KEY_SELECT_LEFT:
+  case EDITOR_KEY_SELECT_RIGHT:
+    if (editor->selection_count == 0)
+      editor_push_cursor (editor);
+    editor_move_cursors (
+        editor,
+        EDITOR_KEY_UP + (key - EDITOR_KEY_SELECT_UP),
+        1);
+    return 0;
+
+  case EDITOR_KEY_ESCAPE:
+    editor_clear_cursors (editor);
+    return 0;
+
+  case EDITOR_KEY_BACKSPACE:
+  case EDITOR_KEY_ENTER:
+    if (editor->selection_count == 0)
+      break;
+    editor_edit_cursors (editor, key, NULL, 0);
+    return 0;
+
+  case EDITOR_KEY_NONE:
+  case EDITOR_KEY_SAVE:
+    break;
+
+  default:
+    if (editor->selection_count == 0)
+      break;
+    editor_move_cursors (editor, key, 0);
+    return 0;
+  }
+
+  return editor_key_at_cursor (editor, key);
+}
+
+// =============================================================================
+// === Regex
+// =============================================================================
+// Patterns for the find bar: literals in UTF-8, . [] [^] \d \w \s and their
+// capitals, () |, * + ? {n} {n,} {n,m}, and ^ $ for the ends of the line. A
+// class is ASCII ranges and single chars, [^...] and the capitals match every
+// char that is not ASCII.
+//
+// The pattern is parsed into nodes and compiled twice into one NFA, once
+// forward and once backward. Nothing runs the NFA itself, two DFAs are built
+// from it a state at a time as the bytes come in and kept, so a line is one
+// table lookup per byte once the states it needs exist. The reversed one
+// runs from the end of the line back, starting anew at every byte, and says
+// at which bytes a match starts. The forward one runs from such a start and
+// says where the longest match ends. Both walk the text around the gap of a
+// line as it is, nothing gets copied out.
+
+// Room for one more in an array that doubles
+void *
+regex_grow (Arena *arena, void *array, int *capacity, int count, size_t size)
+{
+  if (count < *capacity)
+    return array;
+
+  int old_capacity = *capacity;
+  *capacity = old_capacity == 0 ? 16 : old_capacity * 2;
+  if (array == NULL)
+    return arena_alloc (arena, *capacity * size);
+  return arena_resize (arena, array, old_capacity * size, *capacity * size);
+}
+
+Regex *
+init_regex (Arena *arena)
+{
+  Regex *regex = arena_alloc (arena, sizeof (Regex));
+  memset (regex, 0, sizeof (Regex));
+  regex->arena = arena;
+  return regex;
+}
+
+void
+free_regex_dfa (Regex *regex, RegexDfa *dfa)
+{
+  arena_free (regex->arena, dfa->states, dfa->capacity * sizeof (RegexState));
+  arena_free (regex->arena, dfa->next, dfa->capacity * 256 * sizeof (int));
+  arena_free (regex->arena, dfa->sets, dfa->sets_capacity * sizeof (int));
+  arena_free (regex->arena, dfa->table, 2 * REGEX_MAX_STATES * sizeof (int));
+  memset (dfa, 0, sizeof (RegexDfa));
+}
+
+// Everything but the Regex itself, so it can compile again
+void
+clear_regex (Regex *regex)
+{
+  Arena *arena = regex->arena;
+  free_regex_dfa (regex, &regex->forward);
+  free_regex_dfa (regex, &regex->reverse);
+  arena_free (arena, regex->nodes, regex->node_capacity * sizeof (RegexNode));
+  arena_free (
+      arena,
+      regex->program,
+      regex->program_capacity * sizeof (RegexInst));
+  arena_free (arena, regex->list, regex->program_size * sizeof (int));
+  arena_free (
+      arena,
+      regex->stack,
+      (2 * regex->program_size + 1) * sizeof (int));
+  arena_free (arena, regex->marks, regex->program_size * sizeof (int));
+  arena_free (arena, regex->starts, regex->start_capacity * sizeof (int));
+  arena_free (arena, regex->literal, regex->pattern_size);
+
+  memset (regex, 0, sizeof (Regex));
+  regex->arena = arena;
+}
+
+void
+free_regex (Regex *regex)
+{
+  clear_regex (regex);
+  arena_free (regex->arena, regex, sizeof (Regex));
+}
+
+// --- Parse
+
+int
+regex_node (
+    Regex *regex,
+    RegexNodeKind kind,
+    int low,
+    int high,
+    int left,
+    int right)
+{
+  regex->nodes = regex_grow (
+      regex->arena,
+      regex->nodes,
+      &regex->node_capacity,
+      regex->node_count,
+      sizeof (RegexNode));
+  regex->nodes[regex->node_count]
+      = (RegexNode){ kind, low, high, left, right };
+  regex->node_count++;
+  return regex->node_count - 1;
+}
+
+int
+regex_range (Regex *regex, int low, int high)
+{
+  return regex_node (regex, REGEX_NODE_RANGE, low, high, -1, -1);
+}
+
+int
+regex_concat (Regex *regex, int left, int right)
+{
+  if (left < 0 || right < 0)
+    return left < 0 ? right : left;
+  return regex_node (regex, REGEX_NODE_CONCAT, 0, 0, left, right);
+}
+
+int
+regex_alternate (Regex *regex, int left, int right)
+{
+  if (left < 0 || right < 0)
+    return left < 0 ? right : left;
+  return regex_node (regex, REGEX_NODE_ALTERNATE, 0, 0, left, right);
+}
+
+// Any char that is not ASCII, as its UTF-8
+int
+regex_any_multibyte (Regex *regex)
+{
+  int tail = regex_range (regex, 0x80, 0xbf);
+  int two = regex_concat (regex, regex_range (regex, 0xc2, 0xdf), tail);
+  int three = regex_concat (
+      regex,
+      regex_range (regex, 0xe0, 0xef),
+      regex_node (regex, REGEX_NODE_REPEAT, 2, 2, tail, -1));
+  int four = regex_concat (
+      regex,
+      regex_range (regex, 0xf0, 0xf4),
+      regex_node (regex, REGEX_NODE_REPEAT, 3, 3, tail, -1));
+  return regex_alternate (
+      regex,
+      regex_alternate (regex, two, three),
+      four);
+}
+
+// The codepoint as the bytes of its UTF-8 one after the other
+int
+regex_literal (Regex *regex, int codepoint)
+{
+  char bytes[UTF8_MAX_SIZE];
+  int size = utf8_encode (codepoint, bytes);
+  int node = -1;
+  for (int i = 0; i < size; i++)
+  {
+    unsigned char byte = bytes[i];
+    node = regex_concat (regex, node, regex_range (regex, byte, byte));
+  }
+  return node;
+}
+
+// The ASCII bytes set in ascii as ranges, and every other char if negated
+int
+regex_class_node (Regex *regex, const unsigned char *ascii, int negated)
+{
+  int node = -1;
+  int low = -1;
+  for (int byte = 0; byte <= 128; byte++)
+  {
+    int in = byte < 128 && (ascii[byte] != 0) != negated;
+    if (in && low < 0)
+      low = byte;
+    if (!in && low >= 0)
+    {
+      node = regex_alternate (regex, node, regex_range (regex, low, byte - 1));
+      low = -1;
+    }
+  }
+  if (negated)
+    node = regex_alternate (regex, node, regex_any_multibyte (regex));
+  return node;
+}
+
+// Sets the bytes of \d \w \s in ascii, 0 if letter is none of them
+int
+regex_class_escape (int letter, unsigned char *ascii)
+{
+  const char *members;
+  switch (letter | 0x20)
+  {
+  case 'd':
+    members = "0123456789";
+    break;
+  case 'w':
+    members = "0123456789_abcdefghijklmnopqrstuvwxyz"
+              "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    break;
+  case 's':
+    members = " \t\r\f\v";
+    break;
+  default:
+    return 0;
+  }
+  for (; *members != '\0'; members++)
+    ascii[(unsigned char)*members] = 1;
+  return 1;
+}
+
+// The codepoint at regex->at and past it. A byte that is not UTF-8 would
+// compile to the 3 bytes of UTF8_REPLACEMENT, more literal than the pattern
+// has room for, so it is an error instead.
+int
+regex_decode (Regex *regex)
+{
+  int codepoint;
+  const char *text = regex->pattern + regex->at;
+  int length
+      = utf8_decode (text, regex->pattern_size - regex->at, &codepoint);
+  if (codepoint == UTF8_REPLACEMENT && length == 1)
+  {
+    regex->error = "invalid UTF-8";
+    return -1;
+  }
+  regex->at += length;
+  return codepoint;
+}
+
+// The char at regex->at, escapes taken care of, and past it
+int
+regex_next_char (Regex *regex)
+{
+  int codepoint = regex_decode (regex);
+  if (codepoint != '\\')
+    return codepoint;
+
+  if (regex->at == regex->pattern_size)
+  {
+    regex->error = "unfinished escape";
+    return -1;
+  }
+  codepoint = regex_decode (regex);
+  if (codepoint < 0)
+    return -1;
+  switch (codepoint)
+  {
+  case 't':
+    return '\t';
+  case 'n':
+    return '\n';
+  case 'r':
+    return '\r';
+  default:
+    // Letters are kept for escapes that may mean something some day
+    if ((codepoint | 0x20) >= 'a' && (codepoint | 0x20) <= 'z')
+    {
+      regex->error = "unknown escape";
+      return -1;
+    }
+    return codepoint;
+  }
+}
+
+int
+regex_parse_class (Regex *regex)
+{
+  unsigned char ascii[128] = { 0 };
+  int others = -1;
+  int negated = 0;
+  int first = 1;
+
+  if (regex->at < regex->pattern_size && regex->pattern[regex->at] == '^')
+  {
+    negated = 1;
+    regex->at++;
+  }
+  while (regex->at < regex->pattern_size)
+  {
+    char c = regex->pattern[regex->at];
+    if (c == ']' && !first)
+    {
+      regex->at++;
+      int node = regex_class_node (regex, ascii, negated);
+      if (!negated)
+        node = regex_alternate (regex, node, others);
+      if (node < 0)
+        regex->error = "empty class";
+      return node;
+    }
+    first = 0;
+
+    if (c == '\\' && regex->at + 1 < regex->pattern_size
+        && regex_class_escape (regex->pattern[regex->at + 1], ascii))
+    {
+      // The capitals inside a class would need a class of their own
+      if (regex->pattern[regex->at + 1] < 'a')
+      {
+        regex->error = "\\D \\W \\S in a class";
+        return -1;
+      }
+      regex->at += 2;
+      continue;
+    }
+
+    int low = regex_next_char (regex);
+    int high = low;
+    if (regex->at + 1 < regex->pattern_size && regex->pattern[regex->at] == '-'
+        && regex->pattern[regex->at + 1] != ']')
+    {
+      regex->at++;
+      high = regex_next_char (regex);
+    }
+    if (regex->error != NULL)
+      return -1;
+
+    if (low > high || (low != high && high >= 128))
+    {
+      regex->error = "bad range";
+      return -1;
+    }
+    if (low >= 128)
+      others = regex_alternate (regex, others, regex_literal (regex, low));
+    for (int byte = low; byte <= high && byte < 128; byte++)
+      ascii[byte] = 1;
+  }
+  regex->error = "unfinished class";
+  return -1;
+}
+
+int regex_parse_alternate (Regex *regex);
+
+int
+regex_parse_atom (Regex *regex)
+{
+  char c = regex->pattern[regex->at];
+  switch (c)
+  {
+  case '(':
+  {
+    regex->at++;
+    int node = regex_parse_alternate (regex);
+    if (regex->error != NULL)
+      return -1;
+    if (regex->at == regex->pattern_size)
+    {
+      regex->error = "unmatched (";
+      return -1;
+    }
+    regex->at++;
+    return node < 0 ? regex_node (regex, REGEX_NODE_EMPTY, 0, 0, -1, -1)
+                    : node;
+  }
+  case '[':
+    regex->at++;
+    return regex_parse_class (regex);
+  case '.':
+  {
+    regex->at++;
+    unsigned char ascii[128] = { 0 };
+    return regex_class_node (regex, ascii, 1);
+  }
+  case '^':
+    regex->at++;
+    return regex_node (regex, REGEX_NODE_LINE_START, 0, 0, -1, -1);
+  case '$':
+    regex->at++;
+    return regex_node (regex, REGEX_NODE_LINE_END, 0, 0, -1, -1);
+  case '*':
+  case '+':
+  case '?':
+    regex->error = "nothing to repeat";
+    return -1;
+  case '\\':
+    if (regex->at + 1 < regex->pattern_size)
+    {
+      char letter = regex->pattern[regex->at + 1];
+      unsigned char ascii[128] = { 0 };
+      if (regex_class_escape (letter, ascii))
+      {
+        regex->at += 2;
+        return regex_class_node (regex, ascii, letter < 'a');
+      }
+    }
+    // A plain escaped char
+    // fall through
+  default:
+  {
+    int codepoint = regex_next_char (regex);
+    return codepoint < 0 ? -1 : regex_literal (regex, codepoint);
+  }
+  }
+}
+
+// A number for {n,m}, -1 if there is none
+int
+regex_parse_count (Regex *regex)
+{
+  int count = -1;
+  while (regex->at < regex->pattern_size && regex->pattern[regex->at] >= '0'
+         && regex->pattern[regex->at] <= '9')
+  {
+    if (count < 0)
+      count = 0;
+    count = count * 10 + regex->pattern[regex->at] - '0';
+    if (count > REGEX_MAX_REPEAT)
+      count = REGEX_MAX_REPEAT + 1;
+    regex->at++;
+  }
+  return count;
+}
+
+int
+regex_parse_repeat (Regex *regex)
+{
+  int node = regex_parse_atom (regex);
+  while (regex->error == NULL && regex->at < regex->pattern_size)
+  {
+    int low;
+    int high;
+    char c = regex->pattern[regex->at];
+    if (c == '*')
+    {
+      low = 0;
+      high = -1;
+    }
+    else if (c == '+')
+    {
+      low = 1;
+      high = -1;
+    }
+    else if (c == '?')
+    {
+      low = 0;
+      high = 1;
+    }
+    else if (c == '{' && regex->at + 1 < regex->pattern_size
+             && regex->pattern[regex->at + 1] >= '0'
+             && regex->pattern[regex->at + 1] <= '9')
+    {
+      // {n}, {n,} and {n,m}, a { that starts none of them is a literal
+      regex->at++;
+      low = regex_parse_count (regex);
+      high = low;
+      if (regex->at < regex->pattern_size && regex->pattern[regex->at] == ',')
+      {
+        regex->at++;
+        high = regex_parse_count (regex);
+      }
+      if (regex->at == regex->pattern_size || regex->pattern[regex->at] != '}'
+          || low > REGEX_MAX_REPEAT || high > REGEX_MAX_REPEAT
+          || (high >= 0 && high < low))
+      {
+        regex->error = "bad repeat";
+        return -1;
+      }
+    }
+    else
+    {
+      break;
+    }
+    regex->at++;
+    node = regex_node (regex, REGEX_NODE_REPEAT, low, high, node, -1);
+  }
+  return node;
+}
+
+int
+regex_parse_concat (Regex *regex)
+{
+  int node = -1;
+  while (regex->error == NULL && regex->at < regex->pattern_size
+         && regex->pattern[regex->at] != '|'
+         && regex->pattern[regex->at] != ')')
+    node = regex_concat (regex, node, regex_parse_repeat (regex));
+  return node;
+}
+
+int
+regex_parse_alternate (Regex *regex)
+{
+  int node = regex_parse_concat (regex);
+  while (regex->error == NULL && regex->at < regex->pattern_size
+         && regex->pattern[regex->at] == '|')
+  {
+    regex->at++;
+    int right = regex_parse_concat (regex);
+    if (node < 0 || right < 0)
+    {
+      regex->error = "empty alternative";
+      return -1;
+    }
+    node = regex_alternate (regex, node, right);
+  }
+  return node;
+}
+
+// 1 if the node matches without reading a byte
+int
+regex_nullable (Regex *regex, int node)
+{
+  RegexNode *n = &regex->nodes[node];
+  switch (n->kind)
+  {
+  case REGEX_NODE_RANGE:
+    return 0;
+  case REGEX_NODE_CONCAT:
+    return regex_nullable (regex, n->left) && regex_nullable (regex, n->right);
+  case REGEX_NODE_ALTERNATE:
+    return regex_nullable (regex, n->left) || regex_nullable (regex, n->right);
+  case REGEX_NODE_REPEAT:
+    return n->low == 0 || regex_nullable (regex, n->left);
+  default:
+    return 1;
+  }
+}
+
+// The longest run of single bytes that every match has one after the
+// other, from the concats at the top
+void
+regex_required (Regex *regex, int node, char *run, int *run_size)
+{
+  RegexNode *n = &regex->nodes[node];
+  switch (n->kind)
+  {
+  case REGEX_NODE_CONCAT:
+    regex_required (regex, n->left, run, run_size);
+    regex_required (regex, n->right, run, run_size);
+    return;
+  case REGEX_NODE_RANGE:
+    if (n->low == n->high)
+    {
+      run[*run_size] = n->low;
+      (*run_size)++;
+      if (*run_size > regex->literal_size)
+      {
+        memcpy (regex->literal, run, *run_size);
+        regex->literal_size = *run_size;
+      }
+      return;
+    }
+    break;
+  case REGEX_NODE_EMPTY:
+  case REGEX_NODE_LINE_START:
+  case REGEX_NODE_LINE_END:
+    return;
+  default:
+    break;
+  }
+  *run_size = 0;
+}
+
+// --- Compile
+
+int
+regex_inst (Regex *regex, RegexOp op, int low, int high, int out, int out1)
+{
+  if (regex->program_size == REGEX_MAX_PROGRAM)
+  {
+    regex->error = "pattern too big";
+    return 0;
+  }
+  regex->program = regex_grow (
+      regex->arena,
+      regex->program,
+      &regex->program_capacity,
+      regex->program_size,
+      sizeof (RegexInst));
+  regex->program[regex->program_size]
+      = (RegexInst){ op, (unsigned char)low, (unsigned char)high, out, out1 };
+  regex->program_size++;
+  return regex->program_size - 1;
+}
+
+// Compiles node to go on to next and returns where it starts. Backwards the
+// halves of a concat swap and so do the ends of the line.
+int
+regex_emit (Regex *regex, int node, int next, int backwards)
+{
+  RegexNode n = regex->nodes[node];
+  if (regex->error != NULL)
+    return 0;
+
+  switch (n.kind)
+  {
+  case REGEX_NODE_EMPTY:
+    return next;
+  case REGEX_NODE_RANGE:
+    return regex_inst (regex, REGEX_RANGE, n.low, n.high, next, -1);
+  case REGEX_NODE_CONCAT:
+    if (backwards)
+      return regex_emit (
+          regex,
+          n.right,
+          regex_emit (regex, n.left, next, backwards),
+          backwards);
+    return regex_emit (
+        regex,
+        n.left,
+        regex_emit (regex, n.right, next, backwards),
+        backwards);
+  case REGEX_NODE_ALTERNATE:
+  {
+    int left = regex_emit (regex, n.left, next, backwards);
+    int right = regex_emit (regex, n.right, next, backwards);
+    return regex_inst (regex, REGEX_SPLIT, 0, 0, left, right);
+  }
+  case REGEX_NODE_REPEAT:
+  {
+    // The copies after low are a loop, or each one may stop early
+    int start = next;
+    if (n.high < 0)
+    {
+      start = regex_inst (regex, REGEX_SPLIT, 0, 0, -1, next);
+      int body = regex_emit (regex, n.left, start, backwards);
+      regex->program[start].out = body;
+    }
+    for (int i = n.low; i < n.high; i++)
+    {
+      int body = regex_emit (regex, n.left, start, backwards);
+      start = regex_inst (regex, REGEX_SPLIT, 0, 0, body, next);
+    }
+    for (int i = 0; i < n.low; i++)
+      start = regex_emit (regex, n.left, start, backwards);
+    return start;
+  }
+  case REGEX_NODE_LINE_START:
+    return regex_inst (
+        regex,
+        backwards ? REGEX_LINE_END : REGEX_LINE_START,
+        0,
+        0,
+        next,
+        -1);
+  case REGEX_NODE_LINE_END:
+    return regex_inst (
+        regex,
+        backwards ? REGEX_LINE_START : REGEX_LINE_END,
+        0,
+        0,
+        next,
+        -1);
+  }
+  return next;
+}
+
+// --- DFA
+
+// Adds pc and what it leads to without reading a byte to the list
+void
+regex_add (Regex *regex, int pc, int line_start, int line_end)
+{
+  int top = 0;
+  regex->stack[top++] = pc;
+  while (top > 0)
+  {
+    pc = regex->stack[--top];
+    if (regex->marks[pc] == regex->mark)
+      continue;
+    regex->marks[pc] = regex->mark;
+
+    RegexInst *inst = &regex->program[pc];
+    switch (inst->op)
+    {
+    case REGEX_SPLIT:
+      regex->stack[top++] = inst->out1;
+      regex->stack[top++] = inst->out;
+      break;
+    case REGEX_LINE_START:
+      if (line_start)
+        regex->stack[top++] = inst->out;
+      break;
+    case REGEX_LINE_END:
+      // Waits in the state for the end of the line
+      regex->list[regex->list_count++] = pc;
+      if (line_end)
+        regex->stack[top++] = inst->out;
+      break;
+    default:
+      regex->list[regex->list_count++] = pc;
+      break;
+    }
+  }
+}
+
+int
+compare_pc (const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+unsigned int
+regex_hash (const int *pcs, int count)
+{
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < count; i++)
+    hash = (hash ^ (unsigned int)pcs[i]) * 16777619u;
+  return hash;
+}
+
+int regex_state (Regex *regex, RegexDfa *dfa);
+int regex_step (Regex *regex, RegexDfa *dfa, int state, int byte);
+
+// Forgets every state and makes the ones every DFA has: dead and the two it
+// starts in
+void
+regex_reset (Regex *regex, RegexDfa *dfa)
+{
+  dfa->count = 0;
+  dfa->sets_count = 0;
+  memset (dfa->table, 0, 2 * REGEX_MAX_STATES * sizeof (int));
+
+  regex->list_count = 0;
+  regex_state (regex, dfa);
+
+  regex->list_count = 0;
+  regex->mark++;
+  regex_add (regex, dfa->start, 1, 0);
+  dfa->line_start = regex_state (regex, dfa);
+
+  regex->list_count = 0;
+  regex->mark++;
+  regex_add (regex, dfa->start, 0, 0);
+  dfa->mid_line = regex_state (regex, dfa);
+
+  // Floating it comes back to mid_line on most bytes, see regex_skip
+  dfa->escape_count = REGEX_MAX_ESCAPES + 1;
+  if (!dfa->floating)
+    return;
+  dfa->escape_count = 0;
+  int low = -1;
+  for (int byte = 0; byte <= 256; byte++)
+  {
+    int escapes = byte < 256
+                  && regex_step (regex, dfa, dfa->mid_line, byte)
+                         != dfa->mid_line;
+    if (escapes && low < 0)
+      low = byte;
+    if (escapes || low < 0)
+      continue;
+
+    if (dfa->escape_count == REGEX_MAX_ESCAPES)
+    {
+      dfa->escape_count++;
+      return;
+    }
+    dfa->escape_low[dfa->escape_count] = low;
+    dfa->escape_high[dfa->escape_count] = byte - 1;
+    dfa->escape_count++;
+    low = -1;
+  }
+}
+
+// The state for the list, made if it is new. Starts over when there are
+// REGEX_MAX_STATES already, the list survives that.
+int
+regex_state (Regex *regex, RegexDfa *dfa)
+{
+  int *pcs = regex->list;
+  int count = regex->list_count;
+  qsort (pcs, count, sizeof (int), compare_pc);
+
+  int mask = 2 * REGEX_MAX_STATES - 1;
+  unsigned int slot = regex_hash (pcs, count) & mask;
+  for (; dfa->table[slot] != 0; slot = (slot + 1) & mask)
+  {
+    RegexState *state = &dfa->states[dfa->table[slot] - 1];
+    if (state->size == count
+        && memcmp (dfa->sets + state->first, pcs, count * sizeof (int)) == 0)
+      return dfa->table[slot] - 1;
+  }
+
+  if (dfa->count == REGEX_MAX_STATES)
+  {
+    // The list is scratch the reset reuses
+    int saved[count > 0 ? count : 1];
+    memcpy (saved, pcs, count * sizeof (int));
+    regex_reset (regex, dfa);
+    dfa->flushes++;
+    memcpy (regex->list, saved, count * sizeof (int));
+    regex->list_count = count;
+    return regex_state (regex, dfa);
+  }
+
+  if (dfa->count == dfa->capacity)
+  {
+    // next grows along with the states
+    int capacity = dfa->capacity;
+    dfa->states = regex_grow (
+        regex->arena,
+        dfa->states,
+        &capacity,
+        dfa->count,
+        sizeof (RegexState));
+    dfa->next = regex_grow (
+        regex->arena,
+        dfa->next,
+        &dfa->capacity,
+        dfa->count,
+        256 * sizeof (int));
+  }
+  while (dfa->sets_count + count > dfa->sets_capacity)
+    dfa->sets = regex_grow (
+        regex->arena,
+        dfa->sets,
+        &dfa->sets_capacity,
+        dfa->sets_capacity,
+        sizeof (int));
+
+  int id = dfa->count;
+  RegexState *state = &dfa->states[id];
+  state->first = dfa->sets_count;
+  state->size = count;
+  state->match = 0;
+  state->end_match = -1;
+  for (int i = 0; i < count; i++)
+    if (regex->program[pcs[i]].op == REGEX_MATCH)
+      state->match = 1;
+  if (count > 0)
+    memcpy (dfa->sets + dfa->sets_count, pcs, count * sizeof (int));
+  dfa->sets_count += count;
+  memset (dfa->next + id * 256, 0xff, 256 * sizeof (int));
+
+  dfa->table[slot] = id + 1;
+  dfa->count++;
+  dfa->built++;
+  return id;
+}
+
+// Builds the transition of state on byte, returns it the way next has it
+int
+regex_step (Regex *regex, RegexDfa *dfa, int state, int byte)
+{
+  RegexState *from = &dfa->states[state];
+  regex->list_count = 0;
+  regex->mark++;
+  for (int i = 0; i < from->size; i++)
+  {
+    RegexInst *inst = &regex->program[dfa->sets[from->first + i]];
+    if (inst->op == REGEX_RANGE && byte >= inst->low && byte <= inst->high)
+      regex_add (regex, inst->out, 0, 0);
+  }
+  if (dfa->floating)
+    regex_add (regex, dfa->start, 0, 0);
+
+  long flushes = dfa->flushes;
+  int id = regex_state (regex, dfa);
+  int next = dfa->states[id].match ? -2 - id : id;
+  // After a flush state is some other state
+  if (dfa->flushes == flushes)
+    dfa->next[state * 256 + byte] = next;
+  return next;
+}
+
+// 1 if state matches when the line ends after it
+int
+regex_end_match (Regex *regex, RegexDfa *dfa, int state)
+{
+  RegexState *at = &dfa->states[state];
+  if (at->end_match >= 0)
+    return at->end_match;
+
+  regex->list_count = 0;
+  regex->mark++;
+  for (int i = 0; i < at->size; i++)
+  {
+    int pc = dfa->sets[at->first + i];
+    if (regex->program[pc].op == REGEX_LINE_END)
+      regex_add (regex, regex->program[pc].out, 0, 1);
+  }
+  at->end_match = at->match;
+  for (int i = 0; i < regex->list_count; i++)
+    if (regex->program[regex->list[i]].op == REGEX_MATCH)
+      at->end_match = 1;
+  return at->end_match;
+}
+
+void
+init_regex_dfa (Regex *regex, RegexDfa *dfa, int start, int floating)
+{
+  dfa->start = start;
+  dfa->floating = floating;
+  dfa->table = arena_alloc (regex->arena, 2 * REGEX_MAX_STATES * sizeof (int));
+  regex_reset (regex, dfa);
+}
+
+// 0 if pattern compiled, 1 with the reason in regex->error if not
+int
+regex_compile (Regex *regex, const char *pattern, int size)
+{
+  clear_regex (regex);
+  regex->pattern = pattern;
+  regex->pattern_size = size;
+
+  int root = regex_parse_alternate (regex);
+  if (regex->error == NULL && regex->at < regex->pattern_size)
+    regex->error = "unmatched )";
+  if (regex->error == NULL && (root < 0 || regex_nullable (regex, root)))
+    regex->error = "matches nothing";
+  if (regex->error != NULL)
+    return 1;
+
+  // A literal byte comes from at least one byte of the pattern
+  char run[size];
+  int run_size = 0;
+  regex->literal = arena_alloc (regex->arena, size);
+  regex_required (regex, root, run, &run_size);
+
+  int match = regex_inst (regex, REGEX_MATCH, 0, 0, -1, -1);
+  int forward = regex_emit (regex, root, match, 0);
+  int reverse = regex_emit (regex, root, match, 1);
+  if (regex->error != NULL)
+    return 1;
+
+  // Every pc goes in the list once per state at most, and on the stack once
+  // for each of the two ways into it
+  int pcs = regex->program_size;
+  regex->list = arena_alloc (regex->arena, pcs * sizeof (int));
+  regex->stack = arena_alloc (regex->arena, (2 * pcs + 1) * sizeof (int));
+  regex->marks = arena_alloc (regex->arena, pcs * sizeof (int));
+  memset (regex->marks, 0, pcs * sizeof (int));
+  init_regex_dfa (regex, &regex->forward, forward, 0);
+  init_regex_dfa (regex, &regex->reverse, reverse, 1);
+  return 0;
+}
+
+// --- Match
+
+// The last byte from i back to end in one of the escape ranges, end - 1 if
+// none is
+int
+regex_skip (RegexDfa *dfa, const unsigned char *bytes, int i, int end)
+{
+  int count = dfa->escape_count;
+
+#ifdef __SSE2__
+  // x is in low .. high when x - low wraps to at most high - low
+  __m128i lows[REGEX_MAX_ESCAPES];
+  __m128i spans[REGEX_MAX_ESCAPES];
+  for (int e = 0; e < count; e++)
+  {
+    lows[e] = _mm_set1_epi8 (dfa->escape_low[e]);
+    spans[e] = _mm_set1_epi8 (dfa->escape_high[e] - dfa->escape_low[e]);
+  }
+  for (; i - 15 >= end; i -= 16)
+  {
+    __m128i block = _mm_loadu_si128 ((const __m128i *)(bytes + i - 15));
+    __m128i in = _mm_setzero_si128 ();
+    for (int e = 0; e < count; e++)
+    {
+      __m128i offset = _mm_sub_epi8 (block, lows[e]);
+      in = _mm_or_si128 (
+          in,
+          _mm_cmpeq_epi8 (_mm_max_epu8 (offset, spans[e]), spans[e]));
+    }
+    int mask = _mm_movemask_epi8 (in);
+    if (mask != 0)
+      return i - 15 + 31 - __builtin_clz (mask);
+  }
+#endif
+  for (; i >= end; i--)
+    for (int e = 0; e < count; e++)
+      if (bytes[i] >= dfa->escape_low[e] && bytes[i] <= dfa->escape_high[e])
+        return i;
+  return i;
+}
+
+// Where matches start from column on, into regex->starts last first.
+// Returns how many.
+int
+regex_starts (Regex *regex, LineView view, int column)
+{
+  RegexDfa *dfa = &regex->reverse;
+  // Backwards the start of the line is its end
+  int state = dfa->line_start;
+  regex->start_count = 0;
+
+  for (int span = 1; span >= 0; span--)
+  {
+    const unsigned char *bytes
+        = (const unsigned char *)(span ? view.after : view.before);
+    int offset = span ? view.before_size : 0;
+    int i = span ? view.after_size : view.before_size;
+    int end = column > offset ? column - offset : 0;
+
+    while (--i >= end)
+    {
+      if (state == dfa->mid_line && dfa->escape_count <= REGEX_MAX_ESCAPES)
+      {
+        i = regex_skip (dfa, bytes, i, end);
+        if (i < end)
+          break;
+      }
+      int next = dfa->next[state * 256 + bytes[i]];
+      if (next <= 0)
+      {
+        if (next == -1)
+          next = regex_step (regex, dfa, state, bytes[i]);
+        if (next < 0)
+        {
+          regex->starts = regex_grow (
+              regex->arena,
+              regex->starts,
+              &regex->start_capacity,
+              regex->start_count,
+              sizeof (int));
+          regex->starts[regex->start_count] = offset + i;
+          regex->start_count++;
+          next = -2 - next;
+        }
+      }
+      state = next;
+    }
+  }
+
+  // The ones that need the ^ at column 0
+  int first = regex->start_count > 0
+                  ? regex->starts[regex->start_count - 1] == 0
+                  : 0;
+  if (column == 0 && !first && regex_end_match (regex, dfa, state))
+  {
+    regex->starts = regex_grow (
+        regex->arena,
+        regex->starts,
+        &regex->start_capacity,
+        regex->start_count,
+        sizeof (int));
+    regex->starts[regex->start_count] = 0;
+    regex->start_count++;
+  }
+  return regex->start_count;
+}
+
+// Where the longest match from start ends, -1 if none starts there
+int
+regex_end (Regex *regex, LineView view, int start)
+{
+  RegexDfa *dfa = &regex->forward;
+  int state = start == 0 ? dfa->line_start : dfa->mid_line;
+  int end = -1;
+
+  for (int span = 0; span < 2; span++)
+  {
+    const unsigned char *bytes
+        = (const unsigned char *)(span ? view.after : view.before);
+    int offset = span ? view.before_size : 0;
+    int size = span ? view.after_size : view.before_size;
+
+    for (int i = start > offset ? start - offset : 0; i < size; i++)
+    {
+      int next = dfa->next[state * 256 + bytes[i]];
+      if (next <= 0)
+      {
+        if (next == -1)
+          next = regex_step (regex, dfa, state, bytes[i]);
+        if (next == 0)
+          return end;
+        if (next < 0)
+        {
+          end = offset + i + 1;
+          next = -2 - next;
+        }
+      }
+      state = next;
+    }
+  }
+
+  if (regex_end_match (regex, dfa, state))
+    end = view.before_size + view.after_size;
+  return end;
+}
+
+// =============================================================================
+// === Search
+// =============================================================================
+// A match never spans lines, a query has no newline in it. A line is searched
+// in its two spans and across the gap between them. Runs of lines that are
+// still mapped are one stretch of the file, those are searched in one go and
+// only the matches get mapped back to their row.
+//
+// Search keeps every match of its query. When the query grows by a char the
+// new matches are the old ones that go on with that char, so a query typed
+// one char at a time scans the page once. A set that stopped at
+// SEARCH_MAX_MATCHES only has the rest of the page behind it to look at.
+
+// Offset of the first match in text, -1 if there is none. With SSE2 16
+// positions at a time are filtered on the first and the last byte of the
+// query and only those that have both get compared, without it memchr finds
+// the candidates.
+long
+find_span (const char *text, long size, const char *query, int query_size)
+{
+  long i = 0;
+  if (query_size <= 0 || size < query_size)
+    return -1;
+
+#ifdef __SSE2__
+  const char *ends = text + query_size - 1;
+  __m128i first = _mm_set1_epi8 (query[0]);
+  __m128i last = _mm_set1_epi8 (query[query_size - 1]);
+  for (; i + query_size - 1 + 32 <= size; i += 32)
+  {
+    __m128i low = _mm_and_si128 (
+        _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(text + i)), first),
+        _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)(ends + i)), last));
+    __m128i high = _mm_and_si128 (
+        _mm_cmpeq_epi8 (
+            _mm_loadu_si128 ((const __m128i *)(text + i + 16)),
+            first),
+        _mm_cmpeq_epi8 (
+            _mm_loadu_si128 ((const __m128i *)(ends + i + 16)),
+            last));
+    // Most blocks have no candidate at all, one test for both halves
+    if (_mm_movemask_epi8 (_mm_or_si128 (low, high)) == 0)
+      continue;
+
+    unsigned int mask = _mm_movemask_epi8 (low)
+                        | (unsigned int)_mm_movemask_epi8 (high) << 16;
+    while (mask != 0)
+    {
+      int bit = __builtin_ctz (mask);
+      if (memcmp (text + i + bit, query, query_size) == 0)
+        return i + bit;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  while (i + query_size <= size)
+  {
+    const char *hit = memchr (text + i, query[0], size - query_size + 1 - i);
+    if (hit == NULL)
+      return -1;
+    i = hit - text;
+    if (memcmp (hit, query, query_size) == 0)
+      return i;
+    i++;
+  }
+  return -1;
+}
+
+// First match in the line at or after column, -1 if there is none
+int
+find_in_view (LineView view, int column, const char *query, int query_size)
+{
+  int before = view.before_size;
+  long found;
+
+  // All of it in front of the gap
+  if (column < before)
+  {
+    found = find_span (
+        view.before + column,
+        before - column,
+        query,
+        query_size);
+    if (found >= 0)
+      return column + found;
+  }
+
+  // In front of the gap and behind it
+  int start = before - query_size + 1;
+  if (start < column)
+    start = column;
+  for (; start < before; start++)
+  {
+    int in_front = before - start;
+    if (query_size - in_front <= view.after_size
+        && memcmp (view.before + start, query, in_front) == 0
+        && memcmp (view.after, query + in_front, query_size - in_front) == 0)
+      return start;
+  }
+
+  // All of it behind the gap
+  int skip = column > before ? column - before : 0;
+  found = find_span (
+      view.after + skip,
+      view.after_size - skip,
+      query,
+      query_size);
+  return found >= 0 ? before + skip + found : -1;
+}
+
+// The line of first .. last that offset is in
+size_t
+mapped_line_at (MappedFile *map, size_t first, size_t last, size_t offset)
+{
+  while (first < last)
+  {
+    size_t mid = first + (last - first + 1) / 2;
+    if (map->line_starts[mid] <= offset)
+      first = mid;
+    else
+      last = mid - 1;
+  }
+  return first;
+}
+
+// Up to max matches from row and column on to the end of the page, in page
+// order. Returns how many it found.
+int
+page_find (
+    Page *page,
+    int row,
+    int column,
+    const char *query,
+    int query_size,
+    SearchMatch *matches,
+    int max)
+{
+  MappedFile *map = page->map;
+  size_t run_lines = 16;
+  int count = 0;
+  if (query_size <= 0 || row < 0 || row >= page_line_count (page))
+    return 0;
+
+  int slot = page_row_to_slot (page, row);
+  while (slot >= 0 && count < max)
+  {
+    GapBufferLine *entry = page_line_entry (page, slot);
+    if (!line_is_mapped (entry))
+    {
+      LineView view = line_view (map, entry);
+      int found = find_in_view (view, column, query, query_size);
+      while (found >= 0 && count < max)
+      {
+        matches[count] = (SearchMatch){ row, found, query_size };
+        count++;
+        found = find_in_view (view, found + 1, query, query_size);
+      }
+      slot = page_next_slot (page, slot);
+      row++;
+      column = 0;
+      continue;
+    }
+
+    // The mapped lines from here on that follow each other in the file, in
+    // growing blocks so a match close by is found without walking them all
+    size_t first = mapped_line_index (entry);
+    size_t last = first;
+    int first_row = row;
+    slot = page_next_slot (page, slot);
+    row++;
+    while (slot >= 0 && last - first + 1 < run_lines)
+    {
+      GapBufferLine *next = page_line_entry (page, slot);
+      if (!line_is_mapped (next) || mapped_line_index (next) != last + 1)
+        break;
+      last++;
+      slot = page_next_slot (page, slot);
+      row++;
+    }
+
+    // The newline, or the end of the file, after the last line
+    size_t end = map->line_starts[last + 1] - 1;
+    size_t from = map->line_starts[first] + column;
+    if (from > map->line_starts[first + 1] - 1)
+      from = map->line_starts[first + 1] - 1;
+    size_t line = first;
+    while (count < max && from < end)
+    {
+      long found = find_span (map->data + from, end - from, query, query_size);
+      if (found < 0)
+        break;
+
+      size_t offset = from + found;
+      line = mapped_line_at (map, line, last, offset);
+      matches[count] = (SearchMatch){ first_row + (int)(line - first),
+                                      (int)(offset - map->line_starts[line]),
+                                      query_size };
+      count++;
+      from = offset + 1;
+    }
+    column = 0;
+    if (run_lines < SEARCH_RUN_LINES)
+      run_lines *= 2;
+  }
+
+  return count;
+}
+
+// page_find for a compiled pattern. Matches do not overlap, the next one
+// starts where the one before it ends. With a literal in the pattern
+// page_find goes ahead to the next line that has it.
+int
+page_find_regex (
+    Page *page,
+    Regex *regex,
+    int row,
+    int column,
+    SearchMatch *matches,
+    int max)
+{
+  int count = 0;
+  if (regex->error != NULL || row < 0 || row >= page_line_count (page))
+    return 0;
+
+  int slot = page_row_to_slot (page, row);
+  while (slot >= 0 && count < max)
+  {
+    if (regex->literal_size > 0)
+    {
+      SearchMatch next;
+      if (!page_find (
+              page,
+              row,
+              column,
+              regex->literal,
+              regex->literal_size,
+              &next,
+              1))
+        break;
+      if (next.row != row)
+      {
+        row = next.row;
+        column = 0;
+        slot = page_row_to_slot (page, row);
+      }
+    }
+
+    LineView view = line_view (page->map, page_line_entry (page, slot));
+    int from = column;
+    for (int i = regex_starts (regex, view, column) - 1;
+         i >= 0 && count < max;
+         i--)
+    {
+      int start = regex->starts[i];
+      if (start < from)
+        continue;
+      int end = regex_end (regex, view, start);
+      if (end <= start)
+        continue;
+      matches[count] = (SearchMatch){ row, start, end - start };
+      count++;
+      from = end;
+    }
+    slot = page_next_slot (page, slot);
+    row++;
+    column = 0;
+  }
+
+  return count;
+}
+
+// The next max matches of the query from row and column on
+int
+search_page (
+    Search *search,
+    Page *page,
+    int row,
+    int column,
+    SearchMatch *matches,
+    int max)
+{
+  if (search->regex)
+    return page_find_regex (page, search->compiled, row, column, matches, max);
+  return page_find (
+      page,
+      row,
+      column,
+      search->query,
+      search->size,
+      matches,
+      max);
+}
+
+// Adds the matches from row and column on to the ones there are
+void
+search_collect (Search *search, Page *page, int row, int column)
+{
+  search->truncated = 0;
+  while (search->size > 0)
+  {
+    if (search->count == search->capacity)
+    {
+      if (search->capacity == SEARCH_MAX_MATCHES)
+      {
+        search->truncated = 1;
+        break;
+      }
+      if (search->capacity == 0)
+      {
+        search->capacity = 1024;
+        search->matches = arena_alloc (
+            search->arena,
+            search->capacity * sizeof (SearchMatch));
+        continue;
+      }
+      search->matches = arena_resize (
+          search->arena,
+          search->matches,
+          search->capacity * sizeof (SearchMatch),
+          search->capacity * 2 * sizeof (SearchMatch));
+      search->capacity *= 2;
+    }
+
+    search->count += search_page (
+        search,
+        page,
+        row,
+        column,
+        search->matches + search->count,
+        search->capacity - search->count);
+    if (search->count < search->capacity)
+      break;
+
+    // Full, go on behind the last one with more room
+    SearchMatch last = search->matches[search->count - 1];
+    row = last.row;
+    column = last.column + (search->regex ? last.size : 1);
+  }
+  search->scans++;
+}
+
+// Keeps the matches that go on with the last char of the query
+void
+search_refine (Search *search, Page *page)
+{
+  char next = search->query[search->size - 1];
+  LineView view = { 0 };
+  int view_row = -1;
+  int kept = 0;
+
+  for (int i = 0; i < search->count; i++)
+  {
+    SearchMatch match = search->matches[i];
+    if (match.row != view_row)
+    {
+      view = page_line_view (page, page_row_to_slot (page, match.row));
+      view_row = match.row;
+    }
+
+    int column = match.column + search->size - 1;
+    if (column >= view.before_size + view.after_size)
+      continue;
+    char byte = column < view.before_size
+                    ? view.before[column]
+                    : view.after[column - view.before_size];
+    if (byte == next)
+    {
+      match.size = search->size;
+      search->matches[kept] = match;
+      kept++;
+    }
+  }
+  search->count = kept;
+  search->refines++;
+}
+
+void
+search_set_query (Search *search, Page *page, const char *query, int size)
+{
+  double start = now_ms ();
+  if (size > SEARCH_MAX_QUERY)
+    size = SEARCH_MAX_QUERY;
+
+  int longer = !search->stale && search->size > 0
+               && size == search->size + 1
+               && memcmp (query, search->query, search->size) == 0;
+  int same = size == search->size
+             && memcmp (query, search->query, size) == 0;
+  memmove (search->query, query, size);
+  search->size = size;
+
+  if (search->regex)
+  {
+    // One more char can make a pattern match more, it always scans again.
+    // The states built so far stay as long as the pattern does.
+    if (search->compiled == NULL)
+      search->compiled = init_regex (search->arena);
+    if (!same || search->compiled->program == NULL)
+      regex_compile (search->compiled, search->query, search->size);
+    search->count = 0;
+    if (search->compiled->error == NULL)
+      search_collect (search, page, 0, 0);
+  }
+  else if (!longer)
+  {
+    search->count = 0;
+    search_collect (search, page, 0, 0);
+  }
+  else if (!search->truncated)
+  {
+    search_refine (search, page);
+  }
+  else
+  {
+    // Only what is behind the last of the old matches is still unknown
+    SearchMatch last = search->matches[search->count - 1];
+    search_refine (search, page);
+    search_collect (search, page, last.row, last.column + 1);
+  }
+  search->stale = 0;
+  search->ms = now_ms () - start;
+}
+
+// Switches between plain text and patterns, the next find scans again
+void
+search_set_regex (Search *search, int regex)
+{
+  if (search->regex == regex)
+    return;
+  search->regex = regex;
+  search->stale = 1;
+
+  // The query may have changed as text, it compiles again
+  if (search->compiled != NULL)
+    free_regex (search->compiled);
+  search->compiled = NULL;
+}
+
+// The first match at or after row and column, -1 if there is none
+int
+search_next (Search *search, int row, int column)
+{
+  int low = 0;
+  int high = search->count;
+  while (low < high)
+  {
+    int mid = (low + high) / 2;
+    SearchMatch *match = &search->matches[mid];
+    if (match->row < row || (match->row == row && match->column < column))
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low < search->count ? low : -1;
+}
+
+// Puts the cursor on the first match at or after row and column, or on the
+// first one there is. 1 if there is none.
+int
+editor_goto_match (Editor *editor, int row, int column)
+{
+  Page *page = editor->page;
+  Search *search = &editor->search;
+  if (search->stale)
+    search_set_query (search, page, search->query, search->size);
+  if (search->count == 0)
+    return 1;
+
+  SearchMatch match = search->matches[0];
+  int next = search_next (search, row, column);
+  if (next >= 0)
+    match = search->matches[next];
+  else if (search->truncated)
+    search_page (search, page, row, column, &match, 1);
+
+  editor_move_cursor (editor, page_row_to_slot (page, match.row), match.column);
+  return 0;
+}
+
+// Search as you type: sets the query and puts the cursor on the first match
+// from where it is on. Returns the matches there are.
+int
+editor_find (Editor *editor, const char *query, int size)
+{
+  Cursor *cursor = editor->cursor;
+  GapBufferLine *line = page_line (editor->page, cursor->line);
+
+  search_set_query (&editor->search, editor->page, query, size);
+  editor_goto_match (
+      editor,
+      page_slot_to_row (editor->page, cursor->line),
+      line_column (line, cursor->pos));
+  return editor->search.count;
+}
+
+// 1 if there is no match to go to
+int
+editor_find_next (Editor *editor)
+{
+  Cursor *cursor = editor->cursor;
+  GapBufferLine *line = page_line (editor->page, cursor->line);
+
+  return editor_goto_match (
+      editor,
+      page_slot_to_row (editor->page, cursor->line),
+      line_column (line, cursor->pos) + 1);
+}
+
+// =============================================================================
+// === Trace
+// =============================================================================
+// Input as the editor sees it, recorded by the front end and fed back through
+// the same editor calls by the replay tool. After TRACE_MAGIC every event is
+// TRACE_EVENT_SIZE bytes, little endian: kind, a, b, microseconds since the
+// event before.
+
+void
+put_u32 (unsigned char *bytes, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    bytes[i] = (value >> (8 * i)) & 0xff;
+}
+
+uint32_t
+get_u32 (const unsigned char *bytes)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++)
+    value |= (uint32_t)bytes[i] << (8 * i);
+  return value;
+}
+
+// NULL if path can't be written
+Trace *
+start_trace (const char *path)
+{
+  FILE *file = fopen (path, "wb");
+  if (file == NULL)
+    return NULL;
+  fwrite (TRACE_MAGIC, 1, strlen (TRACE_MAGIC), file);
+
+  Trace *trace = malloc (sizeof (Trace));
+  trace->file = file;
+  trace->last_ms = now_ms ();
+  trace->events = 0;
+
+  return trace;
+}
+
+void
+stop_trace (Trace *trace)
+{
+  fclose (trace->file);
+  free (trace);
+}
+
+void
+trace_event (Trace *trace, TraceKind kind, int a, int b)
+{
+  double now = now_ms ();
+  double delta_us = (now - trace->last_ms) * 1000.0;
+  trace->last_ms = now;
+
+  unsigned char bytes[TRACE_EVENT_SIZE];
+  bytes[0] = kind;
+  put_u32 (bytes + 1, (uint32_t)a);
+  put_u32 (bytes + 5, (uint32_t)b);
+  put_u32 (bytes + 9, delta_us < UINT32_MAX ? (uint32_t)delta_us : UINT32_MAX);
+
+  fwrite (bytes, 1, TRACE_EVENT_SIZE, trace->file);
+  trace->events++;
+}
+
+// Positioned at the first event, NULL if it is not a trace
+FILE *
+open_trace (const char *path)
+{
+  FILE *file = fopen (path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  char magic[sizeof (TRACE_MAGIC)] = { 0 };
+  if (fread (magic, 1, strlen (TRACE_MAGIC), file) != strlen (TRACE_MAGIC)
+      || strcmp (magic, TRACE_MAGIC) != 0)
+  {
+    fclose (file);
+    return NULL;
+  }
+  return file;
+}
+
+// 0 at the end of the trace
+int
+read_trace_event (FILE *file, TraceEvent *event)
+{
+  unsigned char bytes[TRACE_EVENT_SIZE];
+  if (fread (bytes, 1, TRACE_EVENT_SIZE, file) != TRACE_EVENT_SIZE)
+    return 0;
+
+  event->kind = bytes[0];
+  event->a = (int)get_u32 (bytes + 1);
+  event->b = (int)get_u32 (bytes + 5);
+  event->delta_ms = get_u32 (bytes + 9) / 1000.0;
+  return 1;
+}
+
+// Saves are left out, a replay measures editing and not the disk
+void
+apply_trace_event (Editor *editor, TraceEvent *event)
+{
+  switch (event->kind)
+  {
+  case TRACE_CHAR:
+  {
+    char text[UTF8_MAX_SIZE];
+    editor_insert_text (editor, text, utf8_encode (event->a, text));
+    break;
+  }
+  case TRACE_KEY:
+    if (event->a != EDITOR_KEY_SAVE)
+      editor_apply_key (editor, (EditorKey)event->a);
+    break;
+  case TRACE_CLICK:
+    if (event->a >= 0 && event->a < page_line_count (editor->page))
+    {
+      editor_move_cursor (
+          editor,
+          page_row_to_slot (editor->page, event->a),
+          event->b);
+    }
+    break;
+  case TRACE_ADD_CURSOR:
+    editor_add_cursor (editor, event->a, event->b);
+    break;
+  case TRACE_SELECT:
+    editor_select_to (editor, event->a, event->b);
+    break;
+  }
+}
+
+// =============================================================================
+// === Memory
+// =============================================================================
+// The arena counts every block it hands out, page_memory walks the lines to
+// tell which of those bytes are text, which are gap and who owns the rest.
+// O(lines), so callers that show it every frame should only ask after a
+// change.
+
+long
+line_memory (Arena *arena, GapBufferLine *gbl)
+{
+  long bytes = arena_block_size (arena, line_header_size (gbl));
+  if (!line_is_inline (gbl))
+    bytes += arena_block_size (arena, gbl->buf_size);
+  return bytes;
+}
+
+void
+page_memory (Page *page, MemoryStats *stats)
+{
+  Arena *arena = page->arena;
+  memset (stats, 0, sizeof (MemoryStats));
+  stats->live_bytes = arena->live_bytes;
+  stats->peak_bytes = arena->peak_bytes;
+  stats->system_bytes = arena->system_bytes;
+  stats->allocs = arena->allocs;
+  stats->frees = arena->frees;
+  if (page->map != NULL)
+    stats->mapped_bytes = page->map->size;
+
+  for (int slot = page_first_slot (page); slot >= 0;
+       slot = page_next_slot (page, slot))
+  {
+    GapBufferLine *line = page_line_entry (page, slot);
+    stats->lines++;
+    if (line_is_mapped (line))
+    {
+      stats->mapped_lines++;
+      continue;
+    }
+
+    stats->line_bytes += line_memory (arena, line);
+    stats->text_bytes += line_length (line);
+    stats->gap_bytes += line->gap_end - line->gap_start + 1;
+    if (line->breaks != NULL)
+      stats->wrap_bytes
+          += arena_block_size (arena, (line->breaks[0] + 1) * sizeof (int));
+  }
+
+  // Rows of the mapped lines and the index of the rows
+  Wrap *wrap = page->wrap;
+  if (wrap != NULL && wrap->mapped_count > 0)
+    stats->wrap_bytes
+        += arena_block_size (arena, wrap->mapped_count * sizeof (int))
+           + arena_block_size (
+               arena,
+               wrap->mapped_count * sizeof (unsigned int));
+  Highlight *highlight = page->highlight;
+  if (highlight != NULL)
+    stats->highlight_bytes
+        = highlight->run_capacity * sizeof (HighlightRun)
+          + (highlight->mapped_count > 0
+                 ? arena_block_size (arena, highlight->mapped_count)
+                 : 0);
+#ifndef NEO_NOTE_ROPE
+  if (wrap != NULL)
+    stats->wrap_bytes += arena_block_size (
+        arena,
+        (page->heights.size + 1) * sizeof (long));
+#endif
+
+#ifdef NEO_NOTE_ROPE
+  stats->page_bytes
+      = arena_block_size (arena, sizeof (RopePage))
+        + stats->lines * arena_block_size (arena, sizeof (RopeNode));
+#else
+  stats->page_bytes
+      = arena_block_size (arena, sizeof (GapBufferPage))
+        + arena_block_size (arena, page->buf_size * sizeof (GapBufferLine *))
+        + arena_block_size (
+            arena,
+            (page->offsets.size + 1) * sizeof (long));
+  stats->page_gap_bytes
+      = (page->gap_end - page->gap_start + 1) * sizeof (GapBufferLine *);
+#endif
+
+  // Old versions the page copied away from under a snapshot
+  if (page->snapshot != NULL)
+  {
+    for (int i = 0; i < page->snapshot->retired_count; i++)
+      stats->retired_bytes
+          += arena_block_size (arena, page->snapshot->retired[i].size);
+  }
+}
+
+void
+editor_memory (Editor *editor, MemoryStats *stats)
+{
+  page_memory (editor->page, stats);
+  stats->cursor_bytes = arena_block_size (editor->page->arena, sizeof (Cursor));
+  if (editor->selections != NULL)
+    stats->cursor_bytes += arena_block_size (
+        editor->page->arena,
+        editor->selection_capacity * sizeof (Selection));
+}
+
+// =============================================================================
+// === Compaction
+// =============================================================================
+// Gaps only ever grow while typing, so a long session leaves slack behind in
+// every line it touched. Once the editor has been idle for COMPACT_IDLE_MS
+// the lines are trimmed back to the slack of the capacity policy a few at a
+// time, then the page gap in one go, O(lines) for its index. Each call stops
+// after budget_ms and the next one goes on from the same row, typing never
+// waits for it.
+//
+// Lines a snapshot still reads are left alone, and so is the cursor line
+// since typing would only grow it again. Trimming a line that grew out of a
+// large block moves it back into a size class of the arena.
+
+// 1 once a whole pass is through
+int
+compact_page (
+    Page *page,
+    Compaction *compaction,
+    Cursor *cursor,
+    double budget_ms)
+{
+  double start = now_ms ();
+  long live = page->arena->live_bytes;
+  int line_count = page_line_count (page);
+  int checked = 0;
+
+  while (compaction->row < line_count)
+  {
+    if (checked % COMPACT_CHECK_LINES == 0 && checked > 0
+        && now_ms () - start > budget_ms)
+      break;
+
+    int slot = page_row_to_slot (page, compaction->row);
+    GapBufferLine *line = page_line_entry (page, slot);
+    compaction->row++;
+    checked++;
+
+    if ((cursor != NULL && slot == cursor->line) || line_is_mapped (line)
+        || line_is_shared (page->snapshot, line) || line_is_inline (line))
+      continue;
+    if (line->gap_end - line->gap_start + 1 <= line_capacity.max_slack)
+      continue;
+
+    shrink_gap_line (line);
+    compaction->lines_trimmed++;
+  }
+
+  int done = compaction->row >= line_count;
+#ifndef NEO_NOTE_ROPE
+  // Slots behind the gap move, the cursor keeps its row
+  int page_gap = page->gap_end - page->gap_start + 1;
+  if (done && !page->shared && page_gap > page_capacity.max_slack)
+  {
+    int row = cursor != NULL ? page_slot_to_row (page, cursor->line) : 0;
+    shrink_gap_page (page);
+    if (cursor != NULL)
+      cursor->line = page_row_to_slot (page, row);
+  }
+#endif
+
+  if (done)
+  {
+    compaction->row = 0;
+    compaction->passes++;
+  }
+  compaction->bytes_trimmed += live - page->arena->live_bytes;
+
+  double ms = now_ms () - start;
+  if (ms > compaction->frame_ms_max)
+    compaction->frame_ms_max = ms;
+
+  return done;
+}
+
+// Call every frame, only does something once the editor is idle
+void
+editor_compact (Editor *editor, double budget_ms)
+{
+  Compaction *compaction = &editor->compaction;
+  if (compaction->done
+      || now_ms () - compaction->last_edit_ms < COMPACT_IDLE_MS)
+    return;
+
+  compaction->done
+      = compact_page (editor->page, compaction, editor->cursor, budget_ms);
+}
@@ -0,0 +1,998 @@
+// NeoNote editing core, everything that works without a window. The raylib
+// front end in main.c is one client, anything headless can link it the same
+// way (./build.sh builds it as build/libneo_note_core.a).
+#ifndef NEO_NOTE_CORE_H
+#define NEO_NOTE_CORE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define INIT_SIZE_LINE 1
+#define GAP_SIZE 5
+// Lines whose header and text fit a block this big keep the text right behind
+// the header instead of in a buffer of their own
+#define LINE_INLINE_SIZE 128
+
+// Longest UTF-8 sequence, and what a char that does not decode is shown as
+#define UTF8_MAX_SIZE 4
+#define UTF8_REPLACEMENT 0xFFFD
+
+// iovecs per writev call, stays below IOV_MAX
+#define SAVE_BATCH 1024
+
+// Lines a page remembers as changed between two frames before it gives up
+// and counts everything as changed
+#define DAMAGE_MAX 64
+
+// First bytes of a trace file, the last char is the format version
+#define TRACE_MAGIC "NEOTRAC1"
+// kind, two values and the time since the event before
+#define TRACE_EVENT_SIZE 13
+
+// Longest query, matches a search keeps before it stops looking and the most
+// mapped lines it searches as one block
+#define SEARCH_MAX_QUERY 256
+#define SEARCH_MAX_MATCHES 65536
+#define SEARCH_RUN_LINES 4096
+
+// Biggest program a regex compiles to, the most DFA states one keeps before
+// it starts over and the most a {n,m} repeats.
+#define REGEX_MAX_PROGRAM 16384
+#define REGEX_MAX_STATES 2048
+#define REGEX_MAX_REPEAT 1000
+// Most ranges of bytes a floating DFA may leave its start on for the scan to
+// skip to
+#define REGEX_MAX_ESCAPES 4
+
+// Autosave after this many edits, or this long after the first unsaved one
+#define AUTOSAVE_EDITS 200
+#define AUTOSAVE_INTERVAL_MS 5000.0
+
+// Idle time before gaps get trimmed, how long that may take in a frame and
+// how many lines go between two looks at the clock
+#define COMPACT_IDLE_MS 1000.0
+#define COMPACT_BUDGET_MS 1.0
+#define COMPACT_CHECK_LINES 32
+
+// How long the wrap in the background may take in a frame and how many lines
+// go between two looks at the clock
+#define WRAP_BUDGET_MS 2.0
+#define WRAP_CHECK_LINES 64
+
+// The same for the highlight catching up after an edit
+#define HIGHLIGHT_BUDGET_MS 1.0
+#define HIGHLIGHT_CHECK_LINES 256
+
+// State a line of Markdown ends in, 0 outside a fenced code block. Inside
+// one it is the fence char and how long the fence was.
+#define HIGHLIGHT_IN_FENCE 0x80
+#define HIGHLIGHT_TILDE 0x40
+#define HIGHLIGHT_FENCE_LENGTH 0x3f
+
+// Percent of the buffer size a full gap grows by, 0 is the old fixed GAP_SIZE
+#ifndef GAP_GROWTH_PERCENT
+#define GAP_GROWTH_PERCENT 100
+#endif
+
+// Size classes of the arena are ARENA_MIN_BLOCK << n, up to ARENA_MAX_BLOCK
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_MIN_BLOCK 16
+#define ARENA_MAX_BLOCK 512
+#define ARENA_CLASS_COUNT 6
+
+typedef struct ArenaChunk
+{
+  struct ArenaChunk *next;
+  size_t used;
+  char data[];
+} ArenaChunk;
+
+typedef struct ArenaFree
+{
+  struct ArenaFree *next;
+} ArenaFree;
+
+typedef struct ArenaLarge
+{
+  struct ArenaLarge *prev;
+  struct ArenaLarge *next;
+  size_t size;
+  size_t padding;
+} ArenaLarge;
+
+typedef struct
+{
+  ArenaChunk *chunks;
+  ArenaFree *free_lists[ARENA_CLASS_COUNT];
+  ArenaLarge *large;
+
+  // Accounting in block sizes, see Memory
+  long live_bytes;
+  long peak_bytes;
+  long system_bytes;
+  long allocs;
+  long frees;
+} Arena;
+
+typedef struct
+{
+  void *buffer;
+  int gap_start;
+  int gap_end;
+  int buf_size;
+  Arena *arena;
+} GapBuffer;
+
+typedef struct
+{
+  const char *name;
+  int min_gap;
+  int growth_percent;
+  int max_slack;
+
+  // Counters. line_capacity and page_capacity are one each for the whole
+  // process, so these add up over every page loaded, not the note on screen
+  // alone. For the share of one run take the difference, as bench does.
+  long grows;
+  long shrinks;
+  long bytes_copied;
+} CapacityPolicy;
+
+typedef struct
+{
+  char *buffer;
+  int gap_start;
+  int gap_end;
+  int buf_size;
+  unsigned int generation;
+  Arena *arena;
+
+  // Byte columns its rows start at after the first, breaks[0] is how many.
+  // NULL for one row. wrapped is the Wrap generation they are from, see Wrap.
+  int *breaks;
+  unsigned int wrapped;
+
+  // buffer points here while the line is short, see Gap Buffer Line
+  int small_size;
+  // State the highlight ends the line in, see Highlight
+  unsigned char highlight;
+  char small[];
+} GapBufferLine;
+
+// A file opened with load_page, line i is
+// data[line_starts[i]] .. data[line_starts[i + 1] - 2]
+typedef struct
+{
+  const char *data;
+  size_t size;
+  size_t *line_starts;
+  size_t line_count;
+
+  // Bytes from the start that are valid UTF-8, size when all of them are
+  size_t valid_size;
+
+  // 1 when the last line ends with a newline, save_page keeps it that way
+  int final_newline;
+} MappedFile;
+
+// The text of a line as the two spans around its gap
+typedef struct
+{
+  const char *before;
+  int before_size;
+  const char *after;
+  int after_size;
+} LineView;
+
+// Fenwick tree, see Line Index
+typedef struct
+{
+  long *tree;
+  int size;
+} LineIndex;
+
+// Lines changed since the last frame, see Damage
+typedef struct
+{
+  GapBufferLine *lines[DAMAGE_MAX];
+  int count;
+  int all;
+} Damage;
+
+// Soft wrap of the lines at a width in pixels, see Wrap
+typedef struct
+{
+  int width;
+  // Pixels of the ASCII chars, the others ask advance
+  int ascii[128];
+  int (*advance) (void *context, int codepoint);
+  void *context;
+  // A new width or font makes every line wrapped before stale
+  unsigned int generation;
+
+  // Lines still in the file have no breaks to keep, just their rows and the
+  // generation, by their line in the file
+  int *mapped_heights;
+  unsigned int *mapped_wrapped;
+  size_t mapped_count;
+
+  // Breaks of the line wrapped last when it could not keep them
+  int *scratch;
+  int scratch_capacity;
+
+  // Where the wrap in the background goes on
+  int next_row;
+
+  // Metrics
+  long lines_wrapped;
+} Wrap;
+
+typedef enum
+{
+  HIGHLIGHT_TEXT,
+  HIGHLIGHT_HEADING,
+  HIGHLIGHT_FENCE,
+  HIGHLIGHT_CODE,
+  HIGHLIGHT_MARKER,
+  HIGHLIGHT_TASK,
+  HIGHLIGHT_TASK_DONE,
+  HIGHLIGHT_TAG,
+  HIGHLIGHT_KIND_COUNT
+} HighlightKind;
+
+// From byte column start on to the start of the next run
+typedef struct
+{
+  int start;
+  HighlightKind kind;
+} HighlightRun;
+
+// Markdown highlight of the lines, see Highlight
+typedef struct
+{
+  // States of the lines still in the file, by their line in the file
+  unsigned char *mapped_states;
+  size_t mapped_count;
+
+  // Rows whose state may be stale, dirty_start -1 when none is
+  int dirty_start;
+  int dirty_end;
+
+  // Runs of the line highlighted last
+  HighlightRun *runs;
+  int run_count;
+  int run_capacity;
+
+  // Metrics
+  long lines_scanned;
+} Highlight;
+
+struct Snapshot;
+
+typedef struct
+{
+  GapBufferLine **buffer;
+  int gap_start;
+  int gap_end;
+  int buf_size;
+  Arena *arena;
+  MappedFile *map;
+
+  // Bytes in front of every slot, and rows once wrapped
+  LineIndex offsets;
+  LineIndex heights;
+  Damage damage;
+  Wrap *wrap;
+  Highlight *highlight;
+
+  // Copy on write, see Snapshot
+  struct Snapshot *snapshot;
+  unsigned int generation;
+  int shared;
+} GapBufferPage;
+
+// NOTE: Build with -DNEO_NOTE_ROPE (./build.sh rope) to keep the lines in a
+// balanced tree instead of the page gap buffer. Everything outside of the two
+// page sections only talks to the page through the page_* functions below, a
+// slot is whatever index the backend uses to address a line.
+#ifdef NEO_NOTE_ROPE
+typedef struct RopeNode
+{
+  struct RopeNode *left;
+  struct RopeNode *right;
+  GapBufferLine *line;
+  unsigned int priority;
+  unsigned int generation;
+  int count;
+
+  // Bytes of the line and of the whole subtree, newlines included
+  int size;
+  long bytes;
+  // Rows of the line and of the whole subtree once wrapped
+  int height;
+  int heights;
+} RopeNode;
+
+typedef struct
+{
+  RopeNode *root;
+  unsigned int seed;
+  Arena *arena;
+  MappedFile *map;
+  Damage damage;
+  Wrap *wrap;
+  Highlight *highlight;
+
+  // Copy on write, see Snapshot
+  struct Snapshot *snapshot;
+  unsigned int generation;
+} RopePage;
+
+typedef RopePage Page;
+#else
+typedef GapBufferPage Page;
+#endif
+
+typedef struct
+{
+  void *ptr;
+  size_t size;
+} Retired;
+
+// A frozen copy of the page header. Lines, rope nodes and the page array it
+// points to were stamped with a generation up to this one and are never
+// written while the snapshot lives, the page copies them first and parks the
+// originals in retired until the snapshot is released.
+typedef struct Snapshot
+{
+  Page page;
+  unsigned int generation;
+  Retired *retired;
+  int retired_count;
+  int retired_capacity;
+  long copied_bytes;
+} Snapshot;
+
+typedef struct
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  char *path;
+  int quit;
+
+  // Handed to the worker, and back once written
+  Snapshot *pending;
+  Snapshot *done;
+  int result;
+
+  int edits;
+  double dirty_since_ms;
+
+  // Metrics
+  long saves;
+  double snapshot_ms;
+  double snapshot_ms_max;
+  long copied_bytes;
+  double save_ms;
+  double frame_ms_max_saving;
+  double frame_ms_max_idle;
+} Autosave;
+
+typedef struct
+{
+  int line;
+  int pos;
+} Cursor;
+
+// What a document holds, see Memory
+typedef struct
+{
+  // The arena: blocks handed out, the most ever, what it got from malloc
+  long live_bytes;
+  long peak_bytes;
+  long system_bytes;
+  long allocs;
+  long frees;
+
+  // Live bytes by owner
+  long line_bytes;
+  long page_bytes;
+  long cursor_bytes;
+  long retired_bytes;
+  long wrap_bytes;
+  long highlight_bytes;
+
+  // What the lines hold, mapped text lives in the file mapping instead
+  long text_bytes;
+  long gap_bytes;
+  long page_gap_bytes;
+  long mapped_bytes;
+  int lines;
+  int mapped_lines;
+} MemoryStats;
+
+typedef enum
+{
+  OUTSIDE_LEFT,
+  OUTSIDE_RIGHT,
+  BEFORE_GAP,
+  AFTER_GAP,
+  GAP_PLUS_ONE,
+  GAP_MINUS_ONE,
+  INSIDE_GAP_START,
+  INSIDE_GAP_INBETWEEN,
+} PositionInGapArray;
+
+typedef enum
+{
+  BEFORE,
+  AFTER,
+} DIRECTION;
+
+typedef enum
+{
+  GAP_END,
+  GAP_START
+} GAP_POSITION;
+
+typedef enum
+{
+  EDITOR_KEY_NONE,
+  EDITOR_KEY_UP,
+  EDITOR_KEY_DOWN,
+  EDITOR_KEY_LEFT,
+  EDITOR_KEY_RIGHT,
+  EDITOR_KEY_PAGE_UP,
+  EDITOR_KEY_PAGE_DOWN,
+  EDITOR_KEY_BACKSPACE,
+  EDITOR_KEY_ENTER,
+  EDITOR_KEY_SAVE,
+  // Move the cursors and keep where their selections started, after the
+  // others so traces from before still read the same
+  EDITOR_KEY_SELECT_UP,
+  EDITOR_KEY_SELECT_DOWN,
+  EDITOR_KEY_SELECT_LEFT,
+  EDITOR_KEY_SELECT_RIGHT,
+  // Back to the one cursor
+  EDITOR_KEY_ESCAPE,
+} EditorKey;
+
+// Where the idle compaction is, see Compaction
+typedef struct
+{
+  int row;
+  int done;
+  double last_edit_ms;
+
+  // Metrics
+  long passes;
+  long lines_trimmed;
+  long bytes_trimmed;
+  double frame_ms_max;
+} Compaction;
+
+// Regex, see Regex in core.c
+
+typedef enum
+{
+  REGEX_NODE_EMPTY,
+  REGEX_NODE_RANGE,
+  REGEX_NODE_CONCAT,
+  REGEX_NODE_ALTERNATE,
+  REGEX_NODE_REPEAT,
+  REGEX_NODE_LINE_START,
+  REGEX_NODE_LINE_END,
+} RegexNodeKind;
+
+// The parsed pattern. A range is bytes low to high, a repeat is left low to
+// high times with -1 for no limit.
+typedef struct
+{
+  RegexNodeKind kind;
+  int low;
+  int high;
+  int left;
+  int right;
+} RegexNode;
+
+typedef enum
+{
+  REGEX_RANGE,
+  REGEX_SPLIT,
+  REGEX_LINE_START,
+  REGEX_LINE_END,
+  REGEX_MATCH,
+} RegexOp;
+
+// One state of the NFA
+typedef struct
+{
+  RegexOp op;
+  unsigned char low;
+  unsigned char high;
+  int out;
+  int out1;
+} RegexInst;
+
+// A DFA state is the sorted NFA states it stands for, in sets
+typedef struct
+{
+  int first;
+  int size;
+  int match;
+  // Matches when the line ends here, -1 until someone asks
+  int end_match;
+} RegexState;
+
+// A DFA built while it runs. next has 256 transitions per state: -1 for not
+// built yet, 0 for the dead state, the state, or -2 - the state when it
+// matches. The dead state is the empty set.
+typedef struct
+{
+  int start;
+  // The start goes back in after every byte, so matches start anywhere
+  int floating;
+  // The states it starts in at the start of the line and anywhere else
+  int line_start;
+  int mid_line;
+  // The only ranges of bytes that take a floating DFA out of mid_line, if
+  // there are few enough to skip the rest with a scan
+  unsigned char escape_low[REGEX_MAX_ESCAPES];
+  unsigned char escape_high[REGEX_MAX_ESCAPES];
+  int escape_count;
+
+  RegexState *states;
+  int *next;
+  int count;
+  int capacity;
+  int *sets;
+  int sets_count;
+  int sets_capacity;
+  // Hash of the states by their set, state + 1 or 0 for empty
+  int *table;
+
+  // Metrics
+  long built;
+  long flushes;
+} RegexDfa;
+
+typedef struct
+{
+  Arena *arena;
+  // Why regex_compile failed, NULL if it did not
+  const char *error;
+
+  const char *pattern;
+  int pattern_size;
+  int at;
+  RegexNode *nodes;
+  int node_count;
+  int node_capacity;
+
+  RegexInst *program;
+  int program_size;
+  int program_capacity;
+
+  // Bytes every match has in a row, lines without them are skipped
+  char *literal;
+  int literal_size;
+
+  // Finds where matches end, run from where one starts
+  RegexDfa forward;
+  // The pattern backwards, run from the end of the line to find where
+  // matches start
+  RegexDfa reverse;
+
+  // Scratch for building a state
+  int *list;
+  int list_count;
+  int *stack;
+  int *marks;
+  int mark;
+
+  // Where matches start in the line regex_starts looked at, last first
+  int *starts;
+  int start_count;
+  int start_capacity;
+} Regex;
+
+typedef struct
+{
+  int row;
+  int column;
+  int size;
+} SearchMatch;
+
+// Every match of query in page order, see Search
+typedef struct
+{
+  char query[SEARCH_MAX_QUERY];
+  int size;
+  // The query is a pattern for compiled, see Regex
+  int regex;
+  Regex *compiled;
+
+  SearchMatch *matches;
+  int count;
+  int capacity;
+  Arena *arena;
+  // Stopped at SEARCH_MAX_MATCHES, the matches after the last one are unknown
+  int truncated;
+  // The page was edited since the matches were collected
+  int stale;
+
+  // Metrics
+  long scans;
+  long refines;
+  double ms;
+} Search;
+
+// A cursor of many, on row and byte column, and where its selection started.
+// Rows and columns, not slots and gap positions, so an edit at one cursor
+// leaves the others where they are until the batch moves them.
+typedef struct
+{
+  int row;
+  int column;
+  int anchor_row;
+  int anchor_column;
+} Selection;
+
+typedef struct
+{
+  Page *page;
+  Cursor *cursor;
+  const char *path;
+
+  // Rows EDITOR_KEY_PAGE_UP and EDITOR_KEY_PAGE_DOWN move by
+  int page_rows;
+
+  // Edits since the front end last looked, it resets them
+  int edits;
+
+  Compaction compaction;
+  Search search;
+
+  // More than the one cursor, sorted and apart, cursor is on the primary
+  // one. None while there is only the one.
+  Selection *selections;
+  int selection_count;
+  int selection_capacity;
+  int primary;
+} Editor;
+
+typedef enum
+{
+  TRACE_CHAR,
+  TRACE_KEY,
+  TRACE_CLICK,
+  TRACE_ADD_CURSOR,
+  TRACE_SELECT,
+} TraceKind;
+
+// A codepoint, an EditorKey, or a click on row and byte column. Adding a
+// cursor and selecting to are on a row and byte column too.
+typedef struct
+{
+  TraceKind kind;
+  int a;
+  int b;
+  double delta_ms;
+} TraceEvent;
+
+typedef struct
+{
+  FILE *file;
+  double last_ms;
+  long events;
+} Trace;
+
+// Page API, implemented by the selected backend
+Page *init_page (void);
+void free_page (Page *page);
+GapBufferLine *page_line (Page *page, int slot);
+GapBufferLine *page_line_entry (Page *page, int slot);
+LineView page_line_view (Page *page, int slot);
+int page_line_count (Page *page);
+int page_first_slot (Page *page);
+int page_next_slot (Page *page, int slot);
+int page_prev_slot (Page *page, int slot);
+int page_slot_to_row (Page *page, int slot);
+int page_row_to_slot (Page *page, int row);
+int page_insert_line (Page *page, GapBufferLine *line, int slot, DIRECTION dir);
+int page_append_line (Page *page, GapBufferLine *line);
+int page_delete_line (Page *page, int slot);
+void page_line_changed (Page *page, int slot);
+long page_byte_count (Page *page);
+long page_slot_offset (Page *page, int slot);
+int page_offset_slot (Page *page, long offset);
+
+// Utilities
+PositionInGapArray get_index_pos_in_gap_array (
+    int index,
+    int gap_start,
+    int gap_end,
+    int buf_size);
+void print_line (GapBufferLine *gbl);
+double now_ms (void);
+int line_is_mapped (GapBufferLine *gbl);
+GapBufferLine *mapped_line (size_t index);
+size_t mapped_line_index (GapBufferLine *gbl);
+LineView line_view (MappedFile *map, GapBufferLine *gbl);
+long line_bytes (MappedFile *map, GapBufferLine *gbl);
+void print_page (GapBufferPage *gbp);
+
+// UTF-8
+int utf8_is_continuation (char byte);
+int utf8_char_size (const char *text, int size);
+int utf8_decode (const char *text, int size, int *codepoint);
+int utf8_encode (int codepoint, char *out);
+size_t utf8_valid_size (const char *text, size_t size);
+
+// DEBUG
+int render_line_debug (
+    GapBufferLine *gbl,
+    char *buffer,
+    int pos,
+    int cursor_pos);
+int render_view_debug (LineView view, char *buffer, int pos);
+void render_page_debug (Page *page, char *buffer, int size, Cursor c);
+
+// Arena
+Arena *init_arena (void);
+void free_arena (Arena *arena);
+size_t arena_block_size (Arena *arena, size_t size);
+void *arena_alloc (Arena *arena, size_t size);
+void arena_free (Arena *arena, void *ptr, size_t size);
+void *arena_resize (Arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+// Cursor
+Cursor *init_cursor (Arena *arena, int line, int pos);
+int move_cursor_next_line (Cursor *c, Page *page);
+int move_cursor_previous_line (Cursor *c, Page *page);
+void move_cursor_column (Cursor *c, Page *page, int column);
+void move_cursor_char (Cursor *c, Page *page, int index);
+PositionInGapArray move_cursor (Cursor *c, Page *page, int new_index);
+
+// Capacity Policy
+extern CapacityPolicy line_capacity;
+extern CapacityPolicy page_capacity;
+int capacity_gap_size (CapacityPolicy *policy, int buf_size, int needed);
+
+// Gap Buffer
+void move_gap_start (GapBuffer *gb, int index, size_t element_size);
+void move_gap_end (GapBuffer *gb, int index, size_t element_size);
+void expand_gap (
+    GapBuffer *gb,
+    int size,
+    size_t element_size,
+    CapacityPolicy *policy);
+void shrink_gap (GapBuffer *gb, size_t element_size, CapacityPolicy *policy);
+void insert_in_gap (
+    GapBuffer *gb,
+    char *buffer_ptr,
+    int count,
+    size_t element_size,
+    CapacityPolicy *policy);
+
+// Gap Kernels
+void move_gap_start_chars (GapBufferLine *gb, int index);
+void move_gap_end_chars (GapBufferLine *gb, int index);
+void expand_gap_chars (GapBufferLine *gb, int size, CapacityPolicy *policy);
+void shrink_gap_chars (GapBufferLine *gb, CapacityPolicy *policy);
+void insert_in_gap_chars (
+    GapBufferLine *gb,
+    const char *elements,
+    int count,
+    CapacityPolicy *policy);
+void move_gap_start_lines (GapBufferPage *gb, int index);
+void move_gap_end_lines (GapBufferPage *gb, int index);
+void expand_gap_lines (GapBufferPage *gb, int size, CapacityPolicy *policy);
+void shrink_gap_lines (GapBufferPage *gb, CapacityPolicy *policy);
+void insert_in_gap_lines (
+    GapBufferPage *gb,
+    GapBufferLine *const *elements,
+    int count,
+    CapacityPolicy *policy);
+
+// Gap Buffer Line
+GapBufferLine *init_gap_buffer_line (
+    Arena *arena,
+    int initial_size,
+    int gap_size);
+void free_gap_buffer_line (GapBufferLine *gbl);
+int line_is_inline (GapBufferLine *gbl);
+size_t line_header_size (GapBufferLine *gbl);
+void move_gap_line (GapBufferLine *gbl, int index, GAP_POSITION gap_pos);
+void expand_gap_line (GapBufferLine *gbl, int new_gap_size);
+void shrink_gap_line (GapBufferLine *gbl);
+void insert_single_char (GapBufferLine *gbl, char value, GAP_POSITION gap_pos);
+void insert_in_gap_line (GapBufferLine *gbl, char *buffer_ptr, int count);
+void delete_single_char (GapBufferLine *gbl, GAP_POSITION gap_pos);
+int line_length (GapBufferLine *gbl);
+int line_column (GapBufferLine *gbl, int pos);
+int line_pos (GapBufferLine *gbl, int column);
+char line_byte (GapBufferLine *gbl, int column);
+int line_next_char (GapBufferLine *gbl, int column);
+int line_prev_char (GapBufferLine *gbl, int column);
+int line_char_index (GapBufferLine *gbl, int column);
+int line_char_column (GapBufferLine *gbl, int index);
+void insert_span_line (
+    GapBufferLine *gbl,
+    int column,
+    char *buffer_ptr,
+    int count);
+void delete_range_line (GapBufferLine *gbl, int column, int count);
+GapBufferLine *split_gap_buffer_line (GapBufferLine *gbl, int column);
+void join_gap_buffer_line (GapBufferLine *gbl, LineView next);
+
+// Mapped File
+void unmap_file (MappedFile *map);
+
+// Line Index
+void init_line_index (LineIndex *index, Arena *arena, int size);
+void line_index_add (LineIndex *index, int slot, long delta);
+long line_index_prefix (LineIndex *index, int slot);
+void line_index_set (LineIndex *index, int slot, long value);
+int line_index_find (LineIndex *index, long offset);
+
+// Damage
+void mark_damaged (Damage *damage, GapBufferLine *line);
+
+// Wrap
+Wrap *init_wrap (int width);
+void free_wrap (Wrap *wrap);
+void free_line_breaks (GapBufferLine *gbl);
+int line_height (Wrap *wrap, GapBufferLine *entry);
+int wrap_line (Wrap *wrap, MappedFile *map, GapBufferLine *entry);
+void page_set_wrap (Page *page, Wrap *wrap);
+void page_rewrap (Page *page, int width);
+void page_wrap_line (Page *page, int slot);
+int page_line_breaks (Page *page, int slot, const int **breaks);
+int line_wrap_row (const int *breaks, int count, int column);
+int page_height (Page *page);
+int page_slot_top (Page *page, int slot);
+int page_find_top (Page *page, int top, int *rows);
+int page_wrap_some (Page *page, double budget_ms);
+
+// Highlight
+Highlight *init_highlight (void);
+void free_highlight (Highlight *highlight);
+int line_state (Highlight *highlight, GapBufferLine *entry);
+int highlight_view (Highlight *highlight, LineView view, int state, int runs);
+void page_set_highlight (Page *page, Highlight *highlight);
+int page_line_start_state (Page *page, int slot);
+int page_highlight_line (Page *page, int slot, const HighlightRun **runs);
+int page_highlight_some (Page *page, double budget_ms);
+
+// Gab Buffer Page
+GapBufferPage *init_gap_buffer_page (
+    Arena *arena,
+    int initial_size,
+    int gap_size);
+void move_gap_page (GapBufferPage *gbp, int index, GAP_POSITION gap_pos);
+void expand_gap_page (GapBufferPage *gbp, int new_gap_size);
+void shrink_gap_page (GapBufferPage *gbp);
+int insert_line_at_row (GapBufferPage *gbp, GapBufferLine *new_line, int row);
+int insert_single_line (
+    GapBufferPage *gbp,
+    GapBufferLine *new_line,
+    int line_index,
+    DIRECTION dir);
+void insert_in_gap_page (GapBufferPage *gbp, char *buffer_ptr, int count);
+void delete_single_line (GapBufferPage *gbp);
+
+// Page
+int page_split_line (Page *page, int slot, int column);
+int page_join_next_line (Page *page, int slot);
+Page *load_page (const char *path);
+
+// Save
+int save_page (Page *page, const char *path);
+
+// Snapshot
+Snapshot *take_snapshot (Page *page);
+void release_snapshot (Page *page, Snapshot *snapshot);
+
+// Autosave
+Autosave *start_autosave (const char *file_path);
+void stop_autosave (Autosave *autosave, Page *page);
+void autosave_frame (Autosave *autosave, Page *page, double frame_ms);
+
+// Editor
+Editor *init_editor (Page *page, const char *path);
+void free_editor (Editor *editor);
+void editor_insert_text (Editor *editor, const char *text, int count);
+int editor_apply_key (Editor *editor, EditorKey key);
+void editor_insert_at_cursor (Editor *editor, const char *text, int count);
+int editor_key_at_cursor (Editor *editor, EditorKey key);
+void editor_move_cursor (Editor *editor, int slot, int column);
+int editor_text (Editor *editor, char *buffer, int size);
+
+// Multi Cursor
+void selection_range (
+    Selection *selection,
+    int *start_row,
+    int *start_column,
+    int *end_row,
+    int *end_column);
+void editor_add_cursor (Editor *editor, int row, int column);
+void editor_select_to (Editor *editor, int row, int column);
+void editor_clear_cursors (Editor *editor);
+int editor_select_matches (Editor *editor);
+
+// Regex
+Regex *init_regex (Arena *arena);
+void free_regex (Regex *regex);
+int regex_compile (Regex *regex, const char *pattern, int size);
+int regex_step (Regex *regex, RegexDfa *dfa, int state, int byte);
+int regex_end_match (Regex *regex, RegexDfa *dfa, int state);
+int regex_starts (Regex *regex, LineView view, int column);
+int regex_end (Regex *regex, LineView view, int start);
+
+// Search
+long find_span (const char *text, long size, const char *query, int query_size);
+int find_in_view (
+    LineView view,
+    int column,
+    const char *query,
+    int query_size);
+size_t mapped_line_at (
+    MappedFile *map,
+    size_t first,
+    size_t last,
+    size_t offset);
+int page_find (
+    Page *page,
+    int row,
+    int column,
+    const char *query,
+    int query_size,
+    SearchMatch *matches,
+    int max);
+int page_find_regex (
+    Page *page,
+    Regex *regex,
+    int row,
+    int column,
+    SearchMatch *matches,
+    int max);
+int search_page (
+    Search *search,
+    Page *page,
+    int row,
+    int column,
+    SearchMatch *matches,
+    int max);
+void search_collect (Search *search, Page *page, int row, int column);
+void search_refine (Search *search, Page *page);
+void search_set_query (Search *search, Page *page, const char *query, int size);
+void search_set_regex (Search *search, int regex);
+int search_next (Search *search, int row, int column);
+int editor_goto_match (Editor *editor, int row, int column);
+int editor_find (Editor *editor, const char *query, int size);
+int editor_find_next (Editor *editor);
+
+// Trace
+Trace *start_trace (const char *path);
+void stop_trace (Trace *trace);
+void trace_event (Trace *trace, TraceKind kind, int a, int b);
+FILE *open_trace (const char *path);
+int read_trace_event (FILE *file, TraceEvent *event);
+void apply_trace_event (Editor *editor, TraceEvent *event);
+
+// Memory
+void page_memory (Page *page, MemoryStats *stats);
+void editor_memory (Editor *editor, MemoryStats *stats);
+
+// Compaction
+int compact_page (
+    Page *page,
+    Compaction *compaction,
+    Cursor *cursor,
+    double budget_ms);
+void editor_compact (Editor *editor, double budget_ms);
+
+#endif
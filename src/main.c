@@ -1,780 +1,1230 @@
-// TODO(rolf): Error handle all allocations
+#include "core.h"
 #include "raylib.h"
-#include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
 
-#define INIT_SIZE_PAGE 1
-#define INIT_SIZE_LINE 1
-#define GAP_SIZE 5
+// The raylib front end, all editing goes through the Editor of the core
 
+#define DEFAULT_NOTE_PATH "note.md"
+
+#define FONT_PATH "fonts/jpos_sans_serif_regular.ttf"
+#define FONT_SIZE 13
+
+// Codepoints are looked up in pages of GLYPH_PAGE_SIZE, only the pages a note
+// uses get allocated
+#define GLYPH_PAGE_BITS 8
+#define GLYPH_PAGE_SIZE (1 << GLYPH_PAGE_BITS)
+#define GLYPH_PAGE_COUNT ((0x10FFFF >> GLYPH_PAGE_BITS) + 1)
+#define GLYPH_NONE -1
+
+// Rows drawn past the bottom of the window, so a view scrolled by part of a
+// row still has its last row
+#define VIEW_OVERSCAN_ROWS 2
+// Rows per mouse wheel step, and how fast the view catches up with a scroll
+#define VIEW_WHEEL_ROWS 3
+#define VIEW_SCROLL_SPEED 15.0f
+
+// Frames and input events the profiler HUD takes its percentiles over
+#define PROFILE_FRAMES 240
+#define PROFILE_LATENCIES 256
+#define PROFILE_HUD_KEY KEY_F3
+
+// Ctrl and these open and close the find bar, and switch it between text
+// and patterns
+#define FIND_KEY KEY_F
+#define FIND_REGEX_KEY KEY_R
+
+// =============================================================================
+// === Render Functions
+// =============================================================================
 typedef struct
 {
-  void *buffer;
-  int gap_start;
-  int gap_end;
-  int buf_size;
-} GapBuffer;
+  Vector2 page_pos;
+  float width;
+  float height;
+} CursorProps;
+
+// =============================================================================
+// === Glyphs
+// =============================================================================
+// raylib finds the glyph of a codepoint by walking all of them, which is fine
+// for 94 and not for the thousands a note in a few scripts brings along. The
+// table here maps a codepoint to its glyph in two steps and the font starts
+// with ASCII and Latin-1 only. A codepoint the font was not loaded with is
+// drawn as the fallback for a frame and remembered, reload_glyphs then loads
+// the font again with everything asked for so far.
 
 typedef struct
 {
-  char *buffer;
-  int gap_start;
-  int gap_end;
-  int buf_size;
-} GapBufferLine;
+  Font font;
+  const char *path;
+  int size;
 
-typedef struct
+  // Every codepoint asked for, the font is loaded with all of them
+  int *codepoints;
+  int count;
+  int capacity;
+  // Asked for since the last load
+  int missing;
+
+  // Glyph index + 1 of a codepoint, 0 when it was never asked for and
+  // GLYPH_NONE when the font has nothing for it
+  int *pages[GLYPH_PAGE_COUNT];
+  int fallback;
+} Glyphs;
+
+int *
+glyph_entry (Glyphs *glyphs, int codepoint)
 {
-  GapBufferLine **buffer;
-  int gap_start;
-  int gap_end;
-  int buf_size;
-} GapBufferPage;
+  int **page = &glyphs->pages[codepoint >> GLYPH_PAGE_BITS];
+  if (*page == NULL)
+    *page = calloc (GLYPH_PAGE_SIZE, sizeof (int));
+  return &(*page)[codepoint & (GLYPH_PAGE_SIZE - 1)];
+}
 
-typedef struct
+// Glyph index of codepoint, the fallback until the font has it
+int
+glyph_index (Glyphs *glyphs, int codepoint)
 {
-  int line;
-  int pos;
-} Cursor;
+  if (codepoint < 0 || codepoint > 0x10FFFF)
+    return glyphs->fallback;
 
-typedef enum
+  int *entry = glyph_entry (glyphs, codepoint);
+  if (*entry == 0)
+  {
+    if (glyphs->count == glyphs->capacity)
+    {
+      glyphs->capacity = glyphs->capacity * 2 + 256;
+      glyphs->codepoints = realloc (
+          glyphs->codepoints,
+          glyphs->capacity * sizeof (int));
+    }
+    glyphs->codepoints[glyphs->count] = codepoint;
+    glyphs->count++;
+    glyphs->missing++;
+    *entry = GLYPH_NONE;
+  }
+
+  return *entry > 0 ? *entry - 1 : glyphs->fallback;
+}
+
+// Loads the font with every codepoint asked for so far. The new font is
+// loaded before the old one goes, so its glyphs never end up at the address
+// the render cache remembers.
+void
+reload_glyphs (Glyphs *glyphs)
 {
-  OUTSIDE_LEFT,
-  OUTSIDE_RIGHT,
-  BEFORE_GAP,
-  AFTER_GAP,
-  GAP_PLUS_ONE,
-  GAP_MINUS_ONE,
-  INSIDE_GAP_START,
-  INSIDE_GAP_INBETWEEN,
-} PositionInGapArray;
+  Font font = LoadFontEx (
+      glyphs->path,
+      glyphs->size,
+      glyphs->codepoints,
+      glyphs->count);
+  if (glyphs->font.glyphs != NULL)
+    UnloadFont (glyphs->font);
+  glyphs->font = font;
+  glyphs->missing = 0;
+
+  for (int i = 0; i < font.glyphCount; i++)
+    *glyph_entry (glyphs, font.glyphs[i].value) = i + 1;
+
+  int *replacement = glyph_entry (glyphs, UTF8_REPLACEMENT);
+  int *question = glyph_entry (glyphs, '?');
+  if (*replacement > 0)
+    glyphs->fallback = *replacement - 1;
+  else
+    glyphs->fallback = *question > 0 ? *question - 1 : 0;
+}
 
-typedef enum
+Glyphs *
+init_glyphs (const char *path, int size)
 {
-  BEFORE,
-  AFTER,
-} DIRECTION;
+  Glyphs *glyphs = calloc (1, sizeof (Glyphs));
+  glyphs->path = path;
+  glyphs->size = size;
+
+  for (int codepoint = 32; codepoint < 127; codepoint++)
+    glyph_index (glyphs, codepoint);
+  for (int codepoint = 160; codepoint < 256; codepoint++)
+    glyph_index (glyphs, codepoint);
+  glyph_index (glyphs, UTF8_REPLACEMENT);
+  reload_glyphs (glyphs);
+
+  return glyphs;
+}
 
-typedef enum
+void
+free_glyphs (Glyphs *glyphs)
 {
-  GAP_END,
-  GAP_START
-} GAP_POSITION;
+  UnloadFont (glyphs->font);
+  for (int page = 0; page < GLYPH_PAGE_COUNT; page++)
+    free (glyphs->pages[page]);
+  free (glyphs->codepoints);
+  free (glyphs);
+}
 
-// =============================================================================
-// === Utilities
-// =============================================================================
+int
+glyph_advance (Font font, int index)
+{
+  if (font.glyphs[index].advanceX == 0)
+    return font.recs[index].width + 2;
+  return font.glyphs[index].advanceX + 2;
+}
 
-PositionInGapArray
-get_index_pos_in_gap_array (int index, int gap_start, int gap_end, int buf_size)
+// Advance of a codepoint for the Wrap of the page, the fallback's until the
+// font has it, like render_row draws it
+int
+glyph_wrap_advance (void *context, int codepoint)
 {
-  if (index < 0)
-  {
-    return OUTSIDE_LEFT;
-  }
-  if (index > buf_size - 1)
-  {
-    return OUTSIDE_RIGHT;
-  }
-  if (index == gap_start - 1)
-  {
-    return GAP_MINUS_ONE;
-  }
-  if (index == gap_end + 1)
-  {
-    return GAP_PLUS_ONE;
-  }
-  if (index < gap_start)
-  {
-    return BEFORE_GAP;
-  }
-  if (index > gap_end)
-  {
-    return AFTER_GAP;
-  }
-  if (gap_start == 0)
-  {
-    return INSIDE_GAP_START;
-  }
-  return INSIDE_GAP_INBETWEEN;
+  Glyphs *glyphs = context;
+  return glyph_advance (glyphs->font, glyph_index (glyphs, codepoint));
 }
 
+// The wrap measures with the font, after a new one every line is stale
 void
-print_line (GapBufferLine *gbl)
+set_wrap_font (Wrap *wrap, Glyphs *glyphs)
 {
-  printf ("[");
-  for (int i = 0; i < gbl->buf_size; i++)
-  {
-    if (i < gbl->gap_start || i > gbl->gap_end)
-      printf ("%c", gbl->buffer[i]);
-    else if (i < gbl->buf_size - 1)
-      printf ("_");
-  }
-  printf ("]\n");
+  for (int codepoint = ' '; codepoint < 127; codepoint++)
+    wrap->ascii[codepoint] = glyph_wrap_advance (glyphs, codepoint);
+  wrap->ascii[127] = glyph_advance (glyphs->font, glyphs->fallback);
+  wrap->advance = glyph_wrap_advance;
+  wrap->context = glyphs;
 }
 
+// What DrawTextCodepoint does, minus its search for the glyph
 void
-print_page (GapBufferPage *gbp)
+draw_glyph (Font font, int index, Vector2 position, Color tint)
 {
-  printf ("[\n");
-  for (int i = 0; i < gbp->buf_size; i++)
-  {
-    if (i < gbp->gap_start || i > gbp->gap_end)
-    {
-      print_line (gbp->buffer[i]);
-    }
-    else
-    {
-      printf ("_\n");
-    }
-  }
-  printf ("]\n");
+  float padding = (float)font.glyphPadding;
+  Rectangle source = { font.recs[index].x - padding,
+                       font.recs[index].y - padding,
+                       font.recs[index].width + 2 * padding,
+                       font.recs[index].height + 2 * padding };
+  Rectangle dest = { position.x + font.glyphs[index].offsetX - padding,
+                     position.y + font.glyphs[index].offsetY - padding,
+                     source.width,
+                     source.height };
+  DrawTexturePro (font.texture, source, dest, (Vector2){ 0, 0 }, 0, tint);
 }
 
 // =============================================================================
-// === DEBUG
+// === Render Cache
 // =============================================================================
+// The text is drawn into a texture one row at a time and the texture is what
+// ends up on screen every frame. A row is only drawn again when the line in it
+// changed, see Damage, or a different line or part of one moved into it. A
+// line that is wrapped takes a row for every part, see Wrap.
 
-int count = 0;
-void
-render_page_debug (GapBufferPage *gbp, char *buffer, int size, Cursor c)
+typedef struct
 {
-  int pos = 0;
-  buffer[pos] = '[';
-  pos++;
-  buffer[pos] = '\n';
-  pos++;
+  GapBufferLine *line;
+  int drawn;
+
+  // Line shown, -1 for none, and the byte columns of its part in this row.
+  // end is where the next row of the line starts, INT_MAX on its last one.
+  int row;
+  int start;
+  int end;
+
+  // x and line byte column of every drawn char, one past the last for the
+  // end
+  float *x;
+  int *bytes;
+  int columns;
+} RenderRow;
 
-  for (int i = 0; i < gbp->buf_size; i++)
+typedef struct
+{
+  RenderTexture2D target;
+  RenderRow *rows;
+  int row_count;
+  int row_height;
+  int width;
+
+  // One row of a line flattened, only as much as fits in the width
+  char *text;
+  int max_columns;
+  int max_bytes;
+
+  // What the rows were laid out for, a different font invalidates them.
+  // first_row counts wrapped rows.
+  int first_row;
+  GlyphInfo *glyphs;
+  int font_size;
+
+  // Rows drawn in the last frame
+  int rows_drawn;
+} RenderCache;
+
+RenderCache *
+init_render_cache (int width, int height, int row_height)
+{
+  RenderCache *cache = malloc (sizeof (RenderCache));
+  cache->target = LoadRenderTexture (
+      width,
+      (height / row_height + VIEW_OVERSCAN_ROWS) * row_height);
+  cache->row_count = height / row_height + VIEW_OVERSCAN_ROWS;
+  cache->row_height = row_height;
+  cache->width = width;
+  cache->rows = calloc (cache->row_count, sizeof (RenderRow));
+
+  // A glyph is at least a pixel plus the spacing of 2 wide
+  cache->max_columns = width / 3 + 1;
+  cache->max_bytes = cache->max_columns * UTF8_MAX_SIZE;
+  cache->text = malloc (cache->max_bytes + 1);
+  cache->rows_drawn = 0;
+  cache->first_row = 0;
+  cache->glyphs = NULL;
+  cache->font_size = 0;
+
+  for (int row = 0; row < cache->row_count; row++)
   {
-    if (i < gbp->gap_start || i > gbp->gap_end)
-    {
-      GapBufferLine *gbl = gbp->buffer[i];
-      buffer[pos] = '[';
-      pos++;
-
-      for (int l = 0; l < gbl->buf_size; l++)
-      {
-        // Render Char/Gap;
-        if (l < gbl->gap_start || l > gbl->gap_end)
-        {
-          // Account for padding
-          if (l < gbl->buf_size - 1)
-          {
-            buffer[pos] = gbl->buffer[l];
-            pos++;
-          }
-          else if (l == gbl->buf_size - 1)
-          {
-            buffer[pos] = ':';
-            pos++;
-          }
-        }
-        else if (l < gbl->buf_size - 1)
-        {
-          buffer[pos] = '_';
-          pos++;
-        }
-
-        // Cursor
-        if (i == c.line && l == c.pos)
-        {
-          if (count++ % 2)
-          {
-            buffer[pos - 1] = (char)219;
-          }
-        }
-      }
-      buffer[pos] = ']';
-      pos++;
-      buffer[pos] = '\n';
-      pos++;
-    }
-    else
-    {
-      buffer[pos] = '_';
-      pos++;
-      buffer[pos] = '\n';
-      pos++;
-    }
+    cache->rows[row].row = -1;
+    cache->rows[row].x = malloc ((cache->max_columns + 1) * sizeof (float));
+    cache->rows[row].bytes = malloc ((cache->max_columns + 1) * sizeof (int));
   }
-  buffer[pos] = ']';
-  pos++;
-  buffer[pos] = '\n';
-  pos++;
-  buffer[pos] = '\0';
-}
 
-// =============================================================================
-// === Cursor
-// =============================================================================
+  BeginTextureMode (cache->target);
+  ClearBackground (RAYWHITE);
+  EndTextureMode ();
 
-Cursor *
-init_cursor (int line, int pos)
-{
-  Cursor *c = malloc (sizeof (Cursor));
-  c->line = line;
-  c->pos = pos;
+  return cache;
+}
 
-  return c;
+void
+free_render_cache (RenderCache *cache)
+{
+  UnloadRenderTexture (cache->target);
+  for (int row = 0; row < cache->row_count; row++)
+  {
+    free (cache->rows[row].x);
+    free (cache->rows[row].bytes);
+  }
+  free (cache->rows);
+  free (cache->text);
+  free (cache);
 }
 
-int
-move_cursor_next_line (Cursor *c, GapBufferPage *gbp)
+// Plain text keeps the color the editor always had
+Color
+highlight_color (HighlightKind kind)
 {
-  if (c->line < gbp->buf_size - 1)
+  switch (kind)
   {
-    if (c->line + 1 == gbp->gap_start)
-    {
-      if (gbp->gap_end != gbp->buf_size - 1)
-      {
-        c->line = gbp->gap_end + 1;
-        return 0;
-      }
-    }
-    else
-    {
-      c->line++;
-      return 0;
-    }
+  case HIGHLIGHT_HEADING:
+    return DARKBLUE;
+  case HIGHLIGHT_FENCE:
+    return GRAY;
+  case HIGHLIGHT_CODE:
+    return DARKGREEN;
+  case HIGHLIGHT_MARKER:
+    return ORANGE;
+  case HIGHLIGHT_TASK:
+    return RED;
+  case HIGHLIGHT_TASK_DONE:
+    return LIME;
+  case HIGHLIGHT_TAG:
+    return DARKPURPLE;
+  default:
+    return MAROON;
   }
-  return 1;
 }
 
-int
-move_cursor_previous_line (Cursor *c, GapBufferPage *gbp)
+// Draws the bytes start to end of the line in slot into the row, colored by
+// the runs of the whole line
+void
+render_row (
+    RenderCache *cache,
+    Page *page,
+    int slot,
+    Glyphs *glyphs,
+    int row,
+    int start,
+    int end,
+    const HighlightRun *runs,
+    int run_count)
 {
-  if (c->line > 0)
+  int y = row * cache->row_height;
+  RenderRow *cached = &cache->rows[row];
+  DrawRectangle (0, y, cache->width, cache->row_height, RAYWHITE);
+  cached->columns = 0;
+  cached->x[0] = 0;
+  cached->bytes[0] = start;
+  if (slot < 0)
+    return;
+
+  LineView view = page_line_view (page, slot);
+  int length = view.before_size + view.after_size;
+  if (end > length)
+    end = length;
+  int stop = end - start > cache->max_bytes ? start + cache->max_bytes : end;
+
+  // The part in front of the gap, then the one behind it
+  if (start < view.before_size)
   {
-    if (c->line - 1 == gbp->gap_end)
-    {
-      if (gbp->gap_start != 0)
-      {
-        c->line = gbp->gap_start - 1;
-        return 0;
-      }
-    }
-    else
-    {
-      c->line--;
-      return 0;
-    }
+    int until = stop < view.before_size ? stop : view.before_size;
+    memcpy (cache->text, view.before + start, until - start);
+  }
+  int from = start > view.before_size ? start : view.before_size;
+  if (stop > from)
+    memcpy (
+        cache->text + from - start,
+        view.after + from - view.before_size,
+        stop - from);
+  int size = stop - start;
+  int cut = stop < end;
+
+  // One glyph per char, looked up in the table instead of by DrawTextEx
+  Font font = glyphs->font;
+  int run = 0;
+  int i = 0;
+  while (i < size && cached->columns < cache->max_columns)
+  {
+    int length = utf8_char_size (cache->text + i, size - i);
+    // The rest of a char cut at max_bytes is not in text
+    if (cut && i + length == size)
+      break;
+
+    int codepoint;
+    if (utf8_decode (cache->text + i, length, &codepoint) != length)
+      codepoint = UTF8_REPLACEMENT;
+    // Control chars are sized like a space
+    if (codepoint < ' ')
+      codepoint = ' ';
+    int index = glyph_index (glyphs, codepoint);
+
+    while (run + 1 < run_count && runs[run + 1].start <= start + i)
+      run++;
+    Color color = run_count > 0 ? highlight_color (runs[run].kind) : MAROON;
+
+    float x = cached->x[cached->columns];
+    if (codepoint != ' ')
+      draw_glyph (font, index, (Vector2){ x, y }, color);
+    cached->columns++;
+    cached->x[cached->columns] = x + glyph_advance (font, index);
+    i += length;
+    cached->bytes[cached->columns] = start + i;
   }
-  return 1;
 }
 
-PositionInGapArray
-move_cursor (Cursor *c, GapBufferPage *gbp, int new_index)
+// Brings the texture up to date with the page from the wrapped row first_row
+// on, returns the number of rows that show a line. The lines on screen are
+// wrapped first if they are stale.
+int
+render_page_cached (
+    RenderCache *cache,
+    Page *page,
+    Glyphs *glyphs,
+    int first_row)
 {
-  GapBufferLine *line = gbp->buffer[c->line];
-  PositionInGapArray state = get_index_pos_in_gap_array (
-      new_index,
-      line->gap_start,
-      line->gap_end,
-      line->buf_size);
-
-  switch (state)
+  Font font = glyphs->font;
+  Damage *damage = &page->damage;
+  int font_changed
+      = font.glyphs != cache->glyphs || font.baseSize != cache->font_size;
+  cache->glyphs = font.glyphs;
+  cache->font_size = font.baseSize;
+  cache->first_row = first_row;
+
+  for (int row = 0; row < cache->row_count; row++)
   {
-  case OUTSIDE_RIGHT:
-    if (line->gap_end == line->buf_size - 1)
-    {
-      c->pos = line->gap_start - 1;
-    }
-    else
+    if (damage->all || font_changed)
     {
-      c->pos = line->buf_size - 1;
+      cache->rows[row].drawn = 0;
+      continue;
     }
-    return state;
-  case OUTSIDE_LEFT:
-    if (line->gap_start == 0)
+    for (int i = 0; i < damage->count; i++)
     {
-      c->pos = line->gap_end + 1;
+      if (cache->rows[row].line == damage->lines[i])
+        cache->rows[row].drawn = 0;
     }
-    else
+  }
+  damage->count = 0;
+  damage->all = 0;
+
+  // Row of the line the first row shows, the line may wrap to less once it
+  // is wrapped again
+  int part;
+  int slot = page_find_top (page, first_row, &part);
+  const int *breaks = NULL;
+  int count = slot >= 0 ? page_line_breaks (page, slot, &breaks) : 0;
+  if (part > count)
+    part = count;
+
+  int visible = 0;
+  cache->rows_drawn = 0;
+  for (int row = 0; row < cache->row_count; row++)
+  {
+    GapBufferLine *line = NULL;
+    int start = 0;
+    int end = 0;
+    RenderRow *cached = &cache->rows[row];
+    cached->row = -1;
+    if (slot >= 0)
     {
-      c->pos = 0;
+      line = page_line_entry (page, slot);
+      start = part > 0 ? breaks[part - 1] : 0;
+      end = part < count ? breaks[part] : INT_MAX;
+      cached->row = page_slot_to_row (page, slot);
+      visible++;
     }
-    return state;
-  case BEFORE_GAP:
-  case AFTER_GAP:
-  case GAP_PLUS_ONE:
-  case GAP_MINUS_ONE:
-    c->pos = new_index;
-    return state;
-  case INSIDE_GAP_START:
-    c->pos = line->gap_end + 1;
-    return state;
-  case INSIDE_GAP_INBETWEEN:
-    if (c->pos > new_index)
+
+    if (!cached->drawn || cached->line != line || cached->start != start
+        || cached->end != end)
     {
-      c->pos = line->gap_start - 1;
+      if (cache->rows_drawn == 0)
+        BeginTextureMode (cache->target);
+      const HighlightRun *runs = NULL;
+      int run_count = slot >= 0 ? page_highlight_line (page, slot, &runs) : 0;
+      render_row (cache, page, slot, glyphs, row, start, end, runs, run_count);
+      cached->line = line;
+      cached->start = start;
+      cached->end = end;
+      cached->drawn = 1;
+      cache->rows_drawn++;
     }
-    else
+
+    if (slot >= 0 && ++part > count)
     {
-      c->pos = line->gap_end + 1;
+      slot = page_next_slot (page, slot);
+      part = 0;
+      count = slot >= 0 ? page_line_breaks (page, slot, &breaks) : 0;
     }
-    return state;
   }
+  if (cache->rows_drawn > 0)
+    EndTextureMode ();
+
+  return visible;
 }
 
-// =============================================================================
-// === Gap Buffer
-// =============================================================================
-void
-move_gap_start (GapBuffer *gb, int index, size_t element_size)
+// Bytes the cache holds on the CPU, and the texture on the GPU
+long
+render_cache_memory (RenderCache *cache, long *texture_bytes)
 {
-  int dest;
-  int src;
-  int size;
-  int gap_size = gb->gap_end - gb->gap_start + 1;
-
-  assert (index < gb->buf_size);
-  if (index < 0)
-    index = 0;
+  *texture_bytes = (long)cache->target.texture.width
+                   * cache->target.texture.height * 4;
+  return sizeof (RenderCache) + cache->row_count * sizeof (RenderRow)
+         + cache->row_count * (cache->max_columns + 1)
+               * (sizeof (float) + sizeof (int))
+         + cache->max_bytes + 1;
+}
 
-  // Index before gap
-  if (index < gb->gap_start)
+// The cached row the byte column of the line in row is drawn in, NULL if it
+// is not on screen. A screenful of rows is few enough to just walk them.
+RenderRow *
+render_cache_row (RenderCache *cache, int row, int column)
+{
+  for (int i = 0; i < cache->row_count; i++)
   {
-    dest = index + gap_size;
-    src = index;
-    size = gb->gap_start - index;
+    RenderRow *cached = &cache->rows[i];
+    if (cached->drawn && cached->row == row && column >= cached->start
+        && column < cached->end)
+      return cached;
   }
-  // index after gap
-  else if (index > gb->gap_end)
+  return NULL;
+}
+
+// Rows of the first and the last line on screen, both -1 if there is none
+void
+render_cache_lines (RenderCache *cache, int *first, int *last)
+{
+  *first = cache->rows[0].drawn ? cache->rows[0].row : -1;
+  *last = -1;
+  for (int i = cache->row_count - 1; i >= 0 && *last < 0; i--)
   {
-    // Not enough space for gap after index
-    if (gb->buf_size - gap_size < index)
-    {
-      index = gb->buf_size - gap_size;
-    }
-    dest = gb->gap_start;
-    src = gb->gap_end + 1;
-    size = index - gb->gap_start + 1;
+    if (cache->rows[i].drawn)
+      *last = cache->rows[i].row;
   }
-  // index inside gap
-  else
+}
+
+// The drawn char that starts at or contains the byte column
+int
+render_row_char (RenderRow *cached, int column)
+{
+  int low = 0;
+  int high = cached->columns;
+  while (low < high)
   {
-    // Not enough space for gap after index
-    if (gb->buf_size - gap_size < index)
-    {
-      index = gb->buf_size - gap_size;
-    }
-    dest = gb->gap_start;
-    src = gb->gap_end + 1;
-    size = index - gb->gap_start;
+    int mid = (low + high + 1) / 2;
+    if (cached->bytes[mid] <= column)
+      low = mid;
+    else
+      high = mid - 1;
   }
-
-  memmove (
-      (char *)gb->buffer + dest * element_size,
-      (char *)gb->buffer + src * element_size,
-      size * element_size);
-
-  gb->gap_start = index;
-  gb->gap_end = index + (gap_size - 1);
+  return low;
 }
 
-void
-move_gap_end (GapBuffer *gb, int index, size_t element_size)
+CursorProps
+render_cursor_pos_from_page (
+    RenderCache *cache,
+    Cursor c,
+    Page *page,
+    Glyphs *glyphs)
 {
-  int dest;
-  int src;
-  int size;
-  int gap_size = gb->gap_end - gb->gap_start + 1;
+  CursorProps result;
+  GapBufferLine *line = page_line (page, c.line);
+  int column = line_column (line, c.pos);
+  const int *breaks;
+  int count = page_line_breaks (page, c.line, &breaks);
+
+  result.page_pos.y
+      = (page_slot_top (page, c.line) + line_wrap_row (breaks, count, column))
+        * cache->row_height;
+  result.page_pos.x = 0;
+  result.width = (float)glyph_advance (glyphs->font, glyph_index (glyphs, ' '));
+  result.height = (float)glyphs->font.baseSize;
+
+  // Off screen or cut at the width, either way there is nothing to see
+  RenderRow *cached
+      = render_cache_row (cache, page_slot_to_row (page, c.line), column);
+  if (cached == NULL || column > cached->bytes[cached->columns])
+    return result;
+
+  int i = render_row_char (cached, column);
+  result.page_pos.x = cached->x[i];
+  if (i < cached->columns)
+    result.width = cached->x[i + 1] - cached->x[i];
 
-  assert (index < gb->buf_size);
-  if (index < 0)
-    index = 0;
+  return result;
+}
 
-  // Index before gap
-  if (index < gb->gap_start)
+// Byte column of the char in the row whose left edge is closest to x
+int
+render_column_at (RenderRow *cached, float x)
+{
+  // Last column starting at or before x
+  int low = 0;
+  int high = cached->columns;
+  while (low < high)
   {
+    int mid = (low + high + 1) / 2;
+    if (cached->x[mid] <= x)
+      low = mid;
+    else
+      high = mid - 1;
+  }
 
-    // Not enough space for gap before index
-    if (gb->buf_size - gap_size < index)
-      if (index < gap_size - 1)
-      {
-        index = gap_size - 1;
-      }
+  if (low < cached->columns && x - cached->x[low] > (cached->x[low + 1] - x))
+    low++;
+  return cached->bytes[low];
+}
 
-    dest = index + 1;
-    src = index - (gap_size - 1);
-    size = gb->gap_start - src;
-  }
-  // index after gap
-  else if (index > gb->gap_end)
+// Behind the byte columns start to end of the line in row, end -1 for the
+// whole rest, one rectangle for every row of it on screen
+void
+draw_span (
+    RenderCache *cache,
+    int row,
+    int start,
+    int end,
+    Vector2 position,
+    Color color)
+{
+  for (int i = 0; i < cache->row_count; i++)
   {
-    dest = gb->gap_start;
-    src = gb->gap_end + 1;
-    size = index - gb->gap_end;
+    RenderRow *cached = &cache->rows[i];
+    if (!cached->drawn || cached->row != row)
+      continue;
+
+    int from = start > cached->start ? start : cached->start;
+    if (from >= cached->end || from > cached->bytes[cached->columns]
+        || (end >= 0 && end < from))
+      continue;
+
+    int first = render_row_char (cached, from);
+    int last = end < 0 || end >= cached->end ? cached->columns
+                                             : render_row_char (cached, end);
+    DrawRectangleV (
+        (Vector2){ position.x + cached->x[first],
+                   position.y + i * cache->row_height },
+        (Vector2){ cached->x[last] - cached->x[first], cache->row_height },
+        color);
   }
-  // index inside gap
-  else
-  {
-    // Not enough space for gap before index
-    if (index < gap_size - 1)
-    {
-      index = gap_size - 1;
-    }
+}
 
-    dest = index + 1;
-    src = index - (gap_size - 1);
-    size = gb->gap_start - src;
-  }
+void
+draw_render_cache (RenderCache *cache, Vector2 position)
+{
+  // Render textures are stored upside down
+  Rectangle source = { 0,
+                       0,
+                       (float)cache->target.texture.width,
+                       (float)-cache->target.texture.height };
+  DrawTextureRec (cache->target.texture, source, position, WHITE);
+}
 
-  memmove (
-      (char *)gb->buffer + dest * element_size,
-      (char *)gb->buffer + src * element_size,
-      size * element_size);
+// =============================================================================
+// === Viewport
+// =============================================================================
+// The view is a scroll position in pixels from the top of the page that eases
+// towards its target. Rows are the ones of the wrapped lines. Only the rows
+// from first_row on are ever rendered, so a frame costs the same for a short
+// note and a huge file.
 
-  gb->gap_end = index;
-  gb->gap_start = index - (gap_size - 1);
+typedef struct
+{
+  float y;
+  float target;
+  int height;
+  int row_height;
+  int rows;
+} Viewport;
+
+Viewport *
+init_viewport (int height, int row_height)
+{
+  Viewport *view = malloc (sizeof (Viewport));
+  view->y = 0;
+  view->target = 0;
+  view->height = height;
+  view->row_height = row_height;
+  view->rows = height / row_height;
+
+  return view;
 }
 
 void
-expand_gap (GapBuffer *gb, int size, size_t element_size)
+resize_viewport (Viewport *view, int height)
 {
-  // The gab is a resource we never want to shrink it
-  if (size <= (gb->gap_end - gb->gap_start + 1))
-    return;
-
-  int new_size = gb->buf_size + size - (gb->gap_end - gb->gap_start + 1);
-  char *new_buffer = malloc (new_size * element_size);
-
-  // NOTE: Only for debugging
-  for (int i = 0; i < new_size; i++)
-  {
-    new_buffer[i] = 'A';
-  }
+  view->height = height;
+  view->rows = height / view->row_height;
+}
 
-  memcpy (new_buffer, gb->buffer, gb->gap_start * element_size);
-  memcpy (
-      new_buffer + (gb->gap_start + size) * element_size,
-      &gb->buffer[(gb->gap_end + 1) * element_size],
-      (gb->buf_size - gb->gap_end) * element_size);
+int
+viewport_first_row (Viewport *view)
+{
+  return (int)(view->y / view->row_height);
+}
 
-  free (gb->buffer);
-  gb->buffer = new_buffer;
+// Pixels the first row is scrolled out at the top
+float
+viewport_offset (Viewport *view)
+{
+  return view->y - viewport_first_row (view) * view->row_height;
+}
 
-  gb->gap_end = gb->gap_start + size - 1;
-  gb->buf_size = new_size;
+void
+scroll_viewport (Viewport *view, float rows)
+{
+  view->target += rows * view->row_height;
 }
 
+// Scrolls just far enough for row to be fully inside the view
 void
-insert_in_gap (GapBuffer *gb, char *buffer_ptr, int count, size_t element_size)
+viewport_follow_row (Viewport *view, int row)
 {
-  int gap_size = gb->gap_end - gb->gap_start + 1;
+  float top = (float)row * view->row_height;
+  float bottom = top + view->row_height;
 
-  if (gap_size <= count)
-  {
-    expand_gap (gb, count + GAP_SIZE, element_size);
-  }
-  memcpy (gb->buffer, buffer_ptr, count * element_size);
+  if (top < view->target)
+    view->target = top;
+  else if (bottom > view->target + view->height)
+    view->target = bottom - view->height;
+}
 
-  gb->gap_start = gb->gap_start + count;
+void
+update_viewport (Viewport *view, int page_rows, float frame_time)
+{
+  float max = (float)(page_rows - view->rows) * view->row_height;
+  if (view->target > max)
+    view->target = max;
+  if (view->target < 0)
+    view->target = 0;
+
+  float step = frame_time * VIEW_SCROLL_SPEED;
+  if (step > 1.0f)
+    step = 1.0f;
+
+  float distance = view->target - view->y;
+  if (distance < 0.5f && distance > -0.5f)
+    view->y = view->target;
+  else
+    view->y += distance * step;
 }
 
 // =============================================================================
-// === Gap Buffer Line
+// === Find
 // =============================================================================
+// Ctrl+F opens the find bar. While it is open typing goes into the query and
+// the cursor jumps to the first match from where it is, Enter goes on to the
+// next one and Backspace takes the last char off the query. Ctrl+R makes
+// the query a regex and back, Ctrl+Enter puts a cursor on every match with
+// the match selected and closes the bar. The matches come from the Search of
+// the editor, the ones on screen get a highlight.
 
-GapBufferLine *
-init_gap_buffer_line (int initial_size, int gap_size)
+typedef struct
 {
-  GapBufferLine *gbl = malloc (sizeof (GapBufferLine));
-  int buf_size = (initial_size + gap_size) * sizeof (char);
+  int open;
+  char query[SEARCH_MAX_QUERY];
+  int size;
+} FindBar;
 
-  gbl->buffer = malloc (buf_size);
-  gbl->gap_start = 0;
-  gbl->gap_end = gap_size - 1;
-  gbl->buf_size = buf_size;
+// Adds the char to the query and searches as you type
+void
+find_type (FindBar *find, Editor *editor, int codepoint)
+{
+  // A byte stays free for the '\0' draw_find_bar puts after it
+  if (find->size + UTF8_MAX_SIZE >= SEARCH_MAX_QUERY || codepoint < 32)
+    return;
 
-  assert (gbl->gap_end < gbl->buf_size);
+  find->size += utf8_encode (codepoint, find->query + find->size);
+  editor_find (editor, find->query, find->size);
+}
 
-  for (int i = 0; i < gbl->buf_size; i++)
+// 1 if the key was for the find bar
+int
+find_key (FindBar *find, Editor *editor, int key, int control)
+{
+  if (key == FIND_KEY && control)
   {
-    gbl->buffer[i] = '\0';
+    find->open = !find->open;
+    return 1;
   }
+  if (!find->open)
+    return 0;
 
-  return gbl;
+  if (key == FIND_REGEX_KEY && control)
+  {
+    search_set_regex (&editor->search, !editor->search.regex);
+    editor_find (editor, find->query, find->size);
+    return 1;
+  }
+  if (key == KEY_ENTER && control)
+  {
+    if (editor_select_matches (editor) > 0)
+      find->open = 0;
+    return 1;
+  }
+  if (key == KEY_ENTER)
+  {
+    editor_find_next (editor);
+    return 1;
+  }
+  if (key == KEY_BACKSPACE)
+  {
+    while (find->size > 0)
+    {
+      find->size--;
+      if (!utf8_is_continuation (find->query[find->size]))
+        break;
+    }
+    editor_find (editor, find->query, find->size);
+    return 1;
+  }
+  return 0;
 }
 
+// A replay has no find bar, it gets a click to where the search went. After
+// Ctrl+Enter it gets the selections, the primary one last so it is the
+// primary one again.
 void
-move_gap_line (GapBufferLine *gbl, int index, GAP_POSITION gap_pos)
+trace_find (Trace *trace, Editor *editor)
 {
-  GapBuffer gb = { gbl->buffer, gbl->gap_start, gbl->gap_end, gbl->buf_size };
-
-  switch (gap_pos)
+  if (editor->selection_count == 0)
   {
-  case GAP_START:
-    move_gap_start (&gb, index, sizeof (char));
-    break;
-  case GAP_END:
-    move_gap_end (&gb, index, sizeof (char));
-    break;
+    GapBufferLine *line = page_line (editor->page, editor->cursor->line);
+    trace_event (
+        trace,
+        TRACE_CLICK,
+        page_slot_to_row (editor->page, editor->cursor->line),
+        line_column (line, editor->cursor->pos));
+    return;
   }
 
-  gbl->gap_start = gb.gap_start;
-  gbl->gap_end = gb.gap_end;
+  // Where each one starts, then where its cursor is
+  TraceKind start = TRACE_CLICK;
+  for (int i = 0; i <= editor->selection_count; i++)
+  {
+    if (i == editor->primary)
+      continue;
+
+    int index = i < editor->selection_count ? i : editor->primary;
+    Selection *selection = &editor->selections[index];
+    trace_event (
+        trace,
+        start,
+        selection->anchor_row,
+        selection->anchor_column);
+    trace_event (trace, TRACE_SELECT, selection->row, selection->column);
+    start = TRACE_ADD_CURSOR;
+  }
 }
 
+// Behind the matches in the rows the cache has drawn
 void
-expand_gap_line (GapBufferLine *gbl, int new_gap_size)
+draw_search_matches (RenderCache *cache, Search *search, Vector2 position)
 {
-  GapBuffer gb = { gbl->buffer, gbl->gap_start, gbl->gap_end, gbl->buf_size };
-  expand_gap (&gb, new_gap_size, sizeof (char));
+  if (search->size == 0 || search->stale)
+    return;
 
-  gbl->buffer = gb.buffer;
-  gbl->buf_size = gb.buf_size;
-  gbl->gap_start = gb.gap_start;
-  gbl->gap_end = gb.gap_end;
-}
+  int first_row, last_row;
+  render_cache_lines (cache, &first_row, &last_row);
+  if (first_row < 0)
+    return;
 
-void
-insert_single_char (GapBufferLine *gbl, char value, GAP_POSITION gap_pos)
-{
-  if (gbl->gap_end == gbl->gap_start)
-    expand_gap_line (gbl, GAP_SIZE);
-  switch (gap_pos)
+  for (int i = search_next (search, first_row, 0);
+       i >= 0 && i < search->count;
+       i++)
   {
-  case GAP_START:
-    gbl->buffer[gbl->gap_start] = value;
-    gbl->gap_start++;
-    break;
-  case GAP_END:
-    gbl->buffer[gbl->gap_end] = value;
-    gbl->gap_end--;
-    break;
+    SearchMatch *match = &search->matches[i];
+    if (match->row > last_row)
+      break;
+
+    draw_span (
+        cache,
+        match->row,
+        match->column,
+        match->column + match->size,
+        position,
+        Fade (YELLOW, 0.5f));
   }
 }
 
 void
-insert_in_gap_line (GapBufferLine *gbl, char *buffer_ptr, int count)
+draw_find_bar (FindBar *find, Editor *editor, int x, int y)
 {
-  GapBuffer gb = { gbl->buffer, gbl->gap_start, gbl->gap_end, gbl->buf_size };
-  insert_in_gap (&gb, buffer_ptr, count, sizeof (GapBufferLine *));
-  gbl->buffer = gb.buffer;
-  gbl->buf_size = gb.buf_size;
-  gbl->gap_start = gb.gap_start;
-  gbl->gap_end = gb.gap_end;
+  Search *search = &editor->search;
+  GapBufferLine *line = page_line (editor->page, editor->cursor->line);
+  int current = search_next (
+      search,
+      page_slot_to_row (editor->page, editor->cursor->line),
+      line_column (line, editor->cursor->pos));
+
+  // A pattern that does not compile says why instead of the count
+  const char *error = search->regex && search->compiled != NULL
+                              && find->size > 0
+                          ? search->compiled->error
+                          : NULL;
+
+  find->query[find->size] = '\0';
+  DrawText (
+      error != NULL
+          ? TextFormat ("regex: %s   %s", find->query, error)
+          : TextFormat (
+              "%s: %s   %d of %d%s, %.2f ms",
+              search->regex ? "regex" : "find",
+              find->query,
+              current >= 0 && search->count > 0 ? current + 1 : 0,
+              search->count,
+              search->truncated ? "+" : "",
+              search->ms),
+      x,
+      y,
+      10,
+      DARKGRAY);
 }
 
+// =============================================================================
+// === Selections
+// =============================================================================
+// With more than one cursor, what they select is highlighted in the rows the
+// cache has drawn and every cursor but the primary one gets a bar. The
+// primary one blinks like the one cursor does.
+
 void
-delete_single_char (GapBufferLine *gbl, GAP_POSITION gap_pos)
+draw_selections (RenderCache *cache, Editor *editor, Vector2 position)
 {
-  switch (gap_pos)
+  int first_row, last_row;
+  render_cache_lines (cache, &first_row, &last_row);
+  if (first_row < 0)
+    return;
+
+  for (int i = 0; i < editor->selection_count; i++)
   {
-  case GAP_START:
-    if (gbl->gap_start > 0)
-    {
-      gbl->gap_start--;
-    }
-    break;
-  case GAP_END:
-    if (gbl->gap_end < gbl->buf_size - 1)
+    Selection *selection = &editor->selections[i];
+    int start_row, start_column, end_row, end_column;
+    selection_range (
+        selection,
+        &start_row,
+        &start_column,
+        &end_row,
+        &end_column);
+    if (end_row < first_row)
+      continue;
+    if (start_row > last_row)
+      break;
+
+    int row = start_row > first_row ? start_row : first_row;
+    for (; row <= end_row && row <= last_row; row++)
     {
-      gbl->gap_end++;
+      draw_span (
+          cache,
+          row,
+          row == start_row ? start_column : 0,
+          row == end_row ? end_column : -1,
+          position,
+          Fade (SKYBLUE, 0.5f));
     }
+
+    if (i == editor->primary)
+      continue;
+    RenderRow *cached
+        = render_cache_row (cache, selection->row, selection->column);
+    if (cached == NULL || selection->column > cached->bytes[cached->columns])
+      continue;
+
+    int column = render_row_char (cached, selection->column);
+    DrawRectangleV (
+        (Vector2){ position.x + cached->x[column],
+                   position.y + (cached - cache->rows) * cache->row_height },
+        (Vector2){ 2, cache->row_height },
+        GREEN);
   }
 }
 
 // =============================================================================
-// === Gab Buffer Page
+// === Profiler
 // =============================================================================
+// Every frame is cut into phases, each one runs until the next one starts.
+// The last PROFILE_FRAMES frames are kept for the HUD (F3) and with
+// --profile file every frame is also written out as a CSV row.
+//
+// Latency is from the frame that took an input in to EndDrawing returning.
+// raylib polls input at the end of EndDrawing and then sleeps for
+// SetTargetFPS, so on a fast machine that sleep is most of it. On a slow one
+// the sleep drops to zero and what is left is where the time goes.
+
+typedef enum
+{
+  PHASE_INPUT,
+  PHASE_EDIT,
+  PHASE_RENDER,
+  PHASE_CURSOR,
+  PHASE_DRAW,
+  PHASE_IDLE,
+  PHASE_PRESENT,
+  PHASE_COUNT,
+} Phase;
+
+const char *phase_names[PHASE_COUNT] = {
+  "input", "edit", "render", "cursor", "draw", "idle", "present",
+};
 
-GapBufferPage *
-init_gap_buffer_page (int initial_size, int gap_size)
+typedef struct
 {
-  GapBufferPage *gbp = malloc (sizeof (GapBufferPage));
-  gbp->buffer = malloc ((initial_size + gap_size) * sizeof (GapBufferLine *));
-  gbp->gap_start = 0;
-  gbp->gap_end = gap_size - 1;
-  gbp->buf_size = initial_size + gap_size;
+  // The frame that is running
+  double frame_start;
+  double phase_start;
+  int phase;
+  double phase_ms[PHASE_COUNT];
+  int inputs;
+
+  // Rings of the last frames, the row after the phases is the whole frame
+  double history[PHASE_COUNT + 1][PROFILE_FRAMES];
+  double latency[PROFILE_LATENCIES];
+  long frames;
+  long latencies;
+
+  int show;
+  FILE *dump;
+} Profiler;
+
+Profiler *
+init_profiler (const char *dump_path)
+{
+  Profiler *profiler = calloc (1, sizeof (Profiler));
+  profiler->phase = PHASE_COUNT;
 
-  for (int i = 0; i < gbp->buf_size; i++)
+  if (dump_path != NULL)
   {
-    gbp->buffer[i] = NULL;
+    profiler->dump = fopen (dump_path, "w");
+    if (profiler->dump != NULL)
+    {
+      fprintf (profiler->dump, "frame");
+      for (int i = 0; i < PHASE_COUNT; i++)
+        fprintf (profiler->dump, ",%s_ms", phase_names[i]);
+      fprintf (profiler->dump, ",frame_ms,inputs,latency_ms\n");
+    }
   }
 
-  return gbp;
+  return profiler;
 }
 
 void
-move_gap_page (GapBufferPage *gbp, int index, GAP_POSITION gap_pos)
+free_profiler (Profiler *profiler)
 {
-  assert (index >= 0);
-  assert (index < gbp->buf_size);
-
-  GapBuffer gb = { gbp->buffer, gbp->gap_start, gbp->gap_end, gbp->buf_size };
+  if (profiler->dump != NULL)
+    fclose (profiler->dump);
+  free (profiler);
+}
 
-  switch (gap_pos)
-  {
-  case GAP_START:
-    move_gap_start (&gb, index, sizeof (GapBufferLine *));
-    break;
-  case GAP_END:
-    move_gap_end (&gb, index, sizeof (GapBufferLine *));
-    break;
-  }
+// Ends the running phase and starts phase, PHASE_COUNT only ends it
+void
+profiler_phase (Profiler *profiler, int phase)
+{
+  double now = now_ms ();
+  if (profiler->phase < PHASE_COUNT)
+    profiler->phase_ms[profiler->phase] += now - profiler->phase_start;
 
-  gbp->gap_start = gb.gap_start;
-  gbp->gap_end = gb.gap_end;
+  profiler->phase = phase;
+  profiler->phase_start = now;
 }
 
 void
-expand_gap_page (GapBufferPage *gbp, int new_gap_size)
+profiler_frame_start (Profiler *profiler)
 {
-  GapBuffer gb = { gbp->buffer, gbp->gap_start, gbp->gap_end, gbp->buf_size };
-  expand_gap (&gb, new_gap_size, sizeof (GapBufferLine *));
-  gbp->buffer = gb.buffer;
-  gbp->buf_size = gb.buf_size;
-  gbp->gap_start = gb.gap_start;
-  gbp->gap_end = gb.gap_end;
+  for (int i = 0; i < PHASE_COUNT; i++)
+    profiler->phase_ms[i] = 0;
+  profiler->inputs = 0;
+  profiler->frame_start = now_ms ();
+  profiler_phase (profiler, PHASE_INPUT);
 }
 
-int
-insert_single_line (
-    GapBufferPage *gbp,
-    GapBufferLine *new_line,
-    int line_index,
-    DIRECTION dir)
+// Something this frame has to show: a key, a char or a click
+void
+profiler_input (Profiler *profiler)
 {
-  if (gbp->gap_end == gbp->gap_start)
-    expand_gap_page (gbp, GAP_SIZE);
+  profiler->inputs++;
+}
 
-  int index_new_line;
+void
+profiler_frame_end (Profiler *profiler)
+{
+  profiler_phase (profiler, PHASE_COUNT);
+  double frame_ms = now_ms () - profiler->frame_start;
 
-  assert (line_index < gbp->buf_size);
-  GapBufferLine *line = gbp->buffer[line_index];
+  int at = profiler->frames % PROFILE_FRAMES;
+  for (int i = 0; i < PHASE_COUNT; i++)
+    profiler->history[i][at] = profiler->phase_ms[i];
+  profiler->history[PHASE_COUNT][at] = frame_ms;
+  profiler->frames++;
 
-  if (dir == BEFORE)
+  // Every input waited the same, one sample each so busy frames weigh more
+  for (int i = 0; i < profiler->inputs; i++)
   {
-    if (line_index != gbp->gap_end + 1)
-    {
-      move_gap_page (gbp, line_index, GAP_END);
-    }
-    index_new_line = gbp->gap_start;
-    gbp->buffer[gbp->gap_start] = new_line;
-    gbp->gap_start++;
+    profiler->latency[profiler->latencies % PROFILE_LATENCIES] = frame_ms;
+    profiler->latencies++;
   }
-  else if (dir == AFTER)
+
+  if (profiler->dump != NULL)
   {
-    if (line_index != gbp->gap_start - 1)
-    {
-      move_gap_page (
-          gbp,
-          gbp->buf_size - 1 - (gbp->gap_end - gbp->gap_start),
-          GAP_START);
-    }
-    index_new_line = gbp->gap_start;
-    gbp->buffer[gbp->gap_start] = new_line;
-    gbp->gap_start++;
+    fprintf (profiler->dump, "%ld", profiler->frames);
+    for (int i = 0; i < PHASE_COUNT; i++)
+      fprintf (profiler->dump, ",%.3f", profiler->phase_ms[i]);
+    fprintf (
+        profiler->dump,
+        ",%.3f,%d,%.3f\n",
+        frame_ms,
+        profiler->inputs,
+        profiler->inputs > 0 ? frame_ms : 0);
   }
-  return index_new_line;
 }
 
-void
-insert_in_gap_page (GapBufferPage *gbp, char *buffer_ptr, int count)
+int
+compare_ms (const void *a, const void *b)
 {
-  GapBuffer gb = { gbp->buffer, gbp->gap_start, gbp->gap_end, gbp->buf_size };
-  insert_in_gap (&gb, buffer_ptr, count, sizeof (GapBufferLine *));
-  gbp->buffer = gb.buffer;
-  gbp->buf_size = gb.buf_size;
-  gbp->gap_start = gb.gap_start;
-  gbp->gap_end = gb.gap_end;
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
 }
 
+// p50 and p99 of the first count values of a ring
 void
-delete_single_line (GapBufferPage *gbp)
+ring_percentiles (double *ring, long count, int size, double *p50, double *p99)
 {
-  if (gbp->gap_start > 0)
+  double sorted[PROFILE_FRAMES > PROFILE_LATENCIES ? PROFILE_FRAMES
+                                                   : PROFILE_LATENCIES];
+  int n = count < size ? (int)count : size;
+  if (n == 0)
   {
-    gbp->gap_start--;
+    *p50 = 0;
+    *p99 = 0;
+    return;
   }
-};
-;
 
-// =============================================================================
-// === Render Functions
-// =============================================================================
-/*
-   [ lkjlkj___ljlkj ]
-*/
-int
-render_string_from_page (GapBufferPage *gbp, char *buffer, int size)
-{
-  int line_count = 0;
-  int pos = 0;
-  for (int line = 0; line < gbp->buf_size; line++)
-  {
-    if (line < gbp->gap_start || line > gbp->gap_end)
-    {
-      for (int ch = 0; ch < gbp->buffer[line]->buf_size; ch++)
-      {
-        GapBufferLine *l = gbp->buffer[line];
-        if (ch != l->buf_size - 1)
-        {
-          if (ch < l->gap_start || ch > l->gap_end)
-          {
-            buffer[pos] = l->buffer[ch];
-            pos++;
-          }
-        }
-        else
-        {
-          buffer[pos] = '\n';
-          pos++;
-          line_count++;
-        }
-      }
-    }
-  }
-  buffer[pos] = '\0';
-  return line_count;
+  memcpy (sorted, ring, n * sizeof (double));
+  qsort (sorted, n, sizeof (double), compare_ms);
+  *p50 = sorted[(int)(0.50 * (n - 1) + 0.5)];
+  *p99 = sorted[(int)(0.99 * (n - 1) + 0.5)];
 }
 
-typedef struct
+// The default font is not monospaced, every column gets its own x
+void
+draw_profiler_row (const char *name, double p50, double p99, int x, int y)
 {
-  Vector2 page_pos;
-  float width;
-  float height;
-} CursorProps;
+  Color color = strcmp (name, "latency") == 0 ? YELLOW : RAYWHITE;
+  DrawText (name, x, y, 10, color);
+  DrawText (TextFormat ("%.3f", p50), x + 70, y, 10, color);
+  DrawText (TextFormat ("%.3f", p99), x + 130, y, 10, color);
+}
 
-CursorProps
-render_cursor_pos_from_page (Cursor c, GapBufferPage page, Font font)
+void
+draw_profiler (Profiler *profiler, int x, int y)
 {
-  Vector2 pos = { 0 };
-  if (c.line < page.gap_start)
-  {
-    pos.y = c.line * (font.baseSize + 3);
-  }
-  else
-  {
-    pos.y
-        = (c.line - (page.gap_end - page.gap_start + 1)) * (font.baseSize + 3);
-  }
-  int last_size = 0;
-  for (int ch = 0; ch <= c.pos; ch++)
+  double p50;
+  double p99;
+  int line = 12;
+
+  DrawRectangle (
+      x - 5,
+      y - 5,
+      190,
+      (PHASE_COUNT + 3) * line + 10,
+      Fade (BLACK, 0.75f));
+  DrawText ("ms", x, y, 10, GRAY);
+  DrawText ("p50", x + 70, y, 10, GRAY);
+  DrawText ("p99", x + 130, y, 10, GRAY);
+
+  for (int i = 0; i <= PHASE_COUNT; i++)
   {
-    if ((ch < page.buffer[c.line]->gap_start
-         || ch > page.buffer[c.line]->gap_end))
-    {
-      int glyph = page.buffer[c.line]->buffer[ch];
-      int glyph_index = glyph - 32;
-      pos.x += last_size;
-      last_size = font.glyphs[glyph_index].advanceX + 2;
-    }
+    ring_percentiles (
+        profiler->history[i],
+        profiler->frames,
+        PROFILE_FRAMES,
+        &p50,
+        &p99);
+    draw_profiler_row (
+        i < PHASE_COUNT ? phase_names[i] : "frame",
+        p50,
+        p99,
+        x,
+        y + (i + 1) * line);
   }
 
-  CursorProps result;
+  ring_percentiles (
+      profiler->latency,
+      profiler->latencies,
+      PROFILE_LATENCIES,
+      &p50,
+      &p99);
+  draw_profiler_row ("latency", p50, p99, x, y + (PHASE_COUNT + 2) * line);
+}
 
-  result.page_pos = pos;
-  result.width = (float)last_size;
-  result.height = (float)font.baseSize;
+// =============================================================================
+// === Input
+// =============================================================================
 
-  return result;
+EditorKey
+editor_key_from_raylib (int key)
+{
+  int control = IsKeyDown (KEY_LEFT_CONTROL) || IsKeyDown (KEY_RIGHT_CONTROL);
+  int shift = IsKeyDown (KEY_LEFT_SHIFT) || IsKeyDown (KEY_RIGHT_SHIFT);
+
+  switch (key)
+  {
+  case KEY_UP:
+    return shift ? EDITOR_KEY_SELECT_UP : EDITOR_KEY_UP;
+  case KEY_DOWN:
+    return shift ? EDITOR_KEY_SELECT_DOWN : EDITOR_KEY_DOWN;
+  case KEY_LEFT:
+    return shift ? EDITOR_KEY_SELECT_LEFT : EDITOR_KEY_LEFT;
+  case KEY_RIGHT:
+    return shift ? EDITOR_KEY_SELECT_RIGHT : EDITOR_KEY_RIGHT;
+  case KEY_ESCAPE:
+    return EDITOR_KEY_ESCAPE;
+  case KEY_PAGE_UP:
+    return EDITOR_KEY_PAGE_UP;
+  case KEY_PAGE_DOWN:
+    return EDITOR_KEY_PAGE_DOWN;
+  case KEY_BACKSPACE:
+    return EDITOR_KEY_BACKSPACE;
+  case KEY_ENTER:
+    return EDITOR_KEY_ENTER;
+  case KEY_S:
+    return control ? EDITOR_KEY_SAVE : EDITOR_KEY_NONE;
+  default:
+    return EDITOR_KEY_NONE;
+  }
 }
 
 // =============================================================================
@@ -782,7 +1232,7 @@ render_cursor_pos_from_page (Cursor c, GapBufferPage page, Font font)
 // =============================================================================
 
 int
-main (void)
+main (int argc, char **argv)
 {
 
   // === Initialization
@@ -792,38 +1242,107 @@ main (void)
   const int screen_width = 400;
   const int screen_height = 400;
 
+  // Long lines wrap at the width of the window, see Wrap
+  SetConfigFlags (FLAG_WINDOW_RESIZABLE);
   InitWindow (screen_width, screen_height, "NeoNote");
 
   SetTargetFPS (60);
 
+  // Escape goes back to the one cursor, it does not close the window
+  SetExitKey (KEY_NULL);
+
   // Raylib -- fonts
   // TODO: Add multiple fonts and find out how to handle dynamic line spacing
-  Font font_ttf = LoadFontEx ("fonts/jpos_sans_serif_regular.ttf", 13, 0, 94);
+  Glyphs *glyphs = init_glyphs (FONT_PATH, FONT_SIZE);
   SetTextLineSpacing (16);
 
-  // Page Buffer
-
-  int page_gap_start = 0;
-  int line_gap_start = 0;
+  // ./main [--record trace] [--profile file] [file]
+  const char *open_path = NULL;
+  const char *trace_path = NULL;
+  const char *profile_path = NULL;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp (argv[i], "--record") == 0 && i + 1 < argc)
+    {
+      trace_path = argv[i + 1];
+      i++;
+    }
+    else if (strcmp (argv[i], "--profile") == 0 && i + 1 < argc)
+    {
+      profile_path = argv[i + 1];
+      i++;
+    }
+    else
+    {
+      open_path = argv[i];
+    }
+  }
 
-  GapBufferLine *current_line = init_gap_buffer_line (INIT_SIZE_LINE, GAP_SIZE);
-  for (int i = 0; i < current_line->buf_size; i++)
+  // Page Buffer
+  const char *file_path = open_path != NULL ? open_path : DEFAULT_NOTE_PATH;
+  Page *loaded = NULL;
+  if (open_path != NULL)
   {
-    current_line->buffer[i] = 'A';
+    loaded = load_page (open_path);
+    if (loaded == NULL)
+      fprintf (stderr, "Could not open %s\n", open_path);
+    else if (loaded->map->valid_size < loaded->map->size)
+      fprintf (
+          stderr,
+          "%s is not valid UTF-8 from byte %zu on, it is kept as it is\n",
+          open_path,
+          loaded->map->valid_size);
   }
 
-  GapBufferPage *page = init_gap_buffer_page (INIT_SIZE_PAGE, GAP_SIZE);
+  Editor *editor = init_editor (loaded, file_path);
+  Page *page = editor->page;
+  Cursor *cursor = editor->cursor;
+
+  Autosave *autosave = start_autosave (file_path);
 
-  page->buffer[page->gap_end + 1] = current_line;
+  // Input of the session for build/replay, see Trace
+  Trace *trace = NULL;
+  if (trace_path != NULL)
+  {
+    trace = start_trace (trace_path);
+    if (trace == NULL)
+      fprintf (stderr, "Could not record to %s\n", trace_path);
+  }
 
-  // Init Cursor
-  assert (page->gap_end + 1 < page->buf_size);
-  assert (current_line->gap_end + 1 < current_line->buf_size);
-  Cursor *cursor = init_cursor (page->gap_end + 1, current_line->gap_end + 1);
+  // Where the time of a frame goes, F3 shows it
+  Profiler *profiler = init_profiler (profile_path);
+  if (profile_path != NULL && profiler->dump == NULL)
+    fprintf (stderr, "Could not write %s\n", profile_path);
+
+  FindBar find = { 0 };
+
+  // Text is drawn through the render cache, padding on every side
+  Vector2 padding = { 20.0f, 20.0f };
+  RenderCache *render_cache = init_render_cache (
+      screen_width - 2 * padding.x,
+      screen_height - 2 * padding.y,
+      glyphs->font.baseSize + 3);
+  Viewport *view = init_viewport (
+      screen_height - 2 * padding.y,
+      glyphs->font.baseSize + 3);
+  int follow_row = -1;
+  editor->page_rows = view->rows;
+
+  // Lines wrap at the width of the text area, measured with the font
+  Wrap *wrap = init_wrap (render_cache->width);
+  set_wrap_font (wrap, glyphs);
+  page_set_wrap (page, wrap);
+
+  // Markdown is highlighted from the state the line above ends in
+  Highlight *highlight = init_highlight ();
+  page_set_highlight (page, highlight);
 
   // Debug
   char debugTextBuffer[8192] = { 0 };
-  char textBuffer[1024] = { 0 };
+  Cursor debug_cursor = { -1, -1 };
+  MemoryStats memory;
+  long render_bytes = 0;
+  long texture_bytes = 0;
   double last_time = GetTime ();
   double curr_time;
 
@@ -832,247 +1351,179 @@ main (void)
   while (!WindowShouldClose ())
   {
     curr_time = GetTime ();
-    // Upadate
-    current_line = page->buffer[cursor->line];
-    int _char = GetCharPressed ();
-    int key = GetKeyPressed ();
+    double frame_start = now_ms ();
+    profiler_frame_start (profiler);
+    // A new size gets a new render cache, the lines are wrapped again as
+    // they show up and in the background
+    if (IsWindowResized ())
+    {
+      int width = GetScreenWidth () - 2 * padding.x;
+      int height = GetScreenHeight () - 2 * padding.y;
+      free_render_cache (render_cache);
+      render_cache = init_render_cache (width, height, view->row_height);
+      resize_viewport (view, height);
+      editor->page_rows = view->rows;
+      page_rewrap (page, render_cache->width);
+      follow_row = -1;
+    }
 
-    while (_char > 0)
+    // Upadate
+    int control = IsKeyDown (KEY_LEFT_CONTROL) || IsKeyDown (KEY_RIGHT_CONTROL);
+    if (IsMouseButtonPressed (MOUSE_BUTTON_LEFT))
     {
-      if ((_char >= 32) && (_char <= 125))
+      // The row of the cache under the mouse, it was drawn for this view
+      Vector2 mouse = GetMousePosition ();
+      float y = mouse.y - padding.y + view->y;
+      int index = y >= 0 ? (int)(y / view->row_height) - render_cache->first_row
+                         : -1;
+      RenderRow *cached = index >= 0 && index < render_cache->row_count
+                              ? &render_cache->rows[index]
+                              : NULL;
+
+      if (cached != NULL && cached->drawn && cached->row >= 0)
       {
-        if (cursor->pos == current_line->gap_end + 1)
-        {
-          /* NOTE: Do this because gap could be expanded, messing up the cursor
-             position. Maybe handle this automaticly inside insert_single_char?
-          */
-          insert_single_char (current_line, _char, GAP_START);
-          cursor->pos = current_line->gap_end + 1;
-        }
-        else if (cursor->pos < current_line->gap_start)
-        {
-          move_gap_line (current_line, cursor->pos, GAP_START);
-          insert_single_char (current_line, _char, GAP_START);
-          /* NOTE: Do this because gap could be expanded, messing up the cursor
-             position. Maybe handle this automaticly inside insert_single_char?
-          */
-          cursor->pos = current_line->gap_end + 1;
-        }
+        int row = cached->row;
+        int slot = page_row_to_slot (page, row);
+        int column = render_column_at (cached, mouse.x - padding.x);
+
+        // Ctrl+click adds a cursor, a plain click leaves just the one
+        profiler_phase (profiler, PHASE_EDIT);
+        if (control)
+          editor_add_cursor (editor, row, column);
         else
-        {
-          move_gap_line (current_line, cursor->pos - 1, GAP_END);
-          insert_single_char (current_line, _char, GAP_START);
-          /* NOTE: Do this because gap could be expanded, messing up the cursor
-             position. Maybe handle this automaticly inside insert_single_char?
-          */
-          cursor->pos = current_line->gap_end + 1;
-        }
+          editor_move_cursor (editor, slot, column);
+        profiler_phase (profiler, PHASE_INPUT);
+        profiler_input (profiler);
+        if (trace != NULL)
+          trace_event (
+              trace,
+              control ? TRACE_ADD_CURSOR : TRACE_CLICK,
+              row,
+              column);
       }
-
-      _char = GetCharPressed ();
     }
-    while (key > 0)
+    int _char = GetCharPressed ();
+    int key = GetKeyPressed ();
+
+    // Everything typed this frame goes in as one run of UTF-8, or into the
+    // query of the find bar
+    char typed[64];
+    int typed_count = 0;
+    while (_char > 0)
     {
-      if (key == KEY_UP)
+      if (find.open)
       {
-        if (move_cursor_previous_line (cursor, page) == 0)
-        {
-          int last_pos = cursor->pos;
-          int new_pos = last_pos;
-
-          if (last_pos > current_line->gap_end)
-            new_pos = last_pos
-                      - (current_line->gap_end - current_line->gap_start + 1);
-
-          current_line = page->buffer[cursor->line];
-
-          if (new_pos >= current_line->gap_start)
-            new_pos = new_pos
-                      + (current_line->gap_end - current_line->gap_start + 1);
-
-          move_cursor (cursor, page, new_pos);
-        }
+        profiler_phase (profiler, PHASE_EDIT);
+        find_type (&find, editor, _char);
+        profiler_phase (profiler, PHASE_INPUT);
+        profiler_input (profiler);
+        if (trace != NULL)
+          trace_find (trace, editor);
       }
-
-      if (key == KEY_DOWN)
+      else if (typed_count + UTF8_MAX_SIZE <= (int)sizeof (typed))
       {
-        if (move_cursor_next_line (cursor, page) == 0)
-        {
-          int last_pos = cursor->pos;
-          int new_pos = last_pos;
-
-          if (last_pos > current_line->gap_end)
-            new_pos = last_pos
-                      - (current_line->gap_end - current_line->gap_start + 1);
-
-          current_line = page->buffer[cursor->line];
-
-          if (new_pos >= current_line->gap_start)
-            new_pos = new_pos
-                      + (current_line->gap_end - current_line->gap_start + 1);
-
-          move_cursor (cursor, page, new_pos);
-          // NEXT
-        }
+        typed_count += utf8_encode (_char, typed + typed_count);
+        profiler_input (profiler);
+        if (trace != NULL)
+          trace_event (trace, TRACE_CHAR, _char, 0);
       }
+      _char = GetCharPressed ();
+    }
+    profiler_phase (profiler, PHASE_EDIT);
+    editor_insert_text (editor, typed, typed_count);
+    profiler_phase (profiler, PHASE_INPUT);
 
-      if (key == KEY_RIGHT)
-      {
-        if (move_cursor (cursor, page, cursor->pos + 1) == OUTSIDE_RIGHT)
-        {
-          if (move_cursor_next_line (cursor, page) == 0)
-          {
-            current_line = page->buffer[cursor->line];
-            move_cursor (cursor, page, 0);
-          }
-        }
-      }
+    while (key > 0)
+    {
+      if (key == PROFILE_HUD_KEY)
+        profiler->show = !profiler->show;
 
-      if (key == KEY_LEFT)
+      profiler_phase (profiler, PHASE_EDIT);
+      int found = find_key (&find, editor, key, control);
+      profiler_phase (profiler, PHASE_INPUT);
+      if (found)
       {
-        PositionInGapArray state = move_cursor (cursor, page, cursor->pos - 1);
-        if (state == OUTSIDE_LEFT || state == INSIDE_GAP_START)
-        {
-          if (move_cursor_previous_line (cursor, page) == 0)
-          {
-            current_line = page->buffer[cursor->line];
-            move_cursor (cursor, page, current_line->buf_size - 1);
-          }
-        }
+        profiler_input (profiler);
+        if (trace != NULL)
+          trace_find (trace, editor);
+        key = GetKeyPressed ();
+        continue;
       }
 
-      if (key == KEY_BACKSPACE)
+      EditorKey editor_key = editor_key_from_raylib (key);
+      if (editor_key != EDITOR_KEY_NONE)
       {
-        if (cursor->pos != 0
-            && (current_line->gap_start != 0
-                || cursor->pos != current_line->gap_end + 1))
-        {
-          if (cursor->pos == current_line->gap_end + 1)
-          {
-            delete_single_char (current_line, GAP_START);
-          }
-          else if (cursor->pos < current_line->gap_start)
-          {
-            move_gap_line (current_line, cursor->pos - 1, GAP_START);
-            delete_single_char (current_line, GAP_END);
-            move_cursor (cursor, page, current_line->gap_end + 1);
-          }
-          else if (cursor->pos > current_line->gap_end)
-          {
-            move_gap_line (current_line, cursor->pos - 1, GAP_END);
-            delete_single_char (current_line, GAP_START);
-            move_cursor (cursor, page, current_line->gap_end + 1);
-          }
-        }
-        else if (cursor->line != 0)
-        {
-          GapBufferLine *previous_line = page->buffer[cursor->line - 1];
-
-          if (current_line->gap_start == 0
-              && current_line->gap_end == current_line->buf_size - 2)
-          {
-            // delete current_line
-            cursor->pos = previous_line->buf_size - 1;
-            move_gap_page (page, cursor->line + 1, GAP_START);
-            delete_single_line (page);
-            cursor->line--;
-          }
-          else
-          {
-            move_gap_line (previous_line, previous_line->buf_size - 2, GAP_END);
-            cursor->pos = previous_line->gap_start;
-
-            // copy current_line to end of privious line
-            for (int i = 0; i < current_line->buf_size - 1; i++)
-            {
-              if (i < current_line->gap_start || i > current_line->gap_end)
-                insert_single_char (
-                    previous_line,
-                    current_line->buffer[i],
-                    GAP_START);
-            }
-            // delete current_line
-            move_gap_page (page, cursor->line + 1, GAP_START);
-            delete_single_line (page);
-            cursor->line--;
-          }
-        }
+        profiler_input (profiler);
+        if (trace != NULL)
+          trace_event (trace, TRACE_KEY, editor_key, 0);
       }
 
-      if (key == KEY_ENTER)
-      {
-        GapBufferLine *new_line
-            = init_gap_buffer_line (INIT_SIZE_LINE, GAP_SIZE);
-
-        // NOTE: Only for debug print
-        for (int i = 0; i < new_line->buf_size; i++)
-        {
-          new_line->buffer[i] = 'A';
-        }
-
-        // Cursor on start of the line
-        if (cursor->pos == 0)
-        {
-          int index_new_line
-              = insert_single_line (page, new_line, cursor->line, BEFORE);
-          cursor->line = index_new_line;
-          cursor->pos = new_line->gap_end + 1;
-        }
-        // Cursor at end of the line
-        // (this works because the line should always have padding on the end)
-        else if (cursor->pos == current_line->buf_size - 1)
-        {
-          int index_new_line
-              = insert_single_line (page, new_line, cursor->line, AFTER);
-          cursor->line = index_new_line;
-          cursor->pos = new_line->gap_end + 1;
-        }
-        // Cursor in the middle of the line
-        else
-        {
-          move_gap_line (new_line, 0, GAP_START);
-          for (int i = cursor->pos; i < current_line->buf_size - 2; i++)
-          {
-            // TODO: Make a functon to insert more than one char
-            //       Maybe copy hole memory area?
-            if (i < current_line->gap_start || i > current_line->gap_end)
-              insert_single_char (new_line, current_line->buffer[i], GAP_START);
-          }
-          current_line->gap_start = cursor->pos;
-          current_line->gap_end = current_line->buf_size - 2;
-
-          move_gap_page (page, cursor->line + 1, GAP_START);
-          int index_new_line
-              = insert_single_line (page, new_line, page->gap_start, AFTER);
-          cursor->line = index_new_line;
-          cursor->pos = 0;
-        }
-        current_line = page->buffer[cursor->line];
-      }
+      profiler_phase (profiler, PHASE_EDIT);
+      if (editor_apply_key (editor, editor_key) != 0)
+        fprintf (stderr, "Could not save %s\n", file_path);
+      profiler_phase (profiler, PHASE_INPUT);
 
       key = GetKeyPressed ();
     }
+    autosave->edits += editor->edits;
+    editor->edits = 0;
+    GapBufferLine *current_line = page_line (page, cursor->line);
+
+    // The view follows the row the cursor is in, but only when it moved so
+    // the wheel can still scroll it out of sight
+    const int *breaks;
+    int break_count = page_line_breaks (page, cursor->line, &breaks);
+    int cursor_row = page_slot_top (page, cursor->line)
+                     + line_wrap_row (
+                         breaks,
+                         break_count,
+                         line_column (current_line, cursor->pos));
+    if (cursor_row != follow_row)
+    {
+      viewport_follow_row (view, cursor_row);
+      follow_row = cursor_row;
+    }
+    scroll_viewport (view, -GetMouseWheelMove () * VIEW_WHEEL_ROWS);
+    update_viewport (view, page_height (page), GetFrameTime ());
+
+    // Bring the text texture up to date before the frame starts
+    profiler_phase (profiler, PHASE_RENDER);
+    // Lines whose state changed are damaged before the cache looks
+    page_highlight_some (page, HIGHLIGHT_BUDGET_MS);
+    int page_changed = page->damage.all || page->damage.count > 0;
+    int line_count = render_page_cached (
+        render_cache,
+        page,
+        glyphs,
+        viewport_first_row (view));
 
     // Draw
     BeginDrawing ();
 
     ClearBackground (RAYWHITE);
 
-    int line_count = render_string_from_page (page, textBuffer, 1024);
+    profiler_phase (profiler, PHASE_CURSOR);
     CursorProps cursor_pos
-        = render_cursor_pos_from_page (*cursor, *page, font_ttf);
+        = render_cursor_pos_from_page (render_cache, *cursor, page, glyphs);
     // TODO: Check if I can simply add two Vector2's
-    Vector2 padding = { 20.0f, 20.0f };
     cursor_pos.page_pos.x = cursor_pos.page_pos.x + padding.x;
-    cursor_pos.page_pos.y = cursor_pos.page_pos.y + padding.y;
-
-    DrawTextEx (
-        font_ttf,
-        textBuffer,
-        padding,
-        (float)font_ttf.baseSize,
-        2,
-        MAROON);
+    cursor_pos.page_pos.y = cursor_pos.page_pos.y + padding.y - view->y;
+    profiler_phase (profiler, PHASE_DRAW);
+
+    // Rows scrolled halfway out are cut at the edge of the text area
+    BeginScissorMode (padding.x, padding.y, render_cache->width, view->height);
+    draw_render_cache (
+        render_cache,
+        (Vector2){ padding.x, padding.y - viewport_offset (view) });
+    if (find.open)
+      draw_search_matches (
+          render_cache,
+          &editor->search,
+          (Vector2){ padding.x, padding.y - viewport_offset (view) });
+    draw_selections (
+        render_cache,
+        editor,
+        (Vector2){ padding.x, padding.y - viewport_offset (view) });
 
     if (curr_time - last_time > 0.5f)
     {
@@ -1083,22 +1534,47 @@ main (void)
       if (curr_time - last_time > 1.0f)
         last_time = curr_time;
     }
+    EndScissorMode ();
 
-    render_page_debug (page, debugTextBuffer, 8192, *cursor);
-    int debug_offset = line_count * font_ttf.baseSize + 20;
-    DrawText (debugTextBuffer, 10, debug_offset + 90, 10, DARKGRAY);
+    // Only rebuilt when there is something new to show
+    if (page_changed || cursor->line != debug_cursor.line
+        || cursor->pos != debug_cursor.pos)
+    {
+      render_page_debug (page, debugTextBuffer, 8192, *cursor);
+      debug_cursor = *cursor;
+      editor_memory (editor, &memory);
+      render_bytes = render_cache_memory (render_cache, &texture_bytes);
+    }
+    int debug_offset = line_count * glyphs->font.baseSize + 20;
+    DrawText (debugTextBuffer, 10, debug_offset + 170, 10, DARKGRAY);
     DrawText (
-        TextFormat ("pos: %d", cursor->pos),
+        TextFormat (
+            "pos: %d, byte %ld of %ld",
+            cursor->pos,
+            page_slot_offset (page, cursor->line)
+                + line_column (current_line, cursor->pos),
+            page_byte_count (page)),
         10,
         debug_offset + 10,
         10,
         DARKGRAY);
     DrawText (
-        TextFormat ("line: %d", cursor->line),
+        TextFormat (
+            "line: %d, rows drawn: %d",
+            cursor->line,
+            render_cache->rows_drawn),
         10,
         debug_offset + 20,
         10,
         DARKGRAY);
+#ifdef NEO_NOTE_ROPE
+    DrawText (
+        TextFormat ("page lines: %d", page_line_count (page)),
+        10,
+        debug_offset + 30,
+        10,
+        DARKGRAY);
+#else
     DrawText (
         TextFormat ("page->gap_start: %d", page->gap_start),
         10,
@@ -1112,11 +1588,12 @@ main (void)
         10,
         DARKGRAY);
     DrawText (
-        TextFormat ("page->buf_size: %d", current_line->buf_size),
+        TextFormat ("page->buf_size: %d", page->buf_size),
         10,
         debug_offset + 50,
         10,
         DARKGRAY);
+#endif
     DrawText (
         TextFormat ("current_line->gap_start: %d", current_line->gap_start),
         10,
@@ -1135,12 +1612,130 @@ main (void)
         debug_offset + 80,
         10,
         DARKGRAY);
+    DrawText (
+        TextFormat (
+            "line_capacity: %ld grows, %ld bytes copied",
+            line_capacity.grows,
+            line_capacity.bytes_copied),
+        10,
+        debug_offset + 90,
+        10,
+        DARKGRAY);
+    DrawText (
+        TextFormat (
+            "page_capacity: %ld grows, %ld bytes copied",
+            page_capacity.grows,
+            page_capacity.bytes_copied),
+        10,
+        debug_offset + 100,
+        10,
+        DARKGRAY);
+    DrawText (
+        TextFormat (
+            "autosave: %ld saves, %.0f ms, snapshot %.3f ms (max %.3f)",
+            autosave->saves,
+            autosave->save_ms,
+            autosave->snapshot_ms,
+            autosave->snapshot_ms_max),
+        10,
+        debug_offset + 110,
+        10,
+        DARKGRAY);
+    DrawText (
+        TextFormat (
+            "autosave: %ld bytes copied, worst frame %.2f ms saving, "
+            "%.2f ms idle",
+            autosave->copied_bytes,
+            autosave->frame_ms_max_saving,
+            autosave->frame_ms_max_idle),
+        10,
+        debug_offset + 120,
+        10,
+        DARKGRAY);
+    DrawText (
+        TextFormat (
+            "memory: %ld KB live, %ld KB peak, %ld KB malloc, %ld allocs",
+            memory.live_bytes / 1024,
+            memory.peak_bytes / 1024,
+            memory.system_bytes / 1024,
+            memory.allocs - memory.frees),
+        10,
+        debug_offset + 130,
+        10,
+        DARKGRAY);
+    DrawText (
+        TextFormat (
+            "text %ld KB, gap %ld KB line + %ld KB page, mapped %ld KB",
+            memory.text_bytes / 1024,
+            memory.gap_bytes / 1024,
+            memory.page_gap_bytes / 1024,
+            memory.mapped_bytes / 1024),
+        10,
+        debug_offset + 140,
+        10,
+        DARKGRAY);
+    DrawText (
+        TextFormat (
+            "render: %ld KB, texture %ld KB, wrap %ld KB, highlight %ld KB",
+            render_bytes / 1024,
+            texture_bytes / 1024,
+            memory.wrap_bytes / 1024,
+            memory.highlight_bytes / 1024),
+        10,
+        debug_offset + 150,
+        10,
+        DARKGRAY);
+    DrawText (
+        TextFormat (
+            "compaction: %ld passes, %ld lines, %ld KB, worst %.2f ms",
+            editor->compaction.passes,
+            editor->compaction.lines_trimmed,
+            editor->compaction.bytes_trimmed / 1024,
+            editor->compaction.frame_ms_max),
+        10,
+        debug_offset + 160,
+        10,
+        DARKGRAY);
+
+    if (profiler->show)
+      draw_profiler (profiler, GetScreenWidth () - 190, 10);
+    if (find.open)
+      draw_find_bar (
+          &find,
+          editor,
+          padding.x,
+          GetScreenHeight () - padding.y + 5);
+
+    // Autosave and trimming get what is left of the frame
+    profiler_phase (profiler, PHASE_IDLE);
+    // Chars the font had no glyph for are drawn right from the next frame on
+    if (glyphs->missing > 0)
+    {
+      reload_glyphs (glyphs);
+      set_wrap_font (wrap, glyphs);
+      page_rewrap (page, wrap->width);
+    }
+    autosave_frame (autosave, page, now_ms () - frame_start);
+    editor_compact (editor, COMPACT_BUDGET_MS);
+    page_wrap_some (page, WRAP_BUDGET_MS);
 
+    profiler_phase (profiler, PHASE_PRESENT);
     EndDrawing ();
+    profiler_frame_end (profiler);
   }
 
   // === De-Initialization
   // ===========================================================================
+  if (trace != NULL)
+    stop_trace (trace);
+  stop_autosave (autosave, page);
+  free_profiler (profiler);
+  free_render_cache (render_cache);
+  free_glyphs (glyphs);
+  free (view);
+  free_editor (editor);
+  free_wrap (wrap);
+  free_highlight (highlight);
   CloseWindow ();
   return 0;
 }
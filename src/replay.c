@@ -0,0 +1,317 @@
+#include "core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Replays a trace without a window, as fast as the editor takes it, and tells
+// how long every event took.
+//
+//   ./build/replay trace [file]          on file, or on a new note
+//   ./build/replay --generate kind trace writes one of the stock traces
+//
+// Traces come from ./build/main --record trace, or --generate with one of
+//   typing     a paragraph typed over and over
+//   backspace  10k lines typed and then held backspace over all of them
+//   paste      one long pasted line split into pieces from its end
+//   unicode    mixed scripts typed, walked over and backspaced
+//   rename     a name selected at 10k cursors, as the find bar does, and a
+//              new one typed over all of them
+
+#define PASTE_SIZE 100000
+#define PASTE_PIECE 100
+#define BACKSPACE_LINES 10000
+#define RENAME_LINES 10000
+
+typedef struct
+{
+  double *ms;
+  int count;
+  int capacity;
+} Latencies;
+
+void
+push_latency (Latencies *latencies, double ms)
+{
+  if (latencies->count == latencies->capacity)
+  {
+    latencies->capacity = latencies->capacity * 2 + 1024;
+    latencies->ms
+        = realloc (latencies->ms, latencies->capacity * sizeof (double));
+  }
+  latencies->ms[latencies->count] = ms;
+  latencies->count++;
+}
+
+int
+compare_ms (const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Needs the latencies sorted
+double
+percentile (Latencies *latencies, double percent)
+{
+  if (latencies->count == 0)
+    return 0;
+
+  int index = (int)(percent / 100.0 * (latencies->count - 1) + 0.5);
+  return latencies->ms[index];
+}
+
+// =============================================================================
+// === Generate
+// =============================================================================
+
+// One event per codepoint of the UTF-8 in text
+void
+trace_text (Trace *trace, const char *text)
+{
+  int size = strlen (text);
+  int i = 0;
+  while (i < size)
+  {
+    int codepoint;
+    int length = utf8_decode (text + i, size - i, &codepoint);
+    if (codepoint == '\n')
+      trace_event (trace, TRACE_KEY, EDITOR_KEY_ENTER, 0);
+    else
+      trace_event (trace, TRACE_CHAR, codepoint, 0);
+    i += length;
+  }
+}
+
+void
+trace_repeat_key (Trace *trace, EditorKey key, int count)
+{
+  for (int i = 0; i < count; i++)
+    trace_event (trace, TRACE_KEY, key, 0);
+}
+
+void
+generate_typing (Trace *trace)
+{
+  for (int i = 0; i < 50; i++)
+  {
+    trace_text (
+        trace,
+        "The quick brown fox jumps over the lazy dog, then it does it "
+        "again.\nTyping a paragraph is mostly inserts at the gap, with the "
+        "odd typo\n");
+    trace_repeat_key (trace, EDITOR_KEY_BACKSPACE, 4);
+    trace_text (trace, "typo.\n\n");
+  }
+}
+
+void
+generate_backspace (Trace *trace)
+{
+  char line[32];
+  long typed = 0;
+  for (int i = 0; i < BACKSPACE_LINES; i++)
+  {
+    int length = snprintf (line, sizeof (line), "line %d\n", i);
+    trace_text (trace, line);
+    typed += length;
+  }
+  trace_repeat_key (trace, EDITOR_KEY_BACKSPACE, typed);
+}
+
+void
+generate_paste (Trace *trace)
+{
+  for (int i = 0; i < PASTE_SIZE; i++)
+    trace_event (trace, TRACE_CHAR, 'a' + i % 26, 0);
+
+  // After an Enter the cursor is at the start of the tail, one more Left gets
+  // it back onto the long line
+  for (int i = 0; i < PASTE_SIZE / PASTE_PIECE - 1; i++)
+  {
+    int left = i == 0 ? PASTE_PIECE : PASTE_PIECE + 1;
+    trace_repeat_key (trace, EDITOR_KEY_LEFT, left);
+    trace_event (trace, TRACE_KEY, EDITOR_KEY_ENTER, 0);
+  }
+}
+
+void
+generate_unicode (Trace *trace)
+{
+  for (int i = 0; i < 50; i++)
+  {
+    trace_text (
+        trace,
+        "Zoë and José met Øystein in Kraków, 東京で 🍣 を食べた\n");
+    trace_repeat_key (trace, EDITOR_KEY_UP, 1);
+    trace_repeat_key (trace, EDITOR_KEY_RIGHT, 30);
+    trace_repeat_key (trace, EDITOR_KEY_BACKSPACE, 3);
+    trace_text (trace, "é€😀");
+    trace_repeat_key (trace, EDITOR_KEY_DOWN, 1);
+  }
+}
+
+void
+generate_rename (Trace *trace)
+{
+  char line[64];
+  for (int i = 0; i < RENAME_LINES; i++)
+  {
+    snprintf (line, sizeof (line), "row %d: count = count + %d;\n", i, i);
+    trace_text (trace, line);
+  }
+
+  // What Ctrl+Enter in the find bar records for the first count of each row,
+  // then every char of the new name is one batch over all the cursors
+  for (int i = 0; i < RENAME_LINES; i++)
+  {
+    int column = snprintf (line, sizeof (line), "row %d: ", i);
+    trace_event (trace, i == 0 ? TRACE_CLICK : TRACE_ADD_CURSOR, i, column);
+    trace_event (trace, TRACE_SELECT, i, column + 5);
+  }
+  trace_text (trace, "total");
+}
+
+int
+generate (const char *kind, const char *path)
+{
+  void (*generator) (Trace *) = NULL;
+  if (strcmp (kind, "typing") == 0)
+    generator = generate_typing;
+  else if (strcmp (kind, "backspace") == 0)
+    generator = generate_backspace;
+  else if (strcmp (kind, "paste") == 0)
+    generator = generate_paste;
+  else if (strcmp (kind, "unicode") == 0)
+    generator = generate_unicode;
+  else if (strcmp (kind, "rename") == 0)
+    generator = generate_rename;
+
+  if (generator == NULL)
+  {
+    fprintf (stderr, "Unknown trace %s\n", kind);
+    return 1;
+  }
+
+  Trace *trace = start_trace (path);
+  if (trace == NULL)
+  {
+    fprintf (stderr, "Could not write %s\n", path);
+    return 1;
+  }
+  generator (trace);
+  printf ("%s: %ld events\n", path, trace->events);
+  stop_trace (trace);
+
+  return 0;
+}
+
+// =============================================================================
+// === main
+// =============================================================================
+
+int
+main (int argc, char **argv)
+{
+  if (argc == 4 && strcmp (argv[1], "--generate") == 0)
+    return generate (argv[2], argv[3]);
+
+  if (argc < 2 || argc > 3)
+  {
+    fprintf (stderr, "usage: %s trace [file]\n", argv[0]);
+    fprintf (stderr, "       %s --generate kind trace\n", argv[0]);
+    return 1;
+  }
+
+  FILE *file = open_trace (argv[1]);
+  if (file == NULL)
+  {
+    fprintf (stderr, "%s is not a trace\n", argv[1]);
+    return 1;
+  }
+
+  Page *page = NULL;
+  if (argc == 3)
+  {
+    page = load_page (argv[2]);
+    if (page == NULL)
+    {
+      fprintf (stderr, "Could not open %s\n", argv[2]);
+      return 1;
+    }
+  }
+  Editor *editor = init_editor (page, argc == 3 ? argv[2] : "note.md");
+
+  Latencies latencies = { 0 };
+  double recorded_ms = 0;
+  TraceEvent event;
+
+  double start = now_ms ();
+  while (read_trace_event (file, &event))
+  {
+    double event_start = now_ms ();
+    apply_trace_event (editor, &event);
+    push_latency (&latencies, now_ms () - event_start);
+    recorded_ms += event.delta_ms;
+  }
+  double total_ms = now_ms () - start;
+  fclose (file);
+
+  qsort (latencies.ms, latencies.count, sizeof (double), compare_ms);
+
+  printf (
+      "%d events in %.1f ms, %.0f events/s, recorded over %.1f s\n",
+      latencies.count,
+      total_ms,
+      total_ms > 0 ? latencies.count / (total_ms / 1000.0) : 0,
+      recorded_ms / 1000.0);
+  printf (
+      "latency us: p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+      percentile (&latencies, 50) * 1000.0,
+      percentile (&latencies, 90) * 1000.0,
+      percentile (&latencies, 99) * 1000.0,
+      percentile (&latencies, 99.9) * 1000.0,
+      percentile (&latencies, 100) * 1000.0);
+  printf (
+      "%d lines, %ld bytes\n",
+      page_line_count (editor->page),
+      page_byte_count (editor->page));
+
+  MemoryStats memory;
+  editor_memory (editor, &memory);
+  printf (
+      "memory: %ld live, %ld peak, %ld from malloc, %ld allocs, %ld frees\n",
+      memory.live_bytes,
+      memory.peak_bytes,
+      memory.system_bytes,
+      memory.allocs,
+      memory.frees);
+  printf (
+      "        %ld text, %ld gap in lines, %ld gap in the page, "
+      "%ld lines, %ld page\n",
+      memory.text_bytes,
+      memory.gap_bytes,
+      memory.page_gap_bytes,
+      memory.line_bytes,
+      memory.page_bytes);
+
+  // What the idle compaction would give back, all of it in one go
+  double compact_start = now_ms ();
+  while (!compact_page (
+      editor->page,
+      &editor->compaction,
+      editor->cursor,
+      COMPACT_BUDGET_MS))
+    ;
+  double compact_ms = now_ms () - compact_start;
+  printf (
+      "compacted: %ld bytes trimmed from %ld lines in %.1f ms, %ld live\n",
+      editor->compaction.bytes_trimmed,
+      editor->compaction.lines_trimmed,
+      compact_ms,
+      editor->page->arena->live_bytes);
+
+  free (latencies.ms);
+  free_editor (editor);
+  return 0;
+}